@@ -10,8 +10,11 @@
 #include "ir.h"
 #include "lib.h"
 #include "operand.h"
+#include "option.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 
 
@@ -24,27 +27,57 @@ Operand curr_func = NULL;
 
 int nr_arg = 0;  // The number of arguments have been encounterded, referred when translating call
 
+int nr_param = 0;  // The number of parameters have been encountered in the current function
+
 
 void gen_asm_label(IR *ir)
 {
-    fprintf(asm_file, "%s:\n", print_operand(ir->rs));
+    mips_label(print_operand(ir->rs), false);
+}
+
+
+//
+// Frame layout, from high to low address:
+//   parameters (in the caller's frame), $ra if the function calls others,
+//   variables and temporaries, callee-saved registers the function uses.
+//
+
+static int nr_saved_regs(Operand func)
+{
+    int count = 0;
+    for (int i = S0; i <= S7; i++) {
+        if (func->saved_regs & (1u << i)) {
+            count++;
+        }
+    }
+    return count;
 }
 
 
 void gen_asm_func(IR *ir)
 {
-    fprintf(asm_file, "%s:\n", print_operand(ir->rs));
+    mips_label(print_operand(ir->rs), true);
     // Spare stack space
     curr_func = ir->rs;
-    sp_offset = curr_func->size;
+    sp_offset = curr_func->size + 4 * nr_saved_regs(curr_func);
+    nr_param = 0;
 
     int ra = curr_func->has_subroutine ? 4 : 0;
 
-    emit_asm(addi, "$sp, $sp, %d  # only for variables, not records", -ir->rs->size - ra);
+    // A leaf function keeping everything in registers needs no frame
+    if (sp_offset + ra) {
+        emit_asm(addi, "$sp, $sp, %d  # only for variables, not records", -sp_offset - ra);
+    }
 
     if (curr_func->has_subroutine) {
         emit_asm(sw, "$ra, %d($sp)  # Save return address", sp_offset);
     }
+
+    for (int i = S0, slot = 0; i <= S7; i++) {
+        if (curr_func->saved_regs & (1u << i)) {
+            emit_asm(sw, "%s, %d($sp)  # Save callee-saved register", reg_to_s(i), 4 * slot++);
+        }
+    }
 }
 
 
@@ -53,34 +86,41 @@ void gen_asm_assign(IR *ir)
     int src = ensure(ir->rs);
     int dst = allocate(ir->rd);
     set_dirty(dst);
-    emit_asm(move, "%s, %s", reg_to_s(dst), reg_to_s(src));
+    if (dst != src) {  // Coalesced by the register allocator
+        emit_asm(move, "%s, %s", reg_to_s(dst), reg_to_s(src));
+    }
 }
 
 
+//
+// add, addi and sub trap on overflow. An instruction moved where it may run although the
+// source does not run it (IR::wraps) uses addu, addiu and subu instead.
+//
+
 // ir->rt should be OPE_INTEGER
-void gen_asm_addi(Operand dst, Operand src, int imm)
+void gen_asm_addi(Operand dst, Operand src, int imm, bool wraps)
 {
     int first = ensure(src);
     int dest = allocate(dst);
     set_dirty(dest);
-    emit_asm(addi, "%s, %s, %d", reg_to_s(dest), reg_to_s(first), imm);
+    mips_emit(wraps ? "addiu" : "addi", "%s, %s, %d", reg_to_s(dest), reg_to_s(first), imm);
 }
 
 
 void gen_asm_add(IR *ir)
 {
     if (ir->rt->type == OPE_INTEGER) {
-        gen_asm_addi(ir->rd, ir->rs, ir->rt->integer);
+        gen_asm_addi(ir->rd, ir->rs, ir->rt->integer, ir->wraps);
     }
     else if (ir->rs->type == OPE_INTEGER) {
-        gen_asm_addi(ir->rd, ir->rt, ir->rs->integer);
+        gen_asm_addi(ir->rd, ir->rt, ir->rs->integer, ir->wraps);
     }
     else {
         int first = ensure(ir->rs);
         int second = ensure(ir->rt);
         int dst = allocate(ir->rd);
         set_dirty(dst);
-        emit_asm(add, "%s, %s, %s", reg_to_s(dst), reg_to_s(first), reg_to_s(second));
+        mips_emit(ir->wraps ? "addu" : "add", "%s, %s, %s", reg_to_s(dst), reg_to_s(first), reg_to_s(second));
     }
 }
 
@@ -90,20 +130,144 @@ void gen_asm_sub(IR *ir)
     // Note, sub cannot exchange!
 
     if (ir->rt->type == OPE_INTEGER) {
-        gen_asm_addi(ir->rd, ir->rs, -ir->rt->integer);
+        gen_asm_addi(ir->rd, ir->rs, -ir->rt->integer, ir->wraps);
     }
     else {
         int first = ensure(ir->rs);
         int second = ensure(ir->rt);
         int dst = allocate(ir->rd);
         set_dirty(dst);
-        emit_asm(sub, "%s, %s, %s", reg_to_s(dst), reg_to_s(first), reg_to_s(second));
+        mips_emit(ir->wraps ? "subu" : "sub", "%s, %s, %s", reg_to_s(dst), reg_to_s(first), reg_to_s(second));
+    }
+}
+
+
+//
+// Multiplication and division by a constant
+//
+// From -O1 on, a product or a quotient with an integer operand avoids mul and div:
+//
+//   x := y * 8           sll   x, y, 3
+//   x := y * 10          sll   $at, y, 3;  sll x, y, 1;  addu x, x, $at
+//   x := y * -7          sll   $at, y, 3;  subu x, $at, y;  subu x, $zero, x
+//   x := y / 4           sra   $at, y, 31;  srl $at, $at, 30;  addu $at, y, $at;  sra x, $at, 2
+//   x := y / 7           li    $at, M;  mult y, $at;  mfhi $at;  addu $at, $at, y;  sra $at, $at, 2;
+//                        srl   x, y, 31;  addu x, $at, x
+//
+// A product takes at most MAX_SHIFT_ADD instructions, otherwise mul is kept. A quotient
+// rounds toward zero as div does: a negative dividend is biased by 2^k - 1 before the shift,
+// and the magic number quotient (Hacker's Delight, 10-4) is incremented when negative.
+// $at is never allocated, so it holds the intermediate values; x may be y, so y is read
+// before x is written.
+//
+
+#define MAX_SHIFT_ADD 3
+
+
+// k if u is 2^k, -1 otherwise
+static int log2_exact(uint32_t u)
+{
+    if (u == 0 || (u & (u - 1)) != 0) {
+        return -1;
+    }
+    int k = 0;
+    while (u >>= 1) {
+        k++;
+    }
+    return k;
+}
+
+
+//
+// Decompose |c| as 2^a + sign * 2^b, sign being 0 if |c| is a power of two,
+// return the number of instructions of the product, or INT_MAX if there is none
+//
+static int decompose_mul(int c, int *a, int *b, int *sign)
+{
+    uint32_t m = c < 0 ? -(uint32_t)c : (uint32_t)c;
+    uint32_t low = m & -m;
+    int neg = c < 0 ? 1 : 0;
+
+    *b = log2_exact(low);
+    if ((*a = log2_exact(m)) != -1) {
+        *sign = 0;
+        return 1 + neg;
+    }
+    if ((*a = log2_exact(m - low)) != -1) {
+        *sign = 1;
+    }
+    else if (m + low != 0 && (*a = log2_exact(m + low)) != -1) {
+        *sign = -1;
+    }
+    else {
+        return INT_MAX;
+    }
+    return (*b == 0 ? 2 : 3) + neg;
+}
+
+
+static bool gen_mul_const(Operand dst, Operand src, int c)
+{
+    int a, b, sign;
+    if (c != 0 && decompose_mul(c, &a, &b, &sign) > MAX_SHIFT_ADD) {
+        return false;
+    }
+
+    int y = ensure(src);
+    int x = allocate(dst);
+    set_dirty(x);
+    const char *rx = reg_to_s(x), *ry = reg_to_s(y);
+
+    if (c == 0) {
+        emit_asm(li, "%s, 0", rx);
+        return true;
+    }
+    if (sign == 0) {
+        if (a == 0) {
+            emit_asm(move, "%s, %s", rx, ry);
+        }
+        else {
+            emit_asm(sll, "%s, %s, %d", rx, ry, a);
+        }
     }
+    else {
+        emit_asm(sll, "$at, %s, %d", ry, a);
+        if (b == 0) {
+            if (sign > 0) {
+                emit_asm(addu, "%s, $at, %s", rx, ry);
+            }
+            else {
+                emit_asm(subu, "%s, $at, %s", rx, ry);
+            }
+        }
+        else {
+            emit_asm(sll, "%s, %s, %d", rx, ry, b);
+            if (sign > 0) {
+                emit_asm(addu, "%s, %s, $at", rx, rx);
+            }
+            else {
+                emit_asm(subu, "%s, $at, %s", rx, rx);
+            }
+        }
+    }
+    if (c < 0) {
+        emit_asm(subu, "%s, $zero, %s", rx, rx);
+    }
+    return true;
 }
 
 
 void gen_asm_mul(IR *ir)
 {
+    if (opt_level >= 1 && ir->rs->type != OPE_INTEGER && ir->rt->type == OPE_INTEGER &&
+            gen_mul_const(ir->rd, ir->rs, ir->rt->integer)) {
+        return;
+    }
+    if (opt_level >= 1 && ir->rt->type != OPE_INTEGER && ir->rs->type == OPE_INTEGER &&
+            gen_mul_const(ir->rd, ir->rt, ir->rs->integer)) {
+        return;
+    }
+
     int y = ensure(ir->rs);
     int z = ensure(ir->rt);
     int x = allocate(ir->rd);
@@ -112,8 +276,110 @@ void gen_asm_mul(IR *ir)
 }
 
 
+//
+// The magic number M and the shift s of the signed division by d, 2 <= |d| < 2^31,
+// so that n / d is the high word of M * n (+ n if d > 0 and M < 0, - n if d < 0 and M > 0)
+// shifted right by s, plus one if it is negative
+//
+static void magic_div(int d, int *m, int *s)
+{
+    const uint32_t two31 = 0x80000000u;
+    uint32_t ad = d < 0 ? -(uint32_t)d : (uint32_t)d;
+    uint32_t t = two31 + ((uint32_t)d >> 31);
+    uint32_t anc = t - 1 - t % ad;  // |nc|
+    uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+    uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+    uint32_t delta;
+    int p = 31;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *m = (int)(q2 + 1);
+    if (d < 0) {
+        *m = -*m;
+    }
+    *s = p - 32;
+}
+
+
+static void gen_div_const(Operand dst, Operand src, int d)
+{
+    int y = ensure(src);
+    int x = allocate(dst);
+    set_dirty(x);
+    const char *rx = reg_to_s(x), *ry = reg_to_s(y);
+
+    if (d == 1 || d == -1) {
+        if (d == 1) {
+            emit_asm(move, "%s, %s", rx, ry);
+        }
+        else {
+            emit_asm(subu, "%s, $zero, %s", rx, ry);
+        }
+        return;
+    }
+
+    int k = log2_exact(d < 0 ? -(uint32_t)d : (uint32_t)d);
+    if (k != -1) {
+        // Bias a negative dividend by 2^k - 1
+        if (k == 1) {
+            emit_asm(srl, "$at, %s, 31", ry);
+        }
+        else {
+            emit_asm(sra, "$at, %s, 31", ry);
+            emit_asm(srl, "$at, $at, %d", 32 - k);
+        }
+        emit_asm(addu, "$at, %s, $at", ry);
+        emit_asm(sra, "%s, $at, %d", rx, k);
+        if (d < 0) {
+            emit_asm(subu, "%s, $zero, %s", rx, rx);
+        }
+        return;
+    }
+
+    int m, s;
+    magic_div(d, &m, &s);
+    emit_asm(li, "$at, %d", m);
+    emit_asm(mult, "%s, $at", ry);
+    emit_asm(mfhi, "$at");
+    if (d > 0 && m < 0) {
+        emit_asm(addu, "$at, $at, %s", ry);
+    }
+    else if (d < 0 && m > 0) {
+        emit_asm(subu, "$at, $at, %s", ry);
+    }
+    if (s > 0) {
+        emit_asm(sra, "$at, $at, %d", s);
+    }
+    // Round toward zero, the quotient is negative if the sign of n is not the sign of d
+    emit_asm(srl, "%s, %s, 31", rx, d > 0 ? ry : "$at");
+    emit_asm(addu, "%s, $at, %s", rx, rx);
+}
+
+
 void gen_asm_div(IR *ir)
 {
+    // Division by 0 and by INT_MIN are left to div
+    if (opt_level >= 1 && ir->rs->type != OPE_INTEGER && ir->rt->type == OPE_INTEGER &&
+            ir->rt->integer != 0 && ir->rt->integer != INT_MIN) {
+        gen_div_const(ir->rd, ir->rs, ir->rt->integer);
+        return;
+    }
+
     int y = ensure(ir->rs);
     int z = ensure(ir->rt);
     int x = allocate(ir->rd);
@@ -152,21 +418,103 @@ void gen_asm_arg(IR *ir)  // Not really emit code, but update the state.
 }
 
 
+//
+// Move src[i] to dst[i] for all i at the same time, a source may be another move's destination.
+// Cycles are broken through $at, which is never allocated, as $v1 may hold another source.
+//
+
+static void parallel_move(int dst[], int src[], int n)
+{
+    bool done[NR_ARG_REG];
+    int left = 0;
+
+    for (int i = 0; i < n; i++) {
+        done[i] = dst[i] == src[i];
+        left += !done[i];
+    }
+
+    while (left > 0) {
+        bool progress = false;
+
+        for (int i = 0; i < n; i++) {
+            bool blocked = done[i];
+            for (int j = 0; j < n && !blocked; j++) {
+                blocked = !done[j] && j != i && src[j] == dst[i];
+            }
+            if (!blocked) {
+                emit_asm(move, "%s, %s", reg_to_s(dst[i]), reg_to_s(src[i]));
+                done[i] = true;
+                left--;
+                progress = true;
+            }
+        }
+
+        if (!progress) {  // Only cycles are left
+            int i = 0;
+            while (done[i]) i++;
+            int cycle = src[i];
+            emit_asm(move, "$at, %s", reg_to_s(cycle));
+            for (int j = 0; j < n; j++) {
+                if (!done[j] && src[j] == cycle) {
+                    src[j] = AT;
+                }
+            }
+        }
+    }
+}
+
+
+//
+// A call whose result is returned at once jumps to the callee after releasing the frame,
+// and the callee returns to our caller. The arguments must all be passed in registers,
+// since the stack arguments would be in the frame released, and no address into the frame
+// may be passed.
+//
+
+static bool is_tail_call(IR *ir)
+{
+    if (opt_level < 1 || ir->type != IR_CALL || curr_func->takes_address) {
+        return false;
+    }
+    if (profile_generate != NULL && !strcmp(curr_func->name, "main")) {
+        return false;  // Returns through _prof_dump
+    }
+
+    int nr = 0;
+    for (IR *arg = ir - 1; arg >= instr_buffer && arg->type != IR_CALL && arg->type != IR_FUNC; arg--) {
+        nr += arg->type == IR_ARG;
+    }
+
+    IR *next = ir + 1;
+    while (next < instr_buffer + nr_instr && next->type == IR_NOP) {
+        next++;
+    }
+    return nr <= NR_ARG_REG && next < instr_buffer + nr_instr && next->type == IR_RET && next->rs == ir->rd;
+}
+
+
+static void emit_epilogue();
+
+
+//
+// The first NR_ARG_REG arguments are passed in $a0-$a3, the others on the stack.
+//
+
 void gen_asm_call(IR *ir)
 {
-    // Open space for used save registers and arguments
+    // Open space for arguments passed on the stack
 
-    int offset = nr_arg * 4;
-    emit_asm(addi, "$sp, $sp, -%d  # Open space for save and arguments", offset);
+    int offset = nr_arg > NR_ARG_REG ? (nr_arg - NR_ARG_REG) * 4 : 0;
+    if (offset) {
+        emit_asm(addi, "$sp, $sp, -%d  # Open space for arguments", offset);
+    }
 
     sp_offset += offset;
 
-    push_all();
-
     IR *arg = ir;  // IR is stored consecutively
 
+    Operand reg_arg[NR_ARG_REG];
 
-    // Push all arguments onto stack, which is more like x86 ;-)
     for (int i = 1; i <= nr_arg; i++) {
 
         do { arg--; } while (arg->type != IR_ARG);  // ARG may not be consecutive,
@@ -175,23 +523,70 @@ void gen_asm_call(IR *ir)
                                                     // It is expected that there always have enough
                                                     // ARG IRs that match [nr_arg]
 
-        int y = ensure(arg->rs);
-        emit_asm(sw, "%s, %d($sp)", reg_to_s(y), (i - 1) * 4);
+        if (i <= NR_ARG_REG) {
+            reg_arg[i - 1] = arg->rs;
+            continue;
+        }
+
+        // Loaded through $at: allocating a register could evict an argument of $a0-$a3
+        // not moved yet, whose value is dead after its ARG and would not be written back
+        int y = lookup(arg->rs);
+        if (y == 0) {
+            y = AT;
+            load_value(AT, arg->rs);
+        }
+        emit_asm(sw, "%s, %d($sp)", reg_to_s(y), (i - 1 - NR_ARG_REG) * 4);
+    }
+
+    // Values in $s0-$s7 survive the call, the others are written back only if still needed
+    push_caller_saved();
+
+    // Arguments already in registers are moved into place, then the others are loaded directly
+
+    int nr_reg_arg = nr_arg < NR_ARG_REG ? nr_arg : NR_ARG_REG;
+    int dst[NR_ARG_REG], src[NR_ARG_REG], n = 0;
+    bool in_reg[NR_ARG_REG];
+
+    for (int i = 0; i < nr_reg_arg; i++) {
+        int reg = lookup(reg_arg[i]);
+        in_reg[i] = reg != 0;
+        if (in_reg[i]) {
+            dst[n] = A0 + i;
+            src[n] = reg;
+            n++;
+        }
+    }
+
+    parallel_move(dst, src, n);
+
+    for (int i = 0; i < nr_reg_arg; i++) {
+        if (!in_reg[i]) {
+            load_value(A0 + i, reg_arg[i]);
+        }
+    }
 
+    if (is_tail_call(ir)) {
+        emit_epilogue();
+        emit_asm(j, "%s", ir->rs->name);
+        clear_caller_saved();
+        nr_arg = 0;
+        return;
     }
 
     emit_asm(jal, "%s", ir->rs->name);
 
-    clear_reg_state();
+    clear_caller_saved();
 
     int x = allocate(ir->rd);
     set_dirty(x);
 
-    if (ir->rd->next_use != MAX_LINE || ir->rd->liveness) {
+    if ((ir->rd->next_use != MAX_LINE || ir->rd->liveness) && x != V0) {
         emit_asm(move, "%s, $v0", reg_to_s(x));
     }
 
-    emit_asm(addiu, "$sp, $sp, %d  # Drawback save and arguments space", offset);
+    if (offset) {
+        emit_asm(addiu, "$sp, $sp, %d  # Drawback arguments space", offset);
+    }
 
     sp_offset -= offset;
 
@@ -204,32 +599,174 @@ void gen_asm_call(IR *ir)
 // Now we know whether the function has saved return address
 // So we can fix the address of parameters.
 //
+// The first NR_ARG_REG parameters arrive in $a0-$a3 and have their slots in the callee's frame.
+//
 
 void gen_asm_param(IR *ir)
 {
-    if (curr_func->has_subroutine) {
-        ir->rs->address -= 4;
+    int index = nr_param++;
+
+    if (index >= NR_ARG_REG) {
+        if (curr_func->has_subroutine) {
+            ir->rs->address -= 4;
+        }
+
+        // A colored parameter lives in its register from the entry on
+        if (ir->rs->color) {
+            emit_asm(lw, "%s, %d($sp)  # load parameter %s", reg_to_s(ir->rs->color),
+                     sp_offset - ir->rs->address, print_operand(ir->rs));
+        }
+        return;
+    }
+
+    int reg = A0 + index;
+
+    if (ir->rs->color) {
+        if (ir->rs->color != reg) {
+            emit_asm(move, "%s, %s  # parameter %s", reg_to_s(ir->rs->color), reg_to_s(reg), print_operand(ir->rs));
+        }
+    }
+    else if (opt_level >= 2) {
+        emit_asm(sw, "%s, %d($sp)  # parameter %s", reg_to_s(reg), sp_offset - ir->rs->address, print_operand(ir->rs));
+    }
+    else {
+        bind_reg(reg, ir->rs);  // Written back when the register is needed, or at the end of the block
     }
 }
 
 
-void gen_asm_return(IR *ir)
+static void emit_epilogue()
 {
     if (curr_func->has_subroutine) {
         emit_asm(lw, "$ra, %d($sp)  # retrieve return address", sp_offset);
     }
-    
-    int x = ensure(ir->rs);
 
-    int size = curr_func->has_subroutine ? curr_func->size + 4 : curr_func->size;
-    emit_asm(addiu, "$sp, $sp, %d  # release stack space", size);
-    emit_asm(move, "$v0, %s  # prepare return value", reg_to_s(x));
-    emit_asm(jr, "$ra");
+    for (int i = S0, slot = 0; i <= S7; i++) {
+        if (curr_func->saved_regs & (1u << i)) {
+            emit_asm(lw, "%s, %d($sp)  # Restore callee-saved register", reg_to_s(i), 4 * slot++);
+        }
+    }
+
+    int size = curr_func->has_subroutine ? sp_offset + 4 : sp_offset;
+    if (size) {
+        emit_asm(addiu, "$sp, $sp, %d  # release stack space", size);
+    }
+}
+
+
+void gen_asm_return(IR *ir)
+{
+    IR *prev = ir - 1;
+    while (prev > instr_buffer && prev->type == IR_NOP) {
+        prev--;
+    }
+    if (is_tail_call(prev)) {
+        return;  // The callee returns to our caller
+    }
+
+    if (opt_level >= 1 && ir->rs->type == OPE_INTEGER) {
+        load_value(V0, ir->rs);
+    }
+    else {
+        int x = ensure(ir->rs);
+        if (x != V0) {
+            emit_asm(move, "$v0, %s  # prepare return value", reg_to_s(x));
+        }
+    }
+
+    emit_epilogue();
+    if (profile_generate != NULL && !strcmp(curr_func->name, "main")) {
+        emit_asm(j, "_prof_dump");  // Writes the counters and returns, see profile.c
+    }
+    else {
+        emit_asm(jr, "$ra");
+    }
+}
+
+
+//
+// From -O1 on, a comparison with a constant keeps the constant out of the registers:
+//
+//   IF x > #0 GOTO L1      bgtz  x, L1
+//   IF #0 == x GOTO L1     beqz  x, L1
+//   IF x < #10 GOTO L1     slti  $at, x, 10;  bnez $at, L1
+//   IF x > #10 GOTO L1     slti  $at, x, 11;  beqz $at, L1
+//   IF x == #10 GOTO L1    li    $at, 10;  beq x, $at, L1
+//
+// A constant on the left is swapped to the right first. Constants out of the 16-bit
+// immediates are loaded into a register as usual.
+//
+
+// x op y is y op' x
+static IR_Type swap_relop(IR_Type relop)
+{
+    switch (relop) {
+        case IR_BGT: return IR_BLT;
+        case IR_BLT: return IR_BGT;
+        case IR_BGE: return IR_BLE;
+        case IR_BLE: return IR_BGE;
+        default:     return relop;
+    }
+}
+
+
+static bool gen_br_const(IR_Type relop, Operand lhs, int c, const char *label)
+{
+    static const char *zero_branch[NR_IR_TYPE] = {
+        [IR_BEQ] = "beqz", [IR_BNE] = "bnez", [IR_BGT] = "bgtz",
+        [IR_BLT] = "bltz", [IR_BGE] = "bgez", [IR_BLE] = "blez",
+    };
+
+    if (c == 0) {
+        int x = ensure(lhs);
+        mips_emit(zero_branch[relop], "%s, %s", reg_to_s(x), label);
+        return true;
+    }
+
+    // x <= c is x < c + 1, x > c is not x < c + 1
+    int bound = relop == IR_BLE || relop == IR_BGT ? c + 1 : c;
+    if (!IS_IMM16(c) || !IS_IMM16(bound)) {
+        return false;
+    }
+
+    int x = ensure(lhs);
+    switch (relop) {
+        case IR_BEQ:
+            emit_asm(li, "$at, %d", c);
+            emit_asm(beq, "%s, $at, %s", reg_to_s(x), label);
+            break;
+        case IR_BNE:
+            emit_asm(li, "$at, %d", c);
+            emit_asm(bne, "%s, $at, %s", reg_to_s(x), label);
+            break;
+        case IR_BLT:
+        case IR_BLE:
+            emit_asm(slti, "$at, %s, %d", reg_to_s(x), bound);
+            emit_asm(bnez, "$at, %s", label);
+            break;
+        case IR_BGE:
+        case IR_BGT:
+            emit_asm(slti, "$at, %s, %d", reg_to_s(x), bound);
+            emit_asm(beqz, "$at, %s", label);
+            break;
+        default:
+            assert(0);
+    }
+    return true;
 }
 
 
 void gen_asm_br(IR *ir)
 {
+    if (opt_level >= 1 && ir->rs->type != OPE_INTEGER && ir->rt->type == OPE_INTEGER &&
+            gen_br_const(ir->type, ir->rs, ir->rt->integer, print_operand(ir->rd))) {
+        return;
+    }
+    if (opt_level >= 1 && ir->rt->type != OPE_INTEGER && ir->rs->type == OPE_INTEGER &&
+            gen_br_const(swap_relop(ir->type), ir->rt, ir->rs->integer, print_operand(ir->rd))) {
+        return;
+    }
+
     int x = ensure(ir->rs);
     int y = ensure(ir->rt);
     switch (ir->type) {
@@ -244,6 +781,123 @@ void gen_asm_br(IR *ir)
 }
 
 
+//
+// A comparison used as a value is computed without branches, as 0 or 1:
+//
+//   x := y < z             slt   x, y, z
+//   x := y >= z            slt   x, y, z;  xori x, x, 1
+//   x := y > z             slt   x, z, y
+//   x := y == z            xor   x, y, z;  sltiu x, x, 1
+//   x := y != z            xor   x, y, z;  sltu x, $zero, x
+//
+// From -O1 on, a constant operand goes into the immediate as for the branches above:
+//
+//   x := y > #10           slti  x, y, 11;  xori x, x, 1
+//   x := y == #0           sltiu x, y, 1
+//   x := y != #10          xori  x, y, 10;  sltu x, $zero, x
+//
+// The sources are only read by the first instruction, so x may be y or z.
+//
+
+static bool gen_compare_const(Operand dst, IR_Type relop, Operand lhs, int c)
+{
+    bool less = relop == IR_BLT || relop == IR_BGE;
+    bool greater = relop == IR_BLE || relop == IR_BGT;
+    bool equal = relop == IR_BEQ || relop == IR_BNE;
+    if ((less && !IS_IMM16(c)) || (greater && (!IS_IMM16(c) || !IS_IMM16(c + 1))) ||
+            (equal && !(0 <= c && c <= 0xffff))) {
+        return false;
+    }
+
+    int x = ensure(lhs);
+    int d = allocate(dst);
+    set_dirty(d);
+    const char *xs = reg_to_s(x), *ds = reg_to_s(d);
+    switch (relop) {
+        case IR_BLT:
+        case IR_BLE:
+            emit_asm(slti, "%s, %s, %d", ds, xs, relop == IR_BLE ? c + 1 : c);
+            break;
+        case IR_BGE:
+        case IR_BGT:
+            emit_asm(slti, "%s, %s, %d", ds, xs, relop == IR_BGT ? c + 1 : c);
+            emit_asm(xori, "%s, %s, 1", ds, ds);
+            break;
+        case IR_BEQ:
+            if (c != 0) {
+                emit_asm(xori, "%s, %s, %d", ds, xs, c);
+                xs = ds;
+            }
+            emit_asm(sltiu, "%s, %s, 1", ds, xs);
+            break;
+        case IR_BNE:
+            if (c != 0) {
+                emit_asm(xori, "%s, %s, %d", ds, xs, c);
+                xs = ds;
+            }
+            emit_asm(sltu, "%s, $zero, %s", ds, xs);
+            break;
+        default:
+            assert(0);
+    }
+    return true;
+}
+
+
+void gen_asm_compare(IR *ir)
+{
+    IR_Type relop = compare_to_branch(ir->type);
+    Operand lhs = ir->rs, rhs = ir->rt;
+    if (lhs->type == OPE_INTEGER && rhs->type != OPE_INTEGER) {
+        relop = swap_relop(relop);
+        lhs = ir->rt;
+        rhs = ir->rs;
+    }
+    if (opt_level >= 1 && rhs->type == OPE_INTEGER && lhs->type != OPE_INTEGER &&
+            gen_compare_const(ir->rd, relop, lhs, rhs->integer)) {
+        return;
+    }
+
+    int x = ensure(lhs);
+    int y = ensure(rhs);
+    int d = allocate(ir->rd);
+    set_dirty(d);
+    const char *xs = reg_to_s(x), *ys = reg_to_s(y), *ds = reg_to_s(d);
+    switch (relop) {
+        case IR_BLT: emit_asm(slt, "%s, %s, %s", ds, xs, ys); break;
+        case IR_BGT: emit_asm(slt, "%s, %s, %s", ds, ys, xs); break;
+        case IR_BGE:
+            emit_asm(slt, "%s, %s, %s", ds, xs, ys);
+            emit_asm(xori, "%s, %s, 1", ds, ds);
+            break;
+        case IR_BLE:
+            emit_asm(slt, "%s, %s, %s", ds, ys, xs);
+            emit_asm(xori, "%s, %s, 1", ds, ds);
+            break;
+        case IR_BEQ:
+            emit_asm(xor, "%s, %s, %s", ds, xs, ys);
+            emit_asm(sltiu, "%s, %s, 1", ds, ds);
+            break;
+        case IR_BNE:
+            emit_asm(xor, "%s, %s, %s", ds, xs, ys);
+            emit_asm(sltu, "%s, $zero, %s", ds, ds);
+            break;
+        default: assert(0);
+    }
+}
+
+
+// x := y IF t != #0 keeps x otherwise, so x is read as well
+void gen_asm_movn(IR *ir)
+{
+    int src = ensure(ir->rs);
+    int cond = ensure(ir->rt);
+    int dst = ensure(ir->rd);
+    set_dirty(dst);
+    emit_asm(movn, "%s, %s, %s", reg_to_s(dst), reg_to_s(src), reg_to_s(cond));
+}
+
+
 void gen_asm_dec(IR *ir)
 {
     return;
@@ -260,18 +914,30 @@ void gen_asm_addr(IR *ir)
 
 void gen_asm_write(IR *ir)
 {
-    int x = ensure(ir->rs);
-    emit_asm(move, "$a0, %s", reg_to_s(x));
+    if (opt_level >= 1 && ir->rs->type == OPE_INTEGER) {
+        spill_reg(A0);
+        load_value(A0, ir->rs);
+    }
+    else {
+        int x = ensure(ir->rs);
+        spill_reg(A0);
+        if (x != A0) {
+            emit_asm(move, "$a0, %s", reg_to_s(x));
+        }
+    }
     emit_asm(jal, "write");
 }
 
 
 void gen_asm_read(IR *ir)
 {
+    spill_reg(A0);
     int x = allocate(ir->rd);
     set_dirty(x);
     emit_asm(jal, "read");
-    emit_asm(move, "%s, $v0", reg_to_s(x));
+    if (x != V0) {
+        emit_asm(move, "%s, $v0", reg_to_s(x));
+    }
 }
 
 
@@ -301,12 +967,20 @@ trans_handler handler[NR_IR_TYPE] = {
     [IR_BGT]     = gen_asm_br,
     [IR_BGE]     = gen_asm_br,
     [IR_BNE]     = gen_asm_br,
-    [IR_BLT]     = gen_asm_br
+    [IR_BLT]     = gen_asm_br,
+    [IR_SEQ]     = gen_asm_compare,
+    [IR_SLT]     = gen_asm_compare,
+    [IR_SLE]     = gen_asm_compare,
+    [IR_SGT]     = gen_asm_compare,
+    [IR_SGE]     = gen_asm_compare,
+    [IR_SNE]     = gen_asm_compare,
+    [IR_MOVN]    = gen_asm_movn
 };
 
 void gen_asm(IR *ir)
 {
-    fprintf(asm_file, "# %s\n", ir_to_s(ir));
+    mips_comment("# %s", ir_to_s(ir));
+    unpin_all();
     handler[ir->type](ir);
 }
 
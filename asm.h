@@ -6,6 +6,7 @@
 #define NJU_COMPILER_2015_ASM_H
 
 #include "ir.h"
+#include "mips.h"
 #include "stdio.h"
 
 void gen_asm(IR *ir);
@@ -18,8 +19,8 @@ extern Operand curr_func;
 
 extern int sp_offset;
 
-// Common asm print format
+// Append an instruction to the code list, see mips.h
 #define emit_asm(instr, format, ...) \
-    fprintf(asm_file, "  %-*s" format "\n", 7, str(instr), ## __VA_ARGS__)
+    mips_emit(str(instr), format, ## __VA_ARGS__)
 
 #endif //NJU_COMPILER_2015_ASM_H
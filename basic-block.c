@@ -113,6 +113,18 @@ void construct_cfg(Block block[], int nr_block, IR instr[], int nr_instr)
     }
 }
 
+//
+// 函数由 FUNCTION 开头的连续基本块组成, 返回从 first 开始的函数的结束块(不可取)
+//
+int func_block_end(Block block[], int nr_block, IR instr[], int first)
+{
+    int end = first + 1;
+    while (end < nr_block && instr[block[end].start].type != IR_FUNC) {
+        end++;
+    }
+    return end;
+}
+
 void cfg_to_dot(const char *filename, Block block[], int nr_block)
 {
     FILE *fp = fopen(filename, "w");
@@ -20,12 +20,17 @@ typedef struct Block {
     };
 } Block;
 
+extern Block blk_buf[];
+extern int nr_blk;
+
 void reset_block(Block block[], int nr_block);
 
 int block_partition(Block block[], IR instr[], int n);
 
 void construct_cfg(Block block[], int nr_block, IR instr[], int nr_instr);
 
+int func_block_end(Block block[], int nr_block, IR instr[], int first);
+
 void cfg_to_dot(const char *filename, Block block[], int nr_block);
 
 #endif //NJU_COMPILER_2015_BASIC_BLOCK_H
@@ -0,0 +1,18 @@
+#!/usr/bin/env bash
+
+# Estimated pipeline stall cycles of each test before and after the instruction scheduling,
+# e.g. ./bench.sh -flatency=lw:3
+
+TESTCASE=$(find ./test/ -name "*.cmm" | sort)
+ASM="./tmp.S"
+
+for file in $TESTCASE; do
+    stats=$(./cmm -O2 -fstats "$@" $file $ASM 2>&1 | grep "^schedule:")
+    if [ $? -ne 0 ]; then
+        echo "$file: compilation failed."
+        continue
+    fi
+    echo "$file: ${stats#schedule: }"
+done
+
+rm -f $ASM
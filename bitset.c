@@ -0,0 +1,129 @@
+//
+// Fixed size bit set used by the data flow analyses
+//
+
+#include "bitset.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+#define WORD_BITS ((int)(8 * sizeof(unsigned)))
+
+
+Bitset new_bitset(int size)
+{
+    Bitset set = NEW(struct Bitset_);
+    set->size = size;
+    set->nr_word = (size + WORD_BITS - 1) / WORD_BITS;
+    set->word = (unsigned *)calloc(set->nr_word ? set->nr_word : 1, sizeof(unsigned));
+    return set;
+}
+
+
+void free_bitset(Bitset set)
+{
+    if (set != NULL) {
+        free(set->word);
+        free(set);
+    }
+}
+
+
+void bs_set(Bitset set, int i)
+{
+    set->word[i / WORD_BITS] |= 1u << (i % WORD_BITS);
+}
+
+
+void bs_reset(Bitset set, int i)
+{
+    set->word[i / WORD_BITS] &= ~(1u << (i % WORD_BITS));
+}
+
+
+bool bs_test(Bitset set, int i)
+{
+    return (set->word[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+
+void bs_clear(Bitset set)
+{
+    memset(set->word, 0, set->nr_word * sizeof(unsigned));
+}
+
+
+void bs_fill(Bitset set)
+{
+    bs_clear(set);
+    for (int i = 0; i < set->size; i++) {
+        bs_set(set, i);
+    }
+}
+
+
+void bs_copy(Bitset dst, Bitset src)
+{
+    memcpy(dst->word, src->word, dst->nr_word * sizeof(unsigned));
+}
+
+
+//
+// dst |= src, return true if dst is changed
+//
+bool bs_union(Bitset dst, Bitset src)
+{
+    bool changed = false;
+    for (int i = 0; i < dst->nr_word; i++) {
+        unsigned w = dst->word[i] | src->word[i];
+        if (w != dst->word[i]) {
+            dst->word[i] = w;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+
+//
+// dst &= src, return true if dst is changed
+//
+bool bs_intersect(Bitset dst, Bitset src)
+{
+    bool changed = false;
+    for (int i = 0; i < dst->nr_word; i++) {
+        unsigned w = dst->word[i] & src->word[i];
+        if (w != dst->word[i]) {
+            dst->word[i] = w;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+
+//
+// dst -= src
+//
+void bs_subtract(Bitset dst, Bitset src)
+{
+    for (int i = 0; i < dst->nr_word; i++) {
+        dst->word[i] &= ~src->word[i];
+    }
+}
+
+
+bool bs_equal(Bitset a, Bitset b)
+{
+    return !memcmp(a->word, b->word, a->nr_word * sizeof(unsigned));
+}
+
+
+int bs_count(Bitset set)
+{
+    int count = 0;
+    for (int i = 0; i < set->size; i++) {
+        count += bs_test(set, i);
+    }
+    return count;
+}
@@ -0,0 +1,44 @@
+//
+// Fixed size bit set used by the data flow analyses
+//
+
+#ifndef NJU_COMPILER_2015_BITSET_H
+#define NJU_COMPILER_2015_BITSET_H
+
+#include "lib.h"
+
+typedef struct Bitset_ *Bitset;
+
+struct Bitset_ {
+    int size;        // Number of bits
+    int nr_word;
+    unsigned *word;
+};
+
+Bitset new_bitset(int size);
+
+void free_bitset(Bitset set);
+
+void bs_set(Bitset set, int i);
+
+void bs_reset(Bitset set, int i);
+
+bool bs_test(Bitset set, int i);
+
+void bs_clear(Bitset set);
+
+void bs_fill(Bitset set);
+
+void bs_copy(Bitset dst, Bitset src);
+
+bool bs_union(Bitset dst, Bitset src);
+
+bool bs_intersect(Bitset dst, Bitset src);
+
+void bs_subtract(Bitset dst, Bitset src);
+
+bool bs_equal(Bitset a, Bitset b);
+
+int bs_count(Bitset set);
+
+#endif //NJU_COMPILER_2015_BITSET_H
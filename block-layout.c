@@ -0,0 +1,447 @@
+//
+// Placement of the basic blocks along the likely paths
+//
+// The blocks come out of the translation in the order of the source, so a while loop jumps
+// back to its test on every iteration, and the arms of an if/else jump over each other.
+// The blocks of each function are instead chained along the edges most likely taken,
+// the likeliest edges first: an edge joins two chains if it leaves the last block of one
+// and enters the first block of the other. The chain of the entry is placed first, then the
+// others in the order of their first blocks. A while loop is turned around this way, with
+// its test after the body:
+//
+//   LABEL L2 :                       GOTO L2
+//   IF v1 >= v2 GOTO L1              LABEL L9 :
+//   v3 := v3 + v1             =>     v3 := v3 + v1
+//   v1 := v1 + #1                    v1 := v1 + #1
+//   GOTO L2                          LABEL L2 :
+//   LABEL L1 :                       IF v1 < v2 GOTO L9
+//
+// Then a branch to the next block is inverted to fall into it and jump to the other one, a
+// jump to the next block is removed, and a block no longer followed by the one it falls into
+// jumps to it. LABELs are added to the blocks now jumped to, and those no longer jumped to
+// are removed.
+//
+// The frequency of an edge is the frequency of its block times the probability of the edge.
+// With -fprofile-use both are counted, see profile.c. Otherwise a block is taken to run
+// LOOP_WEIGHT times as often in each loop around it, a loop being the blocks between a jump
+// backwards and its target, and a branch is taken with the probability LIKELY if it jumps
+// backwards, or if the other edge leaves a loop the branch does not leave; 1 - LIKELY the
+// other way round, 1/2 otherwise. With a profile the blocks never run are placed last.
+//
+// The pass runs last on the intermediate code, and not on the instrumented one, whose blocks
+// must stay those of the profile.
+//
+
+#include "block-layout.h"
+#include "basic-block.h"
+#include "operand.h"
+#include "option.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+
+#define LOOP_WEIGHT 10
+#define MAX_DEPTH   6     // Deeper loops are not weighted more
+#define LIKELY      0.9
+
+
+typedef struct {
+    int src;
+    int dst;
+    double freq;
+    bool falls;   // The edge falls through in the original order
+} Edge;
+
+
+// The function being laid out, blocks are indexed from 0
+static int start;
+static int nr;
+static int *loop_head;    // Loop i is the blocks [loop_head[i], loop_tail[i]]
+static int *loop_tail;
+static int nr_loop;
+static int *next_of;      // The next block in its chain, -1 if last
+static int *prev_of;
+
+static IR *code;          // The code of the function laid out
+static int nr_code;
+static int nr_inverted;
+static int nr_removed;    // Jumps
+static int nr_added;
+
+
+static Block *block(int b)
+{
+    return &blk_buf[start + b];
+}
+
+
+static IR *last_instr(int b)
+{
+    return &instr_buffer[block(b)->end - 1];
+}
+
+
+static bool in_loop(int i, int b)
+{
+    return loop_head[i] <= b && b <= loop_tail[i];
+}
+
+
+static bool leaves_loop(int b, int succ)
+{
+    for (int i = 0; i < nr_loop; i++) {
+        if (in_loop(i, b) && !in_loop(i, succ)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void find_loops()
+{
+    nr_loop = 0;
+    for (int b = 0; b < nr; b++) {
+        Block *blk = block(b);
+        if (blk->branch != -1 && blk->branch - start <= b) {
+            loop_head[nr_loop] = blk->branch - start;
+            loop_tail[nr_loop] = b;
+            nr_loop++;
+        }
+    }
+}
+
+
+static double block_freq(int b)
+{
+    if (has_profile) {
+        return block_count(block(b));
+    }
+
+    double freq = 1;
+    int depth = 0;
+    for (int i = 0; i < nr_loop; i++) {
+        if (in_loop(i, b) && depth++ < MAX_DEPTH) {
+            freq *= LOOP_WEIGHT;
+        }
+    }
+    return freq;
+}
+
+
+// The probability the branch ending block b jumps to t instead of falling into f
+static double taken_probability(int b, int t, int f)
+{
+    if (has_profile) {
+        int count = block_count(block(b));
+        return count > 0 ? (double)last_instr(b)->taken / count : 0;
+    }
+    if (t <= b) {
+        return LIKELY;
+    }
+    if (leaves_loop(b, f) && !leaves_loop(b, t)) {
+        return LIKELY;
+    }
+    if (leaves_loop(b, t) && !leaves_loop(b, f)) {
+        return 1 - LIKELY;
+    }
+    return 0.5;
+}
+
+
+static void add_edge(Edge edge[], int *nr_edge, int src, int dst, double freq, bool falls)
+{
+    // An edge never taken in the profile does not move the blocks
+    if (freq > 0 || falls) {
+        edge[*nr_edge] = (Edge){ src, dst, freq, falls };
+        (*nr_edge)++;
+    }
+}
+
+
+static int cmp_edge(const void *a, const void *b)
+{
+    const Edge *x = (const Edge *)a, *y = (const Edge *)b;
+    if (x->freq != y->freq) {
+        return x->freq > y->freq ? -1 : 1;
+    }
+    if (x->falls != y->falls) {
+        return x->falls ? -1 : 1;
+    }
+    return x->src - y->src;
+}
+
+
+static int chain_head(int b)
+{
+    while (prev_of[b] != -1) {
+        b = prev_of[b];
+    }
+    return b;
+}
+
+
+static void build_chains()
+{
+    Edge *edge = (Edge *)malloc(sizeof(Edge) * 2 * nr);
+    int nr_edge = 0;
+    for (int b = 0; b < nr; b++) {
+        Block *blk = block(b);
+        if (blk->follow == -1) {
+            continue;
+        }
+        int f = blk->follow - start, t = blk->branch - start;
+        double freq = block_freq(b);
+        if (is_branch(last_instr(b)) && t != f) {
+            double p = taken_probability(b, t, f);
+            add_edge(edge, &nr_edge, b, t, freq * p, false);
+            add_edge(edge, &nr_edge, b, f, freq * (1 - p), true);
+        }
+        else {
+            add_edge(edge, &nr_edge, b, f, freq, last_instr(b)->type != IR_JMP);
+        }
+    }
+
+    qsort(edge, nr_edge, sizeof(Edge), cmp_edge);
+
+    for (int b = 0; b < nr; b++) {
+        next_of[b] = prev_of[b] = -1;
+    }
+    for (int i = 0; i < nr_edge; i++) {
+        int src = edge[i].src, dst = edge[i].dst;
+        if (dst != 0 && next_of[src] == -1 && prev_of[dst] == -1 && chain_head(src) != dst) {
+            next_of[src] = dst;
+            prev_of[dst] = src;
+        }
+    }
+    free(edge);
+}
+
+
+//
+// The chain of the entry first, then the others by their first blocks, the cold ones last
+//
+static void place_chains(int order[])
+{
+    int n = 0;
+    for (int cold = 0; cold < 2; cold++) {
+        for (int h = 0; h < nr; h++) {
+            bool is_cold = has_profile && h != 0 && block_count(block(h)) == 0;
+            if (prev_of[h] != -1 || is_cold != (bool)cold) {
+                continue;
+            }
+            for (int b = h; b != -1; b = next_of[b]) {
+                order[n++] = b;
+            }
+        }
+    }
+    assert(n == nr);
+}
+
+
+static void emit(IR ir)
+{
+    if (code != NULL) {
+        code[nr_code] = ir;
+    }
+    nr_code++;
+}
+
+
+//
+// The code of block b followed by block next, -1 if none. The blocks jumped to are marked in
+// need_label. label[x] is the LABEL of block x, NULL in the first run if it has none yet.
+//
+static void emit_block(int b, int next, Operand label[], bool need_label[])
+{
+    Block *blk = block(b);
+    IR *last = last_instr(b);
+
+    if (need_label[b] && instr_buffer[blk->start].type != IR_LABEL) {
+        emit((IR){ .type = IR_LABEL, .rs = label[b], .count = last->count });
+    }
+    for (int i = blk->start; i < blk->end - 1; i++) {
+        emit(instr_buffer[i]);
+    }
+
+    int f = blk->follow - start, t = blk->branch - start;
+    IR ir = *last;
+    if (blk->follow == -1) {
+        emit(ir);
+    }
+    else if (is_branch(last)) {
+        if (next == t && t != f) {
+            // Falls into the target instead, jumps to the block it fell into
+            ir.type = get_relop_anti(ir.type);
+            ir.rd = label[f];
+            ir.taken = ir.count - ir.taken;
+            need_label[f] = true;
+            nr_inverted += code != NULL;
+        }
+        else {
+            need_label[t] = true;
+        }
+        emit(ir);
+        if (next != f && next != t) {
+            emit((IR){ .type = IR_JMP, .rs = label[f], .count = last->count - last->taken });
+            need_label[f] = true;
+            nr_added += code != NULL;
+        }
+    }
+    else if (last->type == IR_JMP) {
+        if (next != f) {
+            emit(ir);
+            need_label[f] = true;
+        }
+        else {
+            nr_removed += code != NULL;
+        }
+    }
+    else {
+        emit(ir);
+        if (next != f) {
+            emit((IR){ .type = IR_JMP, .rs = label[f], .count = last->count });
+            need_label[f] = true;
+            nr_added += code != NULL;
+        }
+    }
+}
+
+
+//
+// Recount the references of the labels, and remove the LABELs not jumped to
+//
+static void remove_labels()
+{
+    for (int i = 0; i < nr_code; i++) {
+        if (code[i].type == IR_LABEL) {
+            code[i].rs->label_ref_cnt = 0;
+        }
+    }
+    for (int i = 0; i < nr_code; i++) {
+        if (is_branch(&code[i])) {
+            code[i].rd->label_ref_cnt++;
+        }
+        else if (code[i].type == IR_JMP) {
+            code[i].rs->label_ref_cnt++;
+        }
+    }
+    int n = 0;
+    for (int i = 0; i < nr_code; i++) {
+        if (code[i].type != IR_LABEL || code[i].rs->label_ref_cnt > 0) {
+            code[n++] = code[i];
+        }
+    }
+    nr_code = n;
+}
+
+
+//
+// Lay out the blocks [func, end), the code is appended to out
+//
+static void layout_function(int func, int end, IR out[], int *nr_out)
+{
+    start = func;
+    nr = end - func;
+    int first = blk_buf[func].start, last = blk_buf[end - 1].end;
+
+    // A function falling off its end into the next one is left as it is
+    bool ok = true;
+    for (int b = 0; b < nr; b++) {
+        Block *blk = block(b);
+        if (blk->follow != -1 && (blk->follow >= end || blk->branch >= end)) {
+            ok = false;
+        }
+    }
+
+    loop_head = (int *)malloc(sizeof(int) * nr);
+    loop_tail = (int *)malloc(sizeof(int) * nr);
+    next_of = (int *)malloc(sizeof(int) * nr);
+    prev_of = (int *)malloc(sizeof(int) * nr);
+    int *order = (int *)malloc(sizeof(int) * nr);
+
+    bool moved = false;
+    if (ok) {
+        find_loops();
+        build_chains();
+        place_chains(order);
+        for (int k = 0; k < nr; k++) {
+            moved = moved || order[k] != k;
+        }
+    }
+
+    if (!moved) {
+        memcpy(&out[*nr_out], &instr_buffer[first], sizeof(IR) * (last - first));
+        *nr_out += last - first;
+    }
+    else {
+        Operand *label = (Operand *)calloc(nr, sizeof(Operand));
+        bool *need_label = (bool *)calloc(nr, sizeof(bool));
+        for (int b = 0; b < nr; b++) {
+            IR *ir = &instr_buffer[block(b)->start];
+            label[b] = ir->type == IR_LABEL ? ir->rs : NULL;
+        }
+
+        // Find the blocks jumped to, then give them LABELs and emit the code
+        code = NULL;
+        nr_code = 0;
+        for (int k = 0; k < nr; k++) {
+            emit_block(order[k], k + 1 < nr ? order[k + 1] : -1, label, need_label);
+        }
+        for (int b = 0; b < nr; b++) {
+            if (need_label[b] && label[b] == NULL) {
+                label[b] = new_operand(OPE_LABEL);
+            }
+        }
+        code = &out[*nr_out];
+        nr_code = 0;
+        nr_inverted = nr_removed = nr_added = 0;
+        for (int k = 0; k < nr; k++) {
+            emit_block(order[k], k + 1 < nr ? order[k + 1] : -1, label, need_label);
+        }
+        remove_labels();
+
+        if (print_stats) {
+            fprintf(stderr, "layout: %s: %d blocks, %d jumps removed, %d added, %d branches inverted\n",
+                    instr_buffer[first].rs->name, nr, nr_removed, nr_added, nr_inverted);
+        }
+        *nr_out += nr_code;
+        code = NULL;
+
+        free(label);
+        free(need_label);
+    }
+
+    free(loop_head);
+    free(loop_tail);
+    free(next_of);
+    free(prev_of);
+    free(order);
+}
+
+
+void layout_blocks()
+{
+    nr_blk = block_partition(blk_buf, instr_buffer, nr_instr);
+    construct_cfg(blk_buf, nr_blk, instr_buffer, nr_instr);
+
+    // Each block may get a LABEL and a GOTO
+    if (nr_instr + 2 * nr_blk >= MAX_LINE) {
+        return;
+    }
+
+    IR *out = (IR *)malloc(sizeof(IR) * (nr_instr + 2 * nr_blk));
+    int nr_out = 0;
+    for (int func = 0; func < nr_blk; ) {
+        int end = func_block_end(blk_buf, nr_blk, instr_buffer, func);
+        layout_function(func, end, out, &nr_out);
+        func = end;
+    }
+
+    memcpy(instr_buffer, out, sizeof(IR) * nr_out);
+    nr_instr = nr_out;
+    free(out);
+}
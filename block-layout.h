@@ -0,0 +1,12 @@
+//
+// Placement of the basic blocks along the likely paths
+//
+
+#ifndef NJU_COMPILER_2015_BLOCK_LAYOUT_H
+#define NJU_COMPILER_2015_BLOCK_LAYOUT_H
+
+#include "ir.h"
+
+void layout_blocks();
+
+#endif //NJU_COMPILER_2015_BLOCK_LAYOUT_H
@@ -116,7 +116,7 @@ void new_symtab()
         scopes = realloc(scopes, sizeof(Symbol ***) * scope_capacity);
     }
 
-    scopes[scope_cnt++] = calloc(SIZE, sizeof(Symbol *));
+    scopes[scope_cnt++] = calloc(SIZE + 1, sizeof(Symbol *));  // hash() returns 0 ~ SIZE
 }
 
 void init_symtab()
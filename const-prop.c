@@ -0,0 +1,337 @@
+//
+// Conditional constant propagation over the control flow graph of a function
+//
+// Each value operand takes a value in the lattice
+//     UNDEF (not assigned on any executable path yet)
+//       > CONST c
+//         > NAC (not a constant)
+// and a block is visited only once one of its incoming edges is found executable.
+// A branch whose operands are both constants makes only one of its edges executable,
+// so a constant decided by a branch never reaches the code it skips:
+//
+//     i := #0                   i := #0
+//     IF i >= #5 GOTO L1   =>   (removed)
+//     ...                       ...
+//
+// Then the uses of constants are replaced by the integers, values computed from constants
+// are assigned the folded results, branches with known outcomes become GOTO or are removed,
+// and the blocks never executed are removed. compress_ir drops the IR_NOPs left behind.
+//
+
+#include "const-prop.h"
+#include "basic-block.h"
+#include "operand.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+
+typedef enum {
+    UNDEF,
+    CONST,
+    NAC
+} LatticeKind;
+
+typedef struct {
+    LatticeKind kind;
+    int value;
+} Lattice;
+
+
+static Lattice nac = { NAC, 0 };
+
+
+static Lattice make_const(int value)
+{
+    Lattice lat = { CONST, value };
+    return lat;
+}
+
+
+static Lattice meet(Lattice a, Lattice b)
+{
+    if (a.kind == UNDEF) {
+        return b;
+    }
+    if (b.kind == UNDEF) {
+        return a;
+    }
+    if (a.kind == CONST && b.kind == CONST && a.value == b.value) {
+        return a;
+    }
+    return nac;
+}
+
+
+static Lattice eval(Lattice state[], Operand ope)
+{
+    if (ope->type == OPE_INTEGER) {
+        return make_const(ope->integer);
+    }
+    if (is_value(ope)) {
+        return state[ope->id];
+    }
+    return nac;
+}
+
+
+static Lattice fold(IR_Type op, Lattice l, Lattice r)
+{
+    // x * 0 is 0 whatever x is
+    if (op == IR_MUL && ((l.kind == CONST && l.value == 0) || (r.kind == CONST && r.value == 0))) {
+        return make_const(0);
+    }
+
+    if (l.kind == NAC || r.kind == NAC) {
+        return nac;
+    }
+    if (l.kind == UNDEF || r.kind == UNDEF) {
+        return l.kind == UNDEF ? l : r;
+    }
+
+    if (is_compare(op)) {
+        return make_const(eval_relop(compare_to_branch(op), l.value, r.value));
+    }
+
+    unsigned a = (unsigned)l.value, b = (unsigned)r.value;
+    switch (op) {
+        case IR_ADD: return make_const((int)(a + b));
+        case IR_SUB: return make_const((int)(a - b));
+        case IR_MUL: return make_const((int)(a * b));
+        case IR_DIV:
+            if (r.value == 0 || (l.value == INT_MIN && r.value == -1)) {
+                return nac;  // Leave the trap to the run time
+            }
+            return make_const(l.value / r.value);
+        default:
+            return nac;
+    }
+}
+
+
+//
+// Outcome of a branch: 1 taken, 0 not taken, -1 unknown
+//
+static int branch_outcome(IR_Type op, Lattice l, Lattice r)
+{
+    if (l.kind != CONST || r.kind != CONST) {
+        return -1;
+    }
+
+    return eval_relop(op, l.value, r.value);
+}
+
+
+//
+// Interpret an instruction on the state
+//
+static void transfer(Lattice state[], IR *ir)
+{
+    Operand def[1];
+    if (!get_def(ir, def)) {
+        return;
+    }
+
+    switch (ir->type) {
+        case IR_ASSIGN:
+            state[def[0]->id] = eval(state, ir->rs);
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+            state[def[0]->id] = fold(ir->type, eval(state, ir->rs), eval(state, ir->rt));
+            break;
+        default:
+            state[def[0]->id] = nac;  // Parameters, loads, calls, reads and addresses
+            break;
+    }
+}
+
+
+static bool merge(Lattice dst[], Lattice src[], int n)
+{
+    bool changed = false;
+    for (int i = 0; i < n; i++) {
+        Lattice lat = meet(dst[i], src[i]);
+        if (lat.kind != dst[i].kind || lat.value != dst[i].value) {
+            dst[i] = lat;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+
+static Operand new_integer(int value)
+{
+    Operand ope = new_operand(OPE_INTEGER);
+    ope->integer = value;
+    return ope;
+}
+
+
+static void replace_use(Lattice state[], Operand *slot)
+{
+    if (*slot && is_value(*slot) && state[(*slot)->id].kind == CONST) {
+        *slot = new_integer(state[(*slot)->id].value);
+    }
+}
+
+
+//
+// Rewrite an executable block with the constants known on its entry
+//
+static void rewrite_block(Block *blk, Lattice state[])
+{
+    for (int i = blk->start; i < blk->end; i++) {
+        IR *ir = &instr_buffer[i];
+
+        switch (ir->type) {
+            case IR_ASSIGN:
+            case IR_RET:
+            case IR_WRITE:
+            case IR_ARG:
+                replace_use(state, &ir->rs);
+                break;
+            case IR_ADD:
+            case IR_SUB:
+            case IR_MUL:
+            case IR_DIV:
+            case IR_SEQ:
+            case IR_SLT:
+            case IR_SLE:
+            case IR_SGT:
+            case IR_SGE:
+            case IR_SNE:
+            case IR_DEREF_L:
+                replace_use(state, &ir->rs);
+                replace_use(state, &ir->rt);
+                break;
+            default:
+                break;
+        }
+
+        if (is_branch(ir)) {
+            int outcome = branch_outcome(ir->type, eval(state, ir->rs), eval(state, ir->rt));
+            if (outcome == 1) {
+                ir->type = IR_JMP;
+                ir->rs = ir->rd;
+                ir->rt = ir->rd = NULL;
+            }
+            else if (outcome == 0) {
+                remove_instr(ir);
+            }
+            else {
+                replace_use(state, &ir->rs);
+                replace_use(state, &ir->rt);
+            }
+            continue;
+        }
+
+        transfer(state, ir);
+
+        // A value computed from constants
+        if (((IR_ADD <= ir->type && ir->type <= IR_DIV) || is_compare(ir->type)) &&
+                state[ir->rd->id].kind == CONST) {
+            ir->type = IR_ASSIGN;
+            ir->rs = new_integer(state[ir->rd->id].value);
+            ir->rt = NULL;
+        }
+    }
+}
+
+
+void propagate_constants(Liveness *lv)
+{
+    int start = lv->start, end = lv->end;
+    int nr = end - start;
+    int n = lv->nr_ope;
+
+    Lattice **in = (Lattice **)malloc(sizeof(Lattice *) * nr);
+    bool *executable = (bool *)calloc(nr, sizeof(bool));
+    int *worklist = (int *)malloc(sizeof(int) * nr);
+    bool *queued = (bool *)calloc(nr, sizeof(bool));
+    Lattice *state = (Lattice *)malloc(sizeof(Lattice) * (n + 1));
+
+    for (int b = 0; b < nr; b++) {
+        in[b] = (Lattice *)calloc(n + 1, sizeof(Lattice));  // All UNDEF
+    }
+
+    // Nothing is known on the function entry, e.g. parameters
+    for (int i = 0; i < n; i++) {
+        in[0][i] = nac;
+    }
+    executable[0] = true;
+    worklist[0] = 0;
+    queued[0] = true;
+    int head = 0, size = 1;
+
+    while (size > 0) {
+        int b = worklist[head];
+        head = (head + 1) % nr;
+        size--;
+        queued[b] = false;
+
+        Block *blk = &blk_buf[start + b];
+        memcpy(state, in[b], sizeof(Lattice) * n);
+        for (int i = blk->start; i < blk->end; i++) {
+            transfer(state, &instr_buffer[i]);
+        }
+
+        // Executable edges
+        IR *last = &instr_buffer[blk->end - 1];
+        int outcome = -1;
+        if (is_branch(last) && blk->next[0] != blk->next[1]) {
+            outcome = branch_outcome(last->type, eval(state, last->rs), eval(state, last->rt));
+        }
+
+        for (int k = 0; k < 2; k++) {
+            int succ = blk->next[k];
+            if (succ < start || succ >= end || (k == 1 && succ == blk->next[0])) {
+                continue;
+            }
+            if (outcome != -1 && outcome != k) {  // next[0] is the fall through, next[1] the target
+                continue;
+            }
+
+            int s = succ - start;
+            bool changed = merge(in[s], state, n);
+            if ((changed || !executable[s]) && !queued[s]) {
+                worklist[(head + size) % nr] = s;
+                size++;
+                queued[s] = true;
+            }
+            executable[s] = true;
+        }
+    }
+
+    for (int b = 0; b < nr; b++) {
+        Block *blk = &blk_buf[start + b];
+        if (executable[b]) {
+            memcpy(state, in[b], sizeof(Lattice) * n);
+            rewrite_block(blk, state);
+        }
+        else {
+            for (int i = blk->start; i < blk->end; i++) {
+                remove_instr(&instr_buffer[i]);
+            }
+        }
+    }
+
+    for (int b = 0; b < nr; b++) {
+        free(in[b]);
+    }
+    free(in);
+    free(executable);
+    free(worklist);
+    free(queued);
+    free(state);
+}
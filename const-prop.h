@@ -0,0 +1,12 @@
+//
+// Conditional constant propagation over the control flow graph of a function
+//
+
+#ifndef NJU_COMPILER_2015_CONST_PROP_H
+#define NJU_COMPILER_2015_CONST_PROP_H
+
+#include "liveness.h"
+
+void propagate_constants(Liveness *lv);
+
+#endif //NJU_COMPILER_2015_CONST_PROP_H
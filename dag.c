@@ -0,0 +1,587 @@
+//
+// Local value numbering over the DAG of a basic block
+//
+// Each instruction is mapped to a DAG node, which stands for the value it computes:
+//   1. Operands are mapped to the node of their current value, Operand::dep,
+//      or a leaf standing for the value on the block entry.
+//   2. Arithmetic is folded when both sides are constants, algebraic identities
+//      (x + 0, x * 1, x * 0, x - x, x / 1) are applied, x - c is turned into x + (-c),
+//      and (x op c1) op c2 is reassociated into x op (c1 op c2) if c1 op c2 does not
+//      overflow, since add and addi trap on overflow.
+//   3. A node already computed is found again instead of being duplicated. Loads are
+//      keyed by a memory version bumped at every store and call. A store records the value
+//      it wrote, so that a later load from the same address reads it directly, and keeps
+//      what is known about the words it can not overlap (same base, other offset).
+//
+// The IR is then regenerated in place from the nodes: an instruction whose node is already
+// held by an operand becomes a copy, operands are replaced by the earliest operand still
+// holding their value, and copies into temporaries are propagated and removed.
+//
+
+#include "dag.h"
+#include "operand.h"
+#include "liveness.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+
+static struct DagNode_ *nodes;
+static int nr_node;
+static int max_node;
+
+static int mem_version;
+
+
+static pDagNode new_node(IR_Type op, Operand leaf, pDagNode left, pDagNode right, int mem)
+{
+    TEST(nr_node < max_node, "Too many DAG nodes");
+
+    pDagNode n = &nodes[nr_node++];
+    memset(n, 0, sizeof(*n));
+    n->op = op;
+    n->leaf = leaf;
+    n->left = left;
+    n->right = right;
+    n->mem = mem;
+    return n;
+}
+
+
+static pDagNode find_node(IR_Type op, pDagNode left, pDagNode right, int mem)
+{
+    for (int i = 0; i < nr_node; i++) {
+        pDagNode n = &nodes[i];
+        if (n->op == op && n->left == left && n->right == right && n->mem == mem) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+
+static pDagNode find_or_add(IR_Type op, pDagNode left, pDagNode right, int mem)
+{
+    pDagNode n = find_node(op, left, right, mem);
+    return n ? n : new_node(op, NULL, left, right, mem);
+}
+
+
+static bool is_int(pDagNode n)
+{
+    return n->op == IR_NOP && n->leaf->type == OPE_INTEGER;
+}
+
+
+static pDagNode int_node(int value, Operand ope)
+{
+    for (int i = 0; i < nr_node; i++) {
+        if (is_int(&nodes[i]) && nodes[i].leaf->integer == value) {
+            return &nodes[i];
+        }
+    }
+
+    if (ope == NULL) {
+        ope = new_operand(OPE_INTEGER);
+        ope->integer = value;
+    }
+    return new_node(IR_NOP, ope, NULL, NULL, 0);
+}
+
+
+static void add_holder(pDagNode n, Operand ope)
+{
+    ope->dep = n;
+
+    // Replace a holder which has been assigned another value, or the oldest one
+    for (int i = 0; i < n->nr_holder; i++) {
+        if (n->holder[i]->dep != n) {
+            n->holder[i] = ope;
+            return;
+        }
+    }
+    n->holder[n->nr_holder < MAX_HOLDER ? n->nr_holder++ : 0] = ope;
+}
+
+
+//
+// The operand to read the node's value from, NULL if no operand holds it any more
+//
+static Operand rep(pDagNode n)
+{
+    if (is_int(n)) {
+        return n->leaf;
+    }
+
+    for (int i = 0; i < n->nr_holder; i++) {
+        if (n->holder[i]->dep == n) {
+            return n->holder[i];
+        }
+    }
+    return NULL;
+}
+
+
+//
+// The node of an operand's current value, NULL for operands not handled (e.g. floats)
+//
+static pDagNode leaf_node(Operand ope)
+{
+    if (ope == NULL) {
+        return NULL;
+    }
+
+    if (ope->type == OPE_INTEGER) {
+        return int_node(ope->integer, ope);
+    }
+
+    if (!is_value(ope) && ope->type != OPE_REF) {
+        return NULL;
+    }
+
+    if (ope->dep == NULL) {
+        add_holder(new_node(IR_NOP, ope, NULL, NULL, 0), ope);
+    }
+    return ope->dep;
+}
+
+
+//
+// A value whose computation is unknown, e.g. the result of a call
+//
+static void define_opaque(IR *ir, Operand ope)
+{
+    if (is_value(ope)) {
+        add_holder(new_node(ir->type, ope, NULL, NULL, 0), ope);
+    }
+}
+
+
+//
+// Map a source operand to its node, and read it from the earliest operand holding the value
+//
+static pDagNode use(Operand *slot)
+{
+    pDagNode n = leaf_node(*slot);
+    if (n != NULL && rep(n) != NULL) {
+        *slot = rep(n);
+    }
+    return n;
+}
+
+
+// True if c1 op c2 fits in an int
+static bool fits(IR_Type op, int c1, int c2)
+{
+    long long v = op == IR_ADD ? (long long)c1 + c2 : (long long)c1 * c2;
+    return INT_MIN <= v && v <= INT_MAX;
+}
+
+
+static pDagNode arith_node(IR_Type op, pDagNode l, pDagNode r)
+{
+    if (is_int(l) && is_int(r)) {
+        int a = l->leaf->integer, b = r->leaf->integer;
+        switch (op) {
+            case IR_ADD: return int_node((int)((unsigned)a + (unsigned)b), NULL);
+            case IR_SUB: return int_node((int)((unsigned)a - (unsigned)b), NULL);
+            case IR_MUL: return int_node((int)((unsigned)a * (unsigned)b), NULL);
+            case IR_DIV:
+                if (b != 0 && !(a == INT_MIN && b == -1)) {
+                    return int_node(a / b, NULL);
+                }
+                break;
+            default:
+                if (is_compare(op)) {
+                    return int_node(eval_relop(compare_to_branch(op), a, b), NULL);
+                }
+                break;
+        }
+        return find_or_add(op, l, r, 0);
+    }
+
+    switch (op) {
+        case IR_SUB:
+            if (l == r) {
+                return int_node(0, NULL);
+            }
+            if (is_int(r) && r->leaf->integer != INT_MIN) {
+                return arith_node(IR_ADD, l, int_node(-r->leaf->integer, NULL));
+            }
+            break;
+        case IR_ADD:
+        case IR_MUL:
+            // Commutative: constants go to the right, the others are ordered by node
+            if (is_int(l) || (!is_int(r) && l > r)) {
+                pDagNode t = l;
+                l = r;
+                r = t;
+            }
+            if (is_int(r)) {
+                int c = r->leaf->integer;
+                if ((op == IR_ADD && c == 0) || (op == IR_MUL && c == 1)) {
+                    return l;
+                }
+                if (op == IR_MUL && c == 0) {
+                    return int_node(0, NULL);
+                }
+                if (l->op == op && is_int(l->right) && rep(l->left) != NULL &&
+                        fits(op, l->right->leaf->integer, c)) {
+                    return arith_node(op, l->left, arith_node(op, l->right, r));
+                }
+            }
+            break;
+        case IR_DIV:
+            if (is_int(r) && r->leaf->integer == 1) {
+                return l;
+            }
+            break;
+        default:
+            break;
+    }
+
+    return find_or_add(op, l, r, 0);
+}
+
+
+//
+// Split an address into a base and a constant offset
+//
+static pDagNode split_addr(pDagNode addr, int *offset)
+{
+    if (addr->op == IR_ADD && is_int(addr->right)) {
+        *offset = addr->right->leaf->integer;
+        return addr->left;
+    }
+    *offset = 0;
+    return addr;
+}
+
+
+//
+// True if the words at the two addresses can not overlap, e.g. two fields of a structure
+//
+static bool disjoint(pDagNode a, pDagNode b)
+{
+    int off_a, off_b;
+    pDagNode base_a = split_addr(a, &off_a);
+    pDagNode base_b = split_addr(b, &off_b);
+    return base_a == base_b && (off_a - off_b >= 4 || off_b - off_a >= 4);
+}
+
+
+//
+// A store starts a new memory version, the known contents of the other words are kept
+//
+static void store_node(pDagNode addr, pDagNode value)
+{
+    int old = mem_version++;
+    int n = nr_node;
+
+    // The other half of the nodes is reserved for the instructions, see optimize_dag
+    for (int i = 0; i < n && nr_node < max_node / 2; i++) {
+        pDagNode known = &nodes[i];
+        if ((known->op != IR_DEREF_L && known->op != IR_DEREF_R) ||
+                known->mem != old || !disjoint(known->left, addr)) {
+            continue;
+        }
+        pDagNode content = known->op == IR_DEREF_L ? known->right : known;
+        new_node(IR_DEREF_L, NULL, known->left, content, mem_version);
+    }
+
+    new_node(IR_DEREF_L, NULL, addr, value, mem_version);
+}
+
+
+static pDagNode load_node(pDagNode addr)
+{
+    // A store into the same address in the current memory version
+    for (int i = 0; i < nr_node; i++) {
+        pDagNode n = &nodes[i];
+        if (n->op == IR_DEREF_L && n->left == addr && n->mem == mem_version) {
+            return n->right;
+        }
+    }
+    return find_or_add(IR_DEREF_R, addr, NULL, mem_version);
+}
+
+
+//
+// Rewrite a value instruction to compute its node in the cheapest way
+//
+static void regenerate(IR *ir, pDagNode n)
+{
+    Operand holder = rep(n);
+
+    if (holder == ir->rd) {  // Already there, e.g. x := x + 0
+        ir->type = IR_NOP;
+    }
+    else if (holder != NULL) {
+        ir->type = IR_ASSIGN;
+        ir->rs = holder;
+        ir->rt = NULL;
+    }
+    else if (((IR_ADD <= n->op && n->op <= IR_DIV) || is_compare(n->op)) && rep(n->left) && rep(n->right)) {
+        ir->type = n->op;
+        ir->rs = rep(n->left);
+        ir->rt = rep(n->right);
+    }
+    // Otherwise keep the instruction, its operands have been rewritten
+}
+
+
+static void number_instr(IR *ir)
+{
+    pDagNode n = NULL, l, r;
+
+    switch (ir->type) {
+        case IR_ASSIGN:
+            n = use(&ir->rs);
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+            l = use(&ir->rs);
+            r = use(&ir->rt);
+            if (l && r) {
+                n = arith_node(ir->type, l, r);
+            }
+            break;
+        case IR_ADDR:
+            l = leaf_node(ir->rs);
+            if (l) {
+                n = find_or_add(IR_ADDR, l, NULL, 0);
+            }
+            break;
+        case IR_DEREF_R:
+            l = use(&ir->rs);
+            if (l) {
+                n = load_node(l);
+            }
+            break;
+        case IR_DEREF_L:
+            l = use(&ir->rs);
+            r = use(&ir->rt);
+            if (l && r) {
+                store_node(l, r);
+            }
+            else {
+                mem_version++;
+            }
+            return;
+        case IR_BEQ:
+        case IR_BLT:
+        case IR_BLE:
+        case IR_BGT:
+        case IR_BGE:
+        case IR_BNE:
+            use(&ir->rs);
+            use(&ir->rt);
+            return;
+        case IR_RET:
+        case IR_WRITE:
+            use(&ir->rs);
+            return;
+        case IR_ARG:
+            // Arguments are read at the call, only constants are safe to substitute
+            l = leaf_node(ir->rs);
+            if (l && is_int(l)) {
+                ir->rs = l->leaf;
+            }
+            return;
+        case IR_CALL:
+            mem_version++;  // Arrays and structures are passed by reference
+            define_opaque(ir, ir->rd);
+            return;
+        case IR_READ:
+            define_opaque(ir, ir->rd);
+            return;
+        case IR_PARAM:
+            define_opaque(ir, ir->rs);
+            return;
+        default:
+            return;
+    }
+
+    if (!is_value(ir->rd)) {
+        return;
+    }
+
+    if (n == NULL) {
+        define_opaque(ir, ir->rd);
+        return;
+    }
+
+    regenerate(ir, n);
+    add_holder(n, ir->rd);
+    ir->depend = n;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Copy propagation
+//////////////////////////////////////////////////////////////////////////////
+
+
+//
+// The source operand slots a copy can be propagated into
+//
+static int source_slots(IR *ir, Operand *slot[2])
+{
+    switch (ir->type) {
+        case IR_ASSIGN:
+        case IR_DEREF_R:
+        case IR_RET:
+        case IR_WRITE:
+        case IR_ARG:
+            slot[0] = &ir->rs;
+            return 1;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+        case IR_DEREF_L:
+        case IR_BEQ:
+        case IR_BLT:
+        case IR_BLE:
+        case IR_BGT:
+        case IR_BGE:
+        case IR_BNE:
+            slot[0] = &ir->rs;
+            slot[1] = &ir->rt;
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+
+static bool defines(IR *ir, Operand ope)
+{
+    Operand def[1];
+    return get_def(ir, def) && def[0] == ope;
+}
+
+
+static bool uses(IR *ir, Operand ope)
+{
+    Operand *slot[2];
+    int n = source_slots(ir, slot);
+    for (int k = 0; k < n; k++) {
+        if (*slot[k] == ope) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//
+// Propagate t := x into the following uses of the temporary t in the block,
+// and remove the copy if t is not needed any more
+//
+static void propagate_copy(IR *copy, IR *end, Bitset live_out)
+{
+    Operand t = copy->rd, x = copy->rs;
+    bool needed = false;  // Some use of t is kept
+    IR *ir;
+
+    for (ir = copy + 1; ir < end; ir++) {
+        Operand *slot[2];
+        int n = source_slots(ir, slot);
+        for (int k = 0; k < n; k++) {
+            if (*slot[k] != t) {
+                continue;
+            }
+            if (ir->type == IR_ARG && !is_const(x)) {
+                needed = true;
+            }
+            else {
+                *slot[k] = x;
+            }
+        }
+
+        if (defines(ir, t)) {
+            break;
+        }
+
+        if (defines(ir, x)) {
+            // x changes, t keeps the old value if it is still used
+            for (ir++; ir < end && !defines(ir, t); ir++) {
+                needed = needed || uses(ir, t);
+            }
+            break;
+        }
+    }
+
+    if (ir == end && bs_test(live_out, t->id)) {
+        needed = true;
+    }
+
+    if (!needed) {
+        copy->type = IR_NOP;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Interface
+//////////////////////////////////////////////////////////////////////////////
+
+
+//
+// Optimize the block of instructions [start, end).
+// live_out tells the temporaries used by other blocks.
+// Removed instructions are left as IR_NOP.
+//
+void optimize_dag(int start, int end, Bitset live_out)
+{
+    max_node = (end - start) * 16 + 16;  // At most 8 nodes for an instruction
+    nodes = (struct DagNode_ *)malloc(sizeof(struct DagNode_) * max_node);
+    nr_node = 0;
+    mem_version = 0;
+
+    for (int i = start; i < end; i++) {
+        for (int k = 0; k < NR_OPE; k++) {
+            if (instr_buffer[i].operand[k]) {
+                instr_buffer[i].operand[k]->dep = NULL;
+            }
+        }
+    }
+
+    for (int i = start; i < end; i++) {
+        number_instr(&instr_buffer[i]);
+    }
+
+    for (int i = start; i < end; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type == IR_ASSIGN && is_tmp(ir->rd) && (is_value(ir->rs) || ir->rs->type == OPE_INTEGER)) {
+            propagate_copy(ir, &instr_buffer[end], live_out);
+        }
+    }
+
+    // The DAG only lives in this block
+    for (int i = start; i < end; i++) {
+        instr_buffer[i].depend = NULL;
+        for (int k = 0; k < NR_OPE; k++) {
+            if (instr_buffer[i].operand[k]) {
+                instr_buffer[i].operand[k]->dep = NULL;
+            }
+        }
+    }
+    free(nodes);
+}
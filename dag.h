@@ -0,0 +1,25 @@
+//
+// Directed acyclic graph of a basic block, used for local value numbering
+//
+
+#ifndef NJU_COMPILER_2015_DAG_H
+#define NJU_COMPILER_2015_DAG_H
+
+#include "ir.h"
+#include "bitset.h"
+
+#define MAX_HOLDER 4
+
+struct DagNode_ {
+    IR_Type op;        // IR_NOP for a leaf
+    Operand leaf;      // A constant, or an operand whose value on the block entry is the leaf
+    pDagNode left;
+    pDagNode right;
+    int mem;           // Version of the memory a load reads
+    Operand holder[MAX_HOLDER];  // Operands assigned the value, valid while their dep is the node
+    int nr_holder;
+};
+
+void optimize_dag(int start, int end, Bitset live_out);
+
+#endif //NJU_COMPILER_2015_DAG_H
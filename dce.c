@@ -0,0 +1,307 @@
+//
+// Dead code elimination over the control flow graph of a function
+//
+// Two sweeps:
+//   1. Reachability: the blocks not reachable from the function entry are removed,
+//      as well as the code following a RETURN in its block.
+//   2. Liveness: an instruction without side effects whose result is not live
+//      after it, or not used by any instruction with side effects, is removed.
+//      Removing it may kill the values it used, so the liveness is computed again
+//      and the sweep repeated until nothing changes.
+//
+// Calls and READs are kept even if their results are dead, stores are always kept.
+//
+
+#include "dce.h"
+#include "basic-block.h"
+#include "operand.h"
+#include "option.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+
+static bool is_pure(IR *ir)
+{
+    switch (ir->type) {
+        case IR_ASSIGN:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+        case IR_ADDR:
+        case IR_DEREF_R:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+//
+// Remove the blocks not reachable from the entry, return the number of them
+//
+static int sweep_unreachable(Liveness *lv, int *nr_removed)
+{
+    int start = lv->start, end = lv->end, nr = end - start;
+    bool *reached = (bool *)calloc(nr, sizeof(bool));
+    int *stack = (int *)malloc(sizeof(int) * nr);
+    int top = 0;
+
+    reached[0] = true;
+    stack[top++] = start;
+    while (top > 0) {
+        Block *blk = &blk_buf[stack[--top]];
+        for (int k = 0; k < 2; k++) {
+            int succ = blk->next[k];
+            if (start <= succ && succ < end && !reached[succ - start]) {
+                reached[succ - start] = true;
+                stack[top++] = succ;
+            }
+        }
+    }
+
+    int nr_blk_removed = 0;
+    for (int b = 0; b < nr; b++) {
+        Block *blk = &blk_buf[start + b];
+        bool dead = !reached[b];
+        bool empty = true;
+
+        for (int i = blk->start; i < blk->end; i++) {
+            IR *ir = &instr_buffer[i];
+            if (ir->type == IR_NOP) {
+                continue;
+            }
+            if (dead) {
+                remove_instr(ir);
+                (*nr_removed)++;
+                empty = false;
+            }
+            else if (ir->type == IR_RET) {
+                dead = true;  // The rest of the block
+            }
+        }
+
+        if (!reached[b] && !empty) {
+            nr_blk_removed++;
+        }
+    }
+
+    free(reached);
+    free(stack);
+    return nr_blk_removed;
+}
+
+
+//
+// The instructions some instruction with side effects depends on, through the reaching
+// definitions. An assignment only feeding itself, e.g. a sum never printed or an induction
+// variable no longer used, is not useful although its value is live.
+// Return the flags indexed by the instruction index from the function start.
+//
+static bool *mark_useful(Liveness *lv)
+{
+    int first = blk_buf[lv->start].start, last = blk_buf[lv->end - 1].end;
+    int nr_line = last - first;
+    int nr_block = lv->end - lv->start;
+
+    // Number the assignments
+    int *def_line = (int *)malloc(sizeof(int) * (nr_line + 1));
+    int nr_def = 0;
+    for (int i = first; i < last; i++) {
+        Operand def[1];
+        if (get_def(&instr_buffer[i], def)) {
+            def_line[nr_def++] = i;
+        }
+    }
+
+    Bitset *defs_of = (Bitset *)calloc(lv->nr_ope, sizeof(Bitset));
+    for (int d = 0; d < nr_def; d++) {
+        Operand def[1];
+        get_def(&instr_buffer[def_line[d]], def);
+        if (defs_of[def[0]->id] == NULL) {
+            defs_of[def[0]->id] = new_bitset(nr_def);
+        }
+        bs_set(defs_of[def[0]->id], d);
+    }
+
+    // Reaching definitions: out[b] = gen[b] U (in[b] - kill[b]), in[b] = U out[p]
+    Bitset *in = (Bitset *)malloc(sizeof(Bitset) * nr_block);
+    Bitset *out = (Bitset *)malloc(sizeof(Bitset) * nr_block);
+    Bitset *gen = (Bitset *)malloc(sizeof(Bitset) * nr_block);
+    Bitset *kill = (Bitset *)malloc(sizeof(Bitset) * nr_block);
+    for (int b = 0, d = 0; b < nr_block; b++) {
+        Block *blk = &blk_buf[lv->start + b];
+        in[b] = new_bitset(nr_def);
+        out[b] = new_bitset(nr_def);
+        gen[b] = new_bitset(nr_def);
+        kill[b] = new_bitset(nr_def);
+        for (; d < nr_def && def_line[d] < blk->end; d++) {
+            Operand def[1];
+            get_def(&instr_buffer[def_line[d]], def);
+            bs_subtract(gen[b], defs_of[def[0]->id]);
+            bs_set(gen[b], d);
+            bs_union(kill[b], defs_of[def[0]->id]);
+        }
+    }
+
+    Bitset tmp = new_bitset(nr_def);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = 0; b < nr_block; b++) {
+            Block *blk = &blk_buf[lv->start + b];
+            for (int k = 0; k < 2; k++) {
+                int succ = blk->next[k] - lv->start;
+                if (0 <= succ && succ < nr_block) {
+                    bs_union(in[succ], out[b]);
+                }
+            }
+            bs_copy(tmp, in[b]);
+            bs_subtract(tmp, kill[b]);
+            bs_union(tmp, gen[b]);
+            if (!bs_equal(tmp, out[b])) {
+                bs_copy(out[b], tmp);
+                changed = true;
+            }
+        }
+    }
+    free_bitset(tmp);
+
+    // Mark from the instructions with side effects
+    bool *useful = (bool *)calloc(nr_line, sizeof(bool));
+    int *work = (int *)malloc(sizeof(int) * nr_line);
+    int top = 0;
+    for (int i = first; i < last; i++) {
+        if (instr_buffer[i].type != IR_NOP && !is_pure(&instr_buffer[i])) {
+            useful[i - first] = true;
+            work[top++] = i;
+        }
+    }
+
+    while (top > 0) {
+        int p = work[--top];
+        Block *blk = &blk_buf[instr_buffer[p].block];
+        Operand use[MAX_USE];
+        int n = get_use(&instr_buffer[p], use);
+
+        for (int k = 0; k < n; k++) {
+            if (defs_of[use[k]->id] == NULL) {
+                continue;  // Read but never assigned
+            }
+
+            // The nearest assignment in the block, or those reaching the block
+            int local = -1;
+            for (int i = p - 1; i >= blk->start && local == -1; i--) {
+                Operand def[1];
+                if (get_def(&instr_buffer[i], def) && def[0] == use[k]) {
+                    local = i;
+                }
+            }
+
+            for (int d = 0; d < nr_def; d++) {
+                int line = def_line[d];
+                bool reach = local != -1 ? line == local :
+                        bs_test(in[blk->index - lv->start], d) && bs_test(defs_of[use[k]->id], d);
+                if (reach && !useful[line - first]) {
+                    useful[line - first] = true;
+                    work[top++] = line;
+                }
+            }
+        }
+    }
+
+    for (int b = 0; b < nr_block; b++) {
+        free_bitset(in[b]);
+        free_bitset(out[b]);
+        free_bitset(gen[b]);
+        free_bitset(kill[b]);
+    }
+    for (int i = 0; i < lv->nr_ope; i++) {
+        if (defs_of[i] != NULL) {
+            free_bitset(defs_of[i]);
+        }
+    }
+    free(in);
+    free(out);
+    free(gen);
+    free(kill);
+    free(defs_of);
+    free(def_line);
+    free(work);
+    return useful;
+}
+
+
+//
+// Remove the pure instructions defining dead values, return the number of them
+//
+static int sweep_dead_values(Liveness *lv)
+{
+    int removed = 0;
+    Bitset live = new_bitset(lv->nr_ope);
+    bool *useful = mark_useful(lv);
+    int first = blk_buf[lv->start].start;
+
+    for (int b = lv->start; b < lv->end; b++) {
+        Block *blk = &blk_buf[b];
+        bs_copy(live, lv->out[b - lv->start]);
+
+        for (int i = blk->end - 1; i >= blk->start; i--) {
+            IR *ir = &instr_buffer[i];
+            Operand ope[MAX_USE];
+
+            int n = get_def(ir, ope);
+            if (n > 0 && is_pure(ir) && (!bs_test(live, ope[0]->id) || !useful[i - first])) {
+                ir->type = IR_NOP;
+                removed++;
+                continue;
+            }
+
+            for (int k = 0; k < n; k++) {
+                bs_reset(live, ope[k]->id);
+            }
+            n = get_use(ir, ope);
+            for (int k = 0; k < n; k++) {
+                bs_set(live, ope[k]->id);
+            }
+        }
+    }
+
+    free_bitset(live);
+    free(useful);
+    return removed;
+}
+
+
+void eliminate_dead_code(Liveness *lv)
+{
+    int nr_instr_removed = 0;
+    int nr_blk_removed = sweep_unreachable(lv, &nr_instr_removed);
+
+    // Recompute the liveness after each round, the caller frees the last one
+    int start = lv->start, end = lv->end;
+    while (true) {
+        free_liveness(lv);
+        analyze_liveness(lv, start, end);
+
+        int n = sweep_dead_values(lv);
+        if (n == 0) {
+            break;
+        }
+        nr_instr_removed += n;
+    }
+
+    if (print_stats) {
+        const char *name = instr_buffer[blk_buf[start].start].rs->name;
+        fprintf(stderr, "dce: %s: %d instructions, %d blocks removed\n",
+                name, nr_instr_removed, nr_blk_removed);
+    }
+}
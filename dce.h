@@ -0,0 +1,12 @@
+//
+// Dead code elimination over the control flow graph of a function
+//
+
+#ifndef NJU_COMPILER_2015_DCE_H
+#define NJU_COMPILER_2015_DCE_H
+
+#include "liveness.h"
+
+void eliminate_dead_code(Liveness *lv);
+
+#endif //NJU_COMPILER_2015_DCE_H
@@ -0,0 +1,787 @@
+//
+// Graph-coloring register allocation
+//
+// This is the iterated register coalescing of George and Appel (Chaitin-Briggs style
+// simplify / coalesce / freeze / potential spill / select), run once per function:
+//
+//   1. The interference graph is built from the global liveness. Physical registers
+//      are precolored nodes, so calls and I/O routines clobbering registers, call
+//      results in $v0 and return values in $v0 are ordinary edges and moves.
+//   2. Moves produced by assignments and by call returns are coalesced conservatively.
+//   3. Spill candidates are picked by loop-depth weighted cost divided by degree, or with
+//      -fprofile-use by the cost weighted by the times each block ran.
+//
+// An operand left uncolored is not rewritten: it stays in its stack slot and is
+// handled by the local allocator in register.c through a small reserved scratch pool,
+// so no rebuild-and-retry loop is needed.
+//
+
+#include "graph-color.h"
+#include "basic-block.h"
+#include "loop.h"
+#include "register.h"
+#include "operand.h"
+#include "profile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+
+// Colors handed out by the allocator, in the order of preference.
+// $a1-$a3 only carry arguments and parameters, which are precolored moves like $a0.
+static const int colors[] = {
+    T0, T1, T2, T3, T4, T5, T6, T7,
+    A1, A2, A3,
+    S0, S1, S2, S3, S4, S5, S6, S7
+};
+
+#define K ((int)(sizeof(colors) / sizeof(colors[0])))
+
+// Registers clobbered by a call, $s0-$s7 are callee-saved (see gen_asm_func)
+static const int call_clobber[] = {
+    V0, A0, A1, A2, A3,
+    T0, T1, T2, T3, T4, T5, T6, T7
+};
+
+// read and write in predefine.S only touch $v0 and $a0
+static const int io_clobber[] = { V0, A0 };
+
+#define LENGTH(x) ((int)(sizeof(x) / sizeof(*x)))
+
+enum {
+    NODE_PRECOLORED,
+    NODE_INITIAL,
+    NODE_SIMPLIFY,
+    NODE_FREEZE,
+    NODE_SPILL,
+    NODE_SPILLED,
+    NODE_COALESCED,
+    NODE_COLORED,
+    NODE_SELECT,
+    NODE_EXCLUDED,    // Never colored, e.g. the address is taken
+};
+
+enum {
+    MOVE_WORKLIST,
+    MOVE_ACTIVE,
+    MOVE_COALESCED,
+    MOVE_CONSTRAINED,
+    MOVE_FROZEN,
+};
+
+typedef struct {
+    int *elem;
+    int size;
+    int cap;
+} IntList;
+
+typedef struct {
+    int dst;
+    int src;
+    int state;
+} Move;
+
+// Allocator state of the current function
+static int nr_node;         // NR_REG precolored nodes followed by operand nodes
+static Bitset adj_set;      // nr_node * nr_node adjacency matrix
+static IntList *adj_list;
+static IntList *move_list;
+static int *degree;
+static int *state;
+static int *alias;
+static int *color;
+static double *cost;
+static Move *moves;
+static int nr_move;
+static int cap_move;
+static int *select_stack;
+static int nr_select;
+
+
+static void list_add(IntList *list, int x)
+{
+    if (list->size == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 8;
+        list->elem = (int *)realloc(list->elem, sizeof(int) * list->cap);
+    }
+    list->elem[list->size++] = x;
+}
+
+
+static inline int node_of(Operand ope)
+{
+    return NR_REG + ope->id;
+}
+
+
+static inline bool is_precolored(int n)
+{
+    return n < NR_REG;
+}
+
+
+static void add_edge(int u, int v)
+{
+    if (u == v || state[u] == NODE_EXCLUDED || state[v] == NODE_EXCLUDED) {
+        return;
+    }
+
+    if (!bs_test(adj_set, u * nr_node + v)) {
+        bs_set(adj_set, u * nr_node + v);
+        bs_set(adj_set, v * nr_node + u);
+        if (!is_precolored(u)) {
+            list_add(&adj_list[u], v);
+            degree[u]++;
+        }
+        if (!is_precolored(v)) {
+            list_add(&adj_list[v], u);
+            degree[v]++;
+        }
+    }
+}
+
+
+static void add_move(int dst, int src)
+{
+    if (dst == src || state[dst] == NODE_EXCLUDED || state[src] == NODE_EXCLUDED) {
+        return;
+    }
+
+    if (nr_move == cap_move) {
+        cap_move = cap_move ? cap_move * 2 : 64;
+        moves = (Move *)realloc(moves, sizeof(Move) * cap_move);
+    }
+    moves[nr_move].dst = dst;
+    moves[nr_move].src = src;
+    moves[nr_move].state = MOVE_WORKLIST;
+    list_add(&move_list[dst], nr_move);
+    list_add(&move_list[src], nr_move);
+    nr_move++;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Build
+//////////////////////////////////////////////////////////////////////////////
+
+
+//
+// A step of an instruction seen by the allocator.
+// An instruction may be split into several steps, e.g. a call clobbers registers,
+// then moves $v0 to its destination.
+//
+typedef struct {
+    int def[NR_REG + 1];
+    int nr_def;
+    int use[MAX_USE];
+    int nr_use;
+    bool is_move;   // def[0] := use[0]
+} Step;
+
+
+static void step_def(Step *step, int n)
+{
+    step->def[step->nr_def++] = n;
+}
+
+
+static void step_use(Step *step, int n)
+{
+    step->use[step->nr_use++] = n;
+}
+
+
+#define MAX_STEP (NR_ARG_REG + 2)
+
+
+//
+// Translate an instruction into steps, return the number of steps.
+//
+// A call moves its first arguments into $a0-$a3, clobbers registers, then moves $v0
+// to its destination. A parameter passed in register is moved from $a0-$a3 on entry.
+//
+static int get_steps(IR *ir, Step step[MAX_STEP])
+{
+    memset(step, 0, sizeof(Step) * MAX_STEP);
+
+    Operand ope[MAX_USE];
+    int n, k = 0;
+
+    switch (ir->type) {
+        case IR_ASSIGN:
+            if (is_value(ir->rs)) {
+                step_def(&step[0], node_of(ir->rd));
+                step_use(&step[0], node_of(ir->rs));
+                step[0].is_move = true;
+            }
+            else {
+                step_def(&step[0], node_of(ir->rd));
+            }
+            return 1;
+        case IR_PARAM:
+            for (IR *param = ir - 1; param >= instr_buffer && param->type == IR_PARAM; param--) {
+                k++;
+            }
+            step_def(&step[0], node_of(ir->rs));
+            if (k < NR_ARG_REG) {
+                step_use(&step[0], A0 + k);
+                step[0].is_move = true;
+            }
+            return 1;
+        case IR_CALL:
+            n = 0;
+            for (IR *arg = ir - 1; arg >= instr_buffer && arg->type != IR_CALL && arg->type != IR_FUNC; arg--) {
+                if (arg->type != IR_ARG) {
+                    continue;
+                }
+                if (k < NR_ARG_REG) {
+                    Step *st = &step[k];
+                    step_def(st, A0 + k);
+                    if (is_value(arg->rs)) {
+                        step_use(st, node_of(arg->rs));
+                        st->is_move = true;
+                    }
+                    step_use(&step[MAX_STEP - 2], A0 + k);
+                    k++;
+                }
+                else if (is_value(arg->rs) && n < MAX_USE - NR_ARG_REG) {
+                    step_use(&step[MAX_STEP - 2], node_of(arg->rs));
+                    n++;
+                }
+            }
+            for (int i = 0; i < LENGTH(call_clobber); i++) {
+                step_def(&step[MAX_STEP - 2], call_clobber[i]);
+            }
+            if (is_value(ir->rd)) {
+                step_def(&step[MAX_STEP - 1], node_of(ir->rd));
+                step_use(&step[MAX_STEP - 1], V0);
+                step[MAX_STEP - 1].is_move = true;
+            }
+            return MAX_STEP;
+        case IR_READ:
+            for (int i = 0; i < LENGTH(io_clobber); i++) {
+                step_def(&step[0], io_clobber[i]);
+            }
+            if (is_value(ir->rd)) {
+                step_def(&step[1], node_of(ir->rd));
+                step_use(&step[1], V0);
+                step[1].is_move = true;
+            }
+            return 2;
+        case IR_WRITE:
+            if (is_value(ir->rs)) {
+                step_use(&step[0], node_of(ir->rs));
+            }
+            for (int i = 0; i < LENGTH(io_clobber); i++) {
+                step_def(&step[0], io_clobber[i]);
+            }
+            return 1;
+        case IR_RET:
+            if (is_value(ir->rs)) {
+                step_def(&step[0], V0);
+                step_use(&step[0], node_of(ir->rs));
+                step[0].is_move = true;
+            }
+            return 1;
+        default:
+            n = get_def(ir, ope);
+            for (int i = 0; i < n; i++) {
+                step_def(&step[0], node_of(ope[i]));
+            }
+            n = get_use(ir, ope);
+            for (int i = 0; i < n; i++) {
+                step_use(&step[0], node_of(ope[i]));
+            }
+            return 1;
+    }
+}
+
+
+static double weight_of(int depth)
+{
+    double w = 1;
+    for (int i = 0; i < depth && i < 6; i++) {
+        w *= 10;
+    }
+    return w;
+}
+
+
+static void build(Liveness *lv)
+{
+    // The natural loops, the layout has moved the blocks out of the order of the source
+    int *depth = loop_depths(lv);
+    Bitset live = new_bitset(nr_node);
+
+    for (int b = lv->start; b < lv->end; b++) {
+        Block *blk = &blk_buf[b];
+        double w = has_profile ? block_count(blk) + 1 : weight_of(depth[b - lv->start]);
+
+        bs_clear(live);
+        for (int i = 0; i < lv->nr_ope; i++) {
+            if (bs_test(lv->out[b - lv->start], i)) {
+                bs_set(live, NR_REG + i);
+            }
+        }
+
+        for (int i = blk->end - 1; i >= blk->start; i--) {
+            Step step[MAX_STEP];
+            int nr_step = get_steps(&instr_buffer[i], step);
+
+            for (int s = nr_step - 1; s >= 0; s--) {
+                Step *st = &step[s];
+
+                if (st->is_move) {
+                    bs_reset(live, st->use[0]);
+                    add_move(st->def[0], st->use[0]);
+                }
+
+                for (int k = 0; k < st->nr_def; k++) {
+                    bs_set(live, st->def[k]);
+                }
+
+                for (int k = 0; k < st->nr_def; k++) {
+                    int d = st->def[k];
+                    for (int l = 0; l < nr_node; l++) {
+                        if (bs_test(live, l)) {
+                            add_edge(l, d);
+                        }
+                    }
+                    if (!is_precolored(d)) {
+                        cost[d] += w;
+                    }
+                }
+
+                for (int k = 0; k < st->nr_def; k++) {
+                    bs_reset(live, st->def[k]);
+                }
+
+                for (int k = 0; k < st->nr_use; k++) {
+                    bs_set(live, st->use[k]);
+                    if (!is_precolored(st->use[k])) {
+                        cost[st->use[k]] += w;
+                    }
+                }
+            }
+        }
+    }
+
+    free_bitset(live);
+    free(depth);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Simplify, coalesce, freeze and spill
+//////////////////////////////////////////////////////////////////////////////
+
+
+static bool is_adjacent(int n)
+{
+    return state[n] != NODE_SELECT && state[n] != NODE_COALESCED;
+}
+
+
+static bool move_related(int n)
+{
+    for (int i = 0; i < move_list[n].size; i++) {
+        int m = move_list[n].elem[i];
+        if (moves[m].state == MOVE_ACTIVE || moves[m].state == MOVE_WORKLIST) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void enable_moves(int n)
+{
+    for (int i = 0; i < move_list[n].size; i++) {
+        int m = move_list[n].elem[i];
+        if (moves[m].state == MOVE_ACTIVE) {
+            moves[m].state = MOVE_WORKLIST;
+        }
+    }
+}
+
+
+static void decrement_degree(int m)
+{
+    if (is_precolored(m)) {
+        return;
+    }
+
+    int d = degree[m]--;
+    if (d == K) {
+        enable_moves(m);
+        for (int i = 0; i < adj_list[m].size; i++) {
+            int t = adj_list[m].elem[i];
+            if (is_adjacent(t)) {
+                enable_moves(t);
+            }
+        }
+        if (state[m] == NODE_SPILL) {
+            state[m] = move_related(m) ? NODE_FREEZE : NODE_SIMPLIFY;
+        }
+    }
+}
+
+
+static int get_alias(int n)
+{
+    while (state[n] == NODE_COALESCED) {
+        n = alias[n];
+    }
+    return n;
+}
+
+
+static void add_work_list(int u)
+{
+    if (!is_precolored(u) && !move_related(u) && degree[u] < K && state[u] == NODE_FREEZE) {
+        state[u] = NODE_SIMPLIFY;
+    }
+}
+
+
+// George's test for coalescing with a precolored node
+static bool george_ok(int t, int r)
+{
+    return degree[t] < K || is_precolored(t) || bs_test(adj_set, t * nr_node + r);
+}
+
+
+// Briggs' conservative test
+static bool conservative(int u, int v)
+{
+    int k = 0;
+    Bitset seen = new_bitset(nr_node);
+    int pair[2] = { u, v };
+    for (int p = 0; p < 2; p++) {
+        IntList *adj = &adj_list[pair[p]];
+        for (int i = 0; i < adj->size; i++) {
+            int t = adj->elem[i];
+            if (is_adjacent(t) && !bs_test(seen, t)) {
+                bs_set(seen, t);
+                if (is_precolored(t) || degree[t] >= K) {
+                    k++;
+                }
+            }
+        }
+    }
+    free_bitset(seen);
+    return k < K;
+}
+
+
+static void combine(int u, int v)
+{
+    state[v] = NODE_COALESCED;
+    alias[v] = u;
+
+    for (int i = 0; i < move_list[v].size; i++) {
+        list_add(&move_list[u], move_list[v].elem[i]);
+    }
+    enable_moves(v);
+
+    for (int i = 0; i < adj_list[v].size; i++) {
+        int t = adj_list[v].elem[i];
+        if (is_adjacent(t)) {
+            add_edge(t, u);
+            decrement_degree(t);
+        }
+    }
+
+    if (!is_precolored(u) && degree[u] >= K && state[u] == NODE_FREEZE) {
+        state[u] = NODE_SPILL;
+    }
+}
+
+
+static bool coalesce()
+{
+    int m;
+    for (m = 0; m < nr_move; m++) {
+        if (moves[m].state == MOVE_WORKLIST) {
+            break;
+        }
+    }
+    if (m == nr_move) {
+        return false;
+    }
+
+    int x = get_alias(moves[m].dst);
+    int y = get_alias(moves[m].src);
+    int u, v;
+    if (is_precolored(y)) {
+        u = y, v = x;
+    }
+    else {
+        u = x, v = y;
+    }
+
+    if (u == v) {
+        moves[m].state = MOVE_COALESCED;
+        add_work_list(u);
+    }
+    else if (is_precolored(v) || bs_test(adj_set, u * nr_node + v)) {
+        moves[m].state = MOVE_CONSTRAINED;
+        add_work_list(u);
+        add_work_list(v);
+    }
+    else {
+        bool ok;
+        if (is_precolored(u)) {
+            ok = true;
+            for (int i = 0; i < adj_list[v].size && ok; i++) {
+                int t = adj_list[v].elem[i];
+                ok = !is_adjacent(t) || george_ok(t, u);
+            }
+        }
+        else {
+            ok = conservative(u, v);
+        }
+
+        if (ok) {
+            moves[m].state = MOVE_COALESCED;
+            combine(u, v);
+            add_work_list(u);
+        }
+        else {
+            moves[m].state = MOVE_ACTIVE;
+        }
+    }
+    return true;
+}
+
+
+static void freeze_moves(int u)
+{
+    for (int i = 0; i < move_list[u].size; i++) {
+        int m = move_list[u].elem[i];
+        if (moves[m].state != MOVE_ACTIVE && moves[m].state != MOVE_WORKLIST) {
+            continue;
+        }
+
+        int x = moves[m].dst;
+        int y = moves[m].src;
+        int v = get_alias(y) == get_alias(u) ? get_alias(x) : get_alias(y);
+        moves[m].state = MOVE_FROZEN;
+
+        if (!is_precolored(v) && state[v] == NODE_FREEZE && !move_related(v) && degree[v] < K) {
+            state[v] = NODE_SIMPLIFY;
+        }
+    }
+}
+
+
+static bool pick_node(int which, int *n)
+{
+    for (int i = NR_REG; i < nr_node; i++) {
+        if (state[i] == which) {
+            *n = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void simplify(int n)
+{
+    state[n] = NODE_SELECT;
+    select_stack[nr_select++] = n;
+    for (int i = 0; i < adj_list[n].size; i++) {
+        int m = adj_list[n].elem[i];
+        if (is_adjacent(m)) {
+            decrement_degree(m);
+        }
+    }
+}
+
+
+static void select_spill()
+{
+    int victim = -1;
+    double best = 0;
+    for (int i = NR_REG; i < nr_node; i++) {
+        if (state[i] == NODE_SPILL) {
+            double c = cost[i] / (degree[i] ? degree[i] : 1);
+            if (victim == -1 || c < best) {
+                victim = i;
+                best = c;
+            }
+        }
+    }
+    state[victim] = NODE_SIMPLIFY;
+    freeze_moves(victim);
+}
+
+
+static void assign_colors()
+{
+    while (nr_select > 0) {
+        int n = select_stack[--nr_select];
+
+        bool ok[NR_REG];
+        for (int i = 0; i < NR_REG; i++) {
+            ok[i] = false;
+        }
+        for (int i = 0; i < K; i++) {
+            ok[colors[i]] = true;
+        }
+
+        for (int i = 0; i < adj_list[n].size; i++) {
+            int w = get_alias(adj_list[n].elem[i]);
+            if (is_precolored(w)) {
+                ok[w] = false;
+            }
+            else if (state[w] == NODE_COLORED) {
+                ok[color[w]] = false;
+            }
+        }
+
+        // Prefer the color of a move partner, so that the move disappears
+        int pick = 0;
+        for (int i = 0; i < move_list[n].size && !pick; i++) {
+            Move *mv = &moves[move_list[n].elem[i]];
+            int p = get_alias(mv->dst) == n ? get_alias(mv->src) : get_alias(mv->dst);
+            int c = is_precolored(p) ? p : (state[p] == NODE_COLORED ? color[p] : 0);
+            if (c && ok[c]) {
+                pick = c;
+            }
+        }
+        for (int i = 0; i < K && !pick; i++) {
+            if (ok[colors[i]]) {
+                pick = colors[i];
+            }
+        }
+
+        if (pick) {
+            state[n] = NODE_COLORED;
+            color[n] = pick;
+        }
+        else {
+            state[n] = NODE_SPILLED;
+        }
+    }
+
+    for (int i = NR_REG; i < nr_node; i++) {
+        if (state[i] == NODE_COALESCED) {
+            int a = get_alias(i);
+            color[i] = is_precolored(a) ? a : (state[a] == NODE_COLORED ? color[a] : 0);
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Interface
+//////////////////////////////////////////////////////////////////////////////
+
+
+//
+// Operands whose address is taken must stay in memory.
+// Only parameters of reference type can meet it now.
+//
+static void exclude_operands(Liveness *lv)
+{
+    int first = blk_buf[lv->start].start;
+    int last = blk_buf[lv->end - 1].end;
+
+    for (int i = first; i < last; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type == IR_ADDR && is_value(ir->rs)) {
+            state[node_of(ir->rs)] = NODE_EXCLUDED;
+        }
+    }
+}
+
+
+void color_registers(Liveness *lv)
+{
+    nr_node = NR_REG + lv->nr_ope;
+    adj_set = new_bitset(nr_node * nr_node);
+    adj_list = (IntList *)calloc(nr_node, sizeof(IntList));
+    move_list = (IntList *)calloc(nr_node, sizeof(IntList));
+    degree = (int *)calloc(nr_node, sizeof(int));
+    state = (int *)calloc(nr_node, sizeof(int));
+    alias = (int *)calloc(nr_node, sizeof(int));
+    color = (int *)calloc(nr_node, sizeof(int));
+    cost = (double *)calloc(nr_node, sizeof(double));
+    select_stack = (int *)calloc(nr_node, sizeof(int));
+    moves = NULL;
+    nr_move = cap_move = 0;
+    nr_select = 0;
+
+    for (int i = 0; i < nr_node; i++) {
+        if (is_precolored(i)) {
+            state[i] = NODE_PRECOLORED;
+            degree[i] = INT_MAX / 2;
+            color[i] = i;
+        }
+        else {
+            state[i] = NODE_INITIAL;
+        }
+    }
+
+    exclude_operands(lv);
+    build(lv);
+
+    for (int i = NR_REG; i < nr_node; i++) {
+        if (state[i] != NODE_INITIAL) {
+            continue;
+        }
+        if (degree[i] >= K) {
+            state[i] = NODE_SPILL;
+        }
+        else if (move_related(i)) {
+            state[i] = NODE_FREEZE;
+        }
+        else {
+            state[i] = NODE_SIMPLIFY;
+        }
+    }
+
+    for (;;) {
+        int n;
+        if (pick_node(NODE_SIMPLIFY, &n)) {
+            simplify(n);
+        }
+        else if (coalesce()) {
+            continue;
+        }
+        else if (pick_node(NODE_FREEZE, &n)) {
+            state[n] = NODE_SIMPLIFY;
+            freeze_moves(n);
+        }
+        else if (pick_node(NODE_SPILL, &n)) {
+            select_spill();
+        }
+        else {
+            break;
+        }
+    }
+
+    assign_colors();
+
+    for (int i = 0; i < lv->nr_ope; i++) {
+        int n = NR_REG + i;
+        lv->ope[i]->color = (state[n] == NODE_EXCLUDED) ? 0 : color[n];
+    }
+
+    for (int i = 0; i < nr_node; i++) {
+        free(adj_list[i].elem);
+        free(move_list[i].elem);
+    }
+    free_bitset(adj_set);
+    free(adj_list);
+    free(move_list);
+    free(degree);
+    free(state);
+    free(alias);
+    free(color);
+    free(cost);
+    free(select_stack);
+    free(moves);
+}
@@ -0,0 +1,12 @@
+//
+// Graph-coloring register allocation, used by the highest optimization level
+//
+
+#ifndef NJU_COMPILER_2015_GRAPH_COLOR_H
+#define NJU_COMPILER_2015_GRAPH_COLOR_H
+
+#include "liveness.h"
+
+void color_registers(Liveness *lv);
+
+#endif //NJU_COMPILER_2015_GRAPH_COLOR_H
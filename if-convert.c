@@ -0,0 +1,372 @@
+//
+// If-conversion of small diamonds and triangles into conditional moves
+//
+// A branch around a few cheap instructions costs more than computing both sides, when the
+// value of the side not taken is dropped by a conditional move (movn):
+//
+//   IF x >= #0 GOTO L1           t := x < #0
+//   y := #0 - x                  u := #0 - x
+//   GOTO L2                 =>   y := x
+//   LABEL L1                     y := u IF t != #0
+//   y := x
+//   LABEL L2
+//
+//   IF x <= m GOTO L1            t := x > m
+//   m := x                  =>   u := x
+//   LABEL L1                     m := u IF t != #0
+//
+// Each side has at most MAX_SIDE instructions without side effects (ASSIGN, ADD, SUB and the
+// comparisons), and assigns at most one value live at the join. Both sides then run whatever
+// the condition, so their additions are emitted by addu and subu (IR::wraps): the trapping
+// add could overflow on the side the source does not run.
+// The side selected by the movn is computed first into new temporaries, then the other side
+// as it is, so neither sees the results of the other. The condition of the movn is the
+// tested value itself if the moved side runs on v != #0, otherwise a new comparison.
+//
+// A side incrementing the value by 1 adds the 0 or 1 of the condition instead, and its
+// copies of values still valid at the movn are not emitted:
+//
+//   IF x == y GOTO L1            t := x != y
+//   n := n + #1             =>   n := n + t
+//   LABEL L1
+//
+// The branch costs 1 plus BRANCH_PENALTY for the cycle lost when it jumps or is
+// mispredicted. The conversion is done only if the code without branches is shorter than
+// the longer path through the branches with the penalty.
+//
+// The pass runs last: only the liveness analysis and the code generator know IR_MOVN.
+//
+
+#include "if-convert.h"
+#include "basic-block.h"
+#include "operand.h"
+#include "option.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
+
+
+#define MAX_SIDE 4
+#define BRANCH_PENALTY 1
+
+
+typedef struct {
+    int first;     // The instructions of the side are [first, last), without LABEL and GOTO
+    int last;
+    int cost;
+    Operand out;   // The value live at the join assigned by the side, NULL if none
+} Side;
+
+
+static bool is_cheap(IR *ir)
+{
+    return ir->type == IR_ASSIGN || ir->type == IR_ADD || ir->type == IR_SUB || is_compare(ir->type);
+}
+
+
+static bool is_zero(Operand ope)
+{
+    return ope->type == OPE_INTEGER && ope->integer == 0;
+}
+
+
+static bool get_side(int first, int last, Bitset live_join, Side *side)
+{
+    side->first = first;
+    side->last = last;
+    side->cost = 0;
+    side->out = NULL;
+
+    for (int i = first; i < last; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type == IR_NOP) {
+            continue;
+        }
+        if (!is_cheap(ir) || ++side->cost > MAX_SIDE) {
+            return false;
+        }
+        if (ir->rd->id >= 0 && bs_test(live_join, ir->rd->id)) {
+            if (side->out != NULL && side->out != ir->rd) {
+                return false;
+            }
+            side->out = ir->rd;
+        }
+    }
+    return true;
+}
+
+
+static bool assigns(Side *side, Operand ope)
+{
+    for (int i = side->first; i < side->last; i++) {
+        if (instr_buffer[i].type != IR_NOP && instr_buffer[i].rd == ope) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//
+// Instructions computing the condition x relop y of the movn, see gen_asm_compare
+//
+static int condition_cost(IR_Type relop, Operand x, Operand y, Side *direct)
+{
+    if (relop == IR_BNE && (is_zero(x) || is_zero(y))) {
+        Operand v = is_zero(y) ? x : y;
+        return is_value(v) && !assigns(direct, v) ? 0 : 1;
+    }
+    if (relop == IR_BLT || relop == IR_BGT || (relop == IR_BEQ && (is_zero(x) || is_zero(y)))) {
+        return 1;
+    }
+    return 2;
+}
+
+
+// A copy in the moved side is not emitted if its source still holds the value at the movn
+static bool is_forwarded(IR *ir, Side *direct)
+{
+    return ir->type == IR_ASSIGN && (!is_value(ir->rs) || !assigns(direct, ir->rs));
+}
+
+
+// x := x + #1 or x := x - #1 alone, done as x := x + t or x := x - t on the 0 or 1 of t
+static IR *get_increment(Side *moved, Side *direct)
+{
+    if (moved->cost != 1 || assigns(direct, moved->out)) {
+        return NULL;
+    }
+    for (int i = moved->first; i < moved->last; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type == IR_NOP) {
+            continue;
+        }
+        bool inc = ir->type == IR_ADD || ir->type == IR_SUB;
+        return inc && ir->rs == ir->rd && ir->rt->type == OPE_INTEGER && ir->rt->integer == 1 ? ir : NULL;
+    }
+    return NULL;
+}
+
+
+//
+// Instructions of the code without branches, INT_MAX if the side cannot be moved
+//
+static int straight_cost(IR_Type relop, IR *branch, Side *moved, Side *direct)
+{
+    if (moved->out == NULL) {
+        return INT_MAX;
+    }
+
+    int cond = condition_cost(relop, branch->rs, branch->rt, direct);
+    if (cond > 0 && get_increment(moved, direct) != NULL) {
+        return cond + 1 + direct->cost;
+    }
+
+    int cost = cond + direct->cost + 1;
+    for (int i = moved->first; i < moved->last; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type != IR_NOP && !is_forwarded(ir, direct)) {
+            cost++;
+        }
+    }
+    return cost;
+}
+
+
+static Operand new_temp()
+{
+    Operand ope = new_operand(OPE_TEMP);
+    ope->id = -1;
+    return ope;
+}
+
+
+//
+// Emit before pos: the condition, the moved side renamed, the direct side, and the movn
+//
+static void emit_select(int pos, IR_Type relop, Operand x, Operand y, Side *moved, Side *direct)
+{
+    Operand t;
+    if (condition_cost(relop, x, y, direct) == 0) {
+        t = is_zero(y) ? x : y;
+    }
+    else {
+        t = new_temp();
+        insert_before(pos, branch_to_compare(relop), x, y, t);
+
+        IR *inc = get_increment(moved, direct);
+        if (inc != NULL) {
+            for (int i = direct->first; i < direct->last; i++) {
+                IR *ir = &instr_buffer[i];
+                if (ir->type != IR_NOP) {
+                    insert_before(pos, ir->type, ir->rs, ir->rt, ir->rd)->wraps = true;
+                    ir->type = IR_NOP;
+                }
+            }
+            insert_before(pos, inc->type, inc->rd, t, inc->rd);
+            inc->type = IR_NOP;
+            return;
+        }
+    }
+
+    Operand from[MAX_SIDE], to[MAX_SIDE];
+    int n = 0;
+    for (int i = moved->first; i < moved->last; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type == IR_NOP) {
+            continue;
+        }
+        Operand rs = ir->rs, rt = ir->rt;
+        for (int k = 0; k < n; k++) {
+            if (rs == from[k]) rs = to[k];
+            if (rt == from[k]) rt = to[k];
+        }
+        from[n] = ir->rd;
+        if (is_forwarded(ir, direct)) {
+            to[n] = rs;
+        }
+        else {
+            to[n] = new_temp();
+            insert_before(pos, ir->type, rs, rt, to[n])->wraps = true;
+        }
+        n++;
+        ir->type = IR_NOP;
+    }
+
+    for (int i = direct->first; i < direct->last; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type != IR_NOP) {
+            insert_before(pos, ir->type, ir->rs, ir->rt, ir->rd)->wraps = true;
+            ir->type = IR_NOP;
+        }
+    }
+
+    // The last assignment of the value
+    Operand u = NULL;
+    for (int k = 0; k < n; k++) {
+        if (from[k] == moved->out) {
+            u = to[k];
+        }
+    }
+    assert(u != NULL);
+    insert_before(pos, IR_MOVN, u, t, moved->out);
+}
+
+
+//
+// The side not taken from the branch ending block b is b + 1. It falls into the join b + 2
+// in a triangle, otherwise it ends with GOTO, the side taken is b + 2 and the join b + 3.
+// Return the join, or -1 if not converted.
+//
+static int convert_branch(Liveness *lv, int b)
+{
+    Block *blk = &blk_buf[b];
+    IR *branch = &instr_buffer[blk->end - 1];
+    if (blk->start == blk->end || !is_branch(branch) || b + 2 >= lv->end) {
+        return -1;
+    }
+    if (branch->rs->type == OPE_INTEGER && branch->rt->type == OPE_INTEGER) {
+        return -1;
+    }
+
+    Block *fall = &blk_buf[b + 1];
+    if (instr_buffer[fall->start].type == IR_LABEL) {
+        return -1;  // Reached from elsewhere
+    }
+
+    IR *goto_join = &instr_buffer[fall->end - 1];
+    IR *label_taken = &instr_buffer[blk_buf[b + 2].start];
+    if (label_taken->type != IR_LABEL || label_taken->rs != branch->rd) {
+        return -1;
+    }
+
+    Side not_taken, taken;
+    int join;
+    IR *label_join;
+    if (goto_join->type == IR_JMP) {
+        // Diamond: the side taken is only reached from the branch and falls into the join
+        join = b + 3;
+        if (join >= lv->end || label_taken->rs->label_ref_cnt != 1) {
+            return -1;
+        }
+        label_join = &instr_buffer[blk_buf[join].start];
+        if (label_join->type != IR_LABEL || label_join->rs != goto_join->rs) {
+            return -1;
+        }
+        Bitset live = lv->in[join - lv->start];
+        if (!get_side(fall->start, fall->end - 1, live, &not_taken) ||
+                !get_side(blk_buf[b + 2].start + 1, blk_buf[b + 2].end, live, &taken)) {
+            return -1;
+        }
+    }
+    else {
+        join = b + 2;
+        label_join = label_taken;
+        goto_join = NULL;
+        Bitset live = lv->in[join - lv->start];
+        if (!get_side(fall->start, fall->end, live, &not_taken)) {
+            return -1;
+        }
+        taken.first = taken.last = fall->end;
+        taken.cost = 0;
+        taken.out = NULL;
+    }
+
+    if (taken.out != NULL && not_taken.out != NULL && taken.out != not_taken.out) {
+        return -1;
+    }
+
+    // Either side can be moved if it assigns the value, on its condition
+    IR_Type relop = branch->type, anti = get_relop_anti(relop);
+    int cost_taken = straight_cost(relop, branch, &taken, &not_taken);
+    int cost_not = straight_cost(anti, branch, &not_taken, &taken);
+    bool move_taken = cost_taken <= cost_not;
+    int straight = move_taken ? cost_taken : cost_not;
+    int path_not = not_taken.cost + (taken.cost > 0 ? 1 : 0);  // GOTO the next is removed
+    int branching = 1 + BRANCH_PENALTY + (path_not > taken.cost ? path_not : taken.cost);
+    if (straight == INT_MAX || straight >= branching || !has_room(straight)) {
+        return -1;
+    }
+
+    int pos = blk->end - 1;
+    if (move_taken) {
+        emit_select(pos, relop, branch->rs, branch->rt, &taken, &not_taken);
+    }
+    else {
+        emit_select(pos, anti, branch->rs, branch->rt, &not_taken, &taken);
+    }
+
+    branch->type = IR_NOP;
+    if (goto_join != NULL) {
+        goto_join->type = IR_NOP;
+        deref_label(label_join);
+    }
+    deref_label(label_taken);
+    return join;
+}
+
+
+void convert_ifs(Liveness *lv)
+{
+    int nr_diamond = 0, nr_triangle = 0;
+
+    for (int b = lv->start; b < lv->end; b++) {
+        int join = convert_branch(lv, b);
+        if (join == -1) {
+            continue;
+        }
+        if (join == b + 3) {
+            nr_diamond++;
+        }
+        else {
+            nr_triangle++;
+        }
+        b = join - 1;  // The join may end with the next branch
+    }
+
+    if (print_stats) {
+        fprintf(stderr, "if-convert: %s: %d diamonds, %d triangles\n",
+                instr_buffer[blk_buf[lv->start].start].rs->name, nr_diamond, nr_triangle);
+    }
+}
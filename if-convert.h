@@ -0,0 +1,12 @@
+//
+// If-conversion of small diamonds and triangles into conditional moves
+//
+
+#ifndef NJU_COMPILER_2015_IF_CONVERT_H
+#define NJU_COMPILER_2015_IF_CONVERT_H
+
+#include "liveness.h"
+
+void convert_ifs(Liveness *lv);
+
+#endif //NJU_COMPILER_2015_IF_CONVERT_H
@@ -0,0 +1,403 @@
+//
+// Inlining of small non-recursive functions
+//
+// The call graph is built from the CALLs in the instruction buffer. A function is recursive
+// if it reaches itself in the graph; it is never inlined, but the calls in it may be.
+// The functions are visited callees first, so that a function is inlined with the calls in
+// it already inlined.
+//
+// A call is replaced by a copy of the callee with fresh operands and labels. The ARGs become
+// assignments to the copies of the parameters (the ARG nearest to the CALL passes the first
+// parameter), and each RETURN becomes an assignment to the result and a jump to the end:
+//
+//     ARG v3                        v9 := v3
+//     t4 := CALL absolute           IF v9 < #0 GOTO L7
+//                            =>     t4 := v9
+//                                   GOTO L8
+//                                   LABEL L7 :
+//                                   t10 := #0 - v9
+//                                   t4 := t10
+//                                   LABEL L8 :
+//
+// A call is inlined if the callee is not much larger than the code of the call itself, or if
+// it is the only call of the callee. Functions no longer reachable from main are removed.
+// With -fprofile-use a call that never ran is only inlined as the only call, a hot call
+// accepts HOT_GROWTH, and the counts of the copy are scaled to the count of the call.
+//
+// A callee taking the address of a parameter (a struct passed by reference) is not inlined,
+// since the address of the parameter is where the caller passed it, not a variable.
+//
+
+#include "inline.h"
+#include "operand.h"
+#include "option.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+
+#define CALL_COST      8    // Instructions of a call besides the arguments: frame, $ra, jal, saves
+#define INLINE_GROWTH  8    // Code growth accepted for a call site
+#define HOT_GROWTH     32   // Code growth accepted for a hot call site
+#define MAX_CALLER     1024 // Stop inlining into a function larger than this
+
+typedef struct {
+    const char *name;
+    IR *code;         // code[0] is the FUNCTION
+    int n;
+    int cap;
+    int nr_param;
+    int nr_call;      // Call sites in the program
+    int nr_inlined;
+    bool recursive;
+    bool param_addr;  // The address of a parameter is taken
+    bool reached;     // From main
+    bool visited;
+} Function;
+
+static Function *func;
+static int nr_func;
+
+
+static int find_func(const char *name)
+{
+    for (int i = 0; i < nr_func; i++) {
+        if (!strcmp(func[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static void append(Function *f, IR *ir)
+{
+    if (f->n == f->cap) {
+        f->cap = f->cap * 2 + 16;
+        f->code = (IR *)realloc(f->code, sizeof(IR) * f->cap);
+    }
+    f->code[f->n++] = *ir;
+}
+
+
+//
+// Split the instruction buffer into functions
+//
+static void split_functions()
+{
+    func = (Function *)calloc(nr_instr + 1, sizeof(Function));
+    nr_func = 0;
+
+    for (int i = 0; i < nr_instr; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type == IR_FUNC) {
+            func[nr_func++].name = ir->rs->name;
+        }
+        if (ir->type == IR_NOP || nr_func == 0) {
+            continue;
+        }
+
+        Function *f = &func[nr_func - 1];
+        IR copy = *ir;
+        copy.block = 0;
+        copy.depend = NULL;
+        append(f, &copy);
+
+        if (ir->type == IR_PARAM) {
+            f->nr_param++;
+        }
+    }
+
+    for (int k = 0; k < nr_func; k++) {
+        Function *f = &func[k];
+        for (int i = 0; i < f->n; i++) {
+            IR *ir = &f->code[i];
+            if (ir->type == IR_ADDR) {
+                // The PARAMs follow the FUNCTION
+                for (int j = 1; j <= f->nr_param; j++) {
+                    if (f->code[j].rs == ir->rs) {
+                        f->param_addr = true;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+//
+// Mark the recursive functions with the transitive closure of the call graph
+//
+static void find_recursion()
+{
+    bool *reach = (bool *)calloc(nr_func * nr_func, sizeof(bool));
+
+    for (int k = 0; k < nr_func; k++) {
+        Function *f = &func[k];
+        for (int i = 0; i < f->n; i++) {
+            if (f->code[i].type == IR_CALL) {
+                int g = find_func(f->code[i].rs->name);
+                if (g != -1) {
+                    reach[k * nr_func + g] = true;
+                    func[g].nr_call++;
+                }
+            }
+        }
+    }
+
+    for (int m = 0; m < nr_func; m++) {
+        for (int a = 0; a < nr_func; a++) {
+            if (!reach[a * nr_func + m]) {
+                continue;
+            }
+            for (int b = 0; b < nr_func; b++) {
+                if (reach[m * nr_func + b]) {
+                    reach[a * nr_func + b] = true;
+                }
+            }
+        }
+    }
+
+    for (int k = 0; k < nr_func; k++) {
+        func[k].recursive = reach[k * nr_func + k];
+    }
+    free(reach);
+}
+
+
+static int code_size(Function *f)
+{
+    return f->n - 1 - f->nr_param;  // Without FUNCTION and PARAMs
+}
+
+
+static bool should_inline(Function *caller, Function *callee, IR *call, int total)
+{
+    if (callee == caller || callee->recursive || callee->param_addr || !strcmp(callee->name, "main")) {
+        return false;
+    }
+    if (caller->n + callee->n > MAX_CALLER || total + callee->n > MAX_LINE / 2) {
+        return false;
+    }
+    if (callee->nr_call == 1) {
+        return true;
+    }
+    if (has_profile && call->count == 0) {
+        return false;
+    }
+    int growth = is_hot(call->count) ? HOT_GROWTH : INLINE_GROWTH;
+    return code_size(callee) <= CALL_COST + callee->nr_param + growth;
+}
+
+
+//
+// Fresh copies of the operands of the callee at a call site
+//
+typedef struct {
+    Operand old;
+    Operand new;
+} Rename;
+
+static Rename *renamed;
+static int nr_renamed;
+
+
+static Operand clone_operand(Operand ope)
+{
+    if (ope == NULL) {
+        return NULL;
+    }
+
+    switch (ope->type) {
+        case OPE_VAR:
+        case OPE_REF:
+        case OPE_BOOL:
+        case OPE_TEMP:
+        case OPE_ADDR:
+        case OPE_LABEL:
+            break;
+        default:
+            return ope;  // Constants and functions are shared
+    }
+
+    for (int i = 0; i < nr_renamed; i++) {
+        if (renamed[i].old == ope) {
+            return renamed[i].new;
+        }
+    }
+
+    Operand copy = new_operand(ope->type);
+    copy->size = ope->size;
+    copy->base_type = ope->base_type;
+    copy->label_ref_cnt = ope->label_ref_cnt;
+    renamed[nr_renamed].old = ope;
+    renamed[nr_renamed].new = copy;
+    nr_renamed++;
+    return copy;
+}
+
+
+//
+// Replace the call ending the code of the caller by the body of the callee
+//
+static void inline_call(Function *caller, Function *callee, IR *call)
+{
+    nr_renamed = 0;
+    renamed = (Rename *)malloc(sizeof(Rename) * 3 * (callee->n + 1));
+
+    // The arguments, from the CALL backwards, pass the parameters in order
+    int param = 0;
+    for (int i = caller->n - 1; i > 0 && param < callee->nr_param; i--) {
+        IR *ir = &caller->code[i];
+        if (ir->type == IR_CALL || ir->type == IR_FUNC) {
+            break;
+        }
+        if (ir->type == IR_ARG) {
+            ir->type = IR_ASSIGN;
+            ir->rd = clone_operand(callee->code[1 + param].rs);
+            param++;
+        }
+    }
+    assert(param == callee->nr_param);
+
+    // This call runs the copy call->count times of the entries of the callee
+    int entries = callee->code[0].count;
+    double scale = entries > 0 ? (double)call->count / entries : 0;
+
+    Operand end = new_operand(OPE_LABEL);
+    int body = 1 + callee->nr_param;
+    for (int i = body; i < callee->n; i++) {
+        IR ir = callee->code[i];
+        for (int k = 0; k < NR_OPE; k++) {
+            ir.operand[k] = clone_operand(ir.operand[k]);
+        }
+        ir.count = (int)(ir.count * scale);
+        ir.taken = (int)(ir.taken * scale);
+
+        if (ir.type != IR_RET) {
+            append(caller, &ir);
+            continue;
+        }
+
+        if (call->rd != NULL) {
+            IR assign = { .type = IR_ASSIGN, .rs = ir.rs, .rd = call->rd, .count = ir.count };
+            append(caller, &assign);
+        }
+        if (i != callee->n - 1) {
+            IR jmp = { .type = IR_JMP, .rs = end, .count = ir.count };
+            append(caller, &jmp);
+            end->label_ref_cnt++;
+        }
+    }
+
+    if (end->label_ref_cnt > 0) {
+        IR label = { .type = IR_LABEL, .rs = end, .count = call->count };
+        append(caller, &label);
+    }
+
+    free(renamed);
+    caller->nr_inlined++;
+    callee->nr_call--;
+}
+
+
+//
+// Inline the calls in a function, after the functions it calls
+//
+static void visit(int k, int *total)
+{
+    Function *f = &func[k];
+    if (f->visited) {
+        return;
+    }
+    f->visited = true;
+
+    for (int i = 0; i < f->n; i++) {
+        if (f->code[i].type == IR_CALL) {
+            int g = find_func(f->code[i].rs->name);
+            if (g != -1) {
+                visit(g, total);
+            }
+        }
+    }
+
+    IR *code = f->code;
+    int n = f->n;
+    f->code = NULL;
+    f->n = f->cap = 0;
+
+    for (int i = 0; i < n; i++) {
+        int g = code[i].type == IR_CALL ? find_func(code[i].rs->name) : -1;
+        if (g != -1 && should_inline(f, &func[g], &code[i], *total)) {
+            *total += code_size(&func[g]) + 1;
+            inline_call(f, &func[g], &code[i]);
+        }
+        else {
+            append(f, &code[i]);
+        }
+    }
+    free(code);
+}
+
+
+static void mark_reached(int k)
+{
+    Function *f = &func[k];
+    if (f->reached) {
+        return;
+    }
+    f->reached = true;
+
+    for (int i = 0; i < f->n; i++) {
+        if (f->code[i].type == IR_CALL) {
+            int g = find_func(f->code[i].rs->name);
+            if (g != -1) {
+                mark_reached(g);
+            }
+        }
+    }
+}
+
+
+void inline_functions()
+{
+    split_functions();
+    find_recursion();
+
+    int total = nr_instr;
+    for (int k = 0; k < nr_func; k++) {
+        visit(k, &total);
+    }
+
+    int main_func = find_func("main");
+    for (int k = 0; k < nr_func; k++) {
+        if (main_func == -1) {
+            func[k].reached = true;
+        }
+    }
+    if (main_func != -1) {
+        mark_reached(main_func);
+    }
+
+    // Put back the functions still called
+    nr_instr = 0;
+    for (int k = 0; k < nr_func; k++) {
+        Function *f = &func[k];
+        if (print_stats && f->nr_inlined > 0) {
+            fprintf(stderr, "inline: %s: %d calls inlined\n", f->name, f->nr_inlined);
+        }
+        if (print_stats && !f->reached) {
+            fprintf(stderr, "inline: %s: removed\n", f->name);
+        }
+        if (f->reached) {
+            assert(nr_instr + f->n <= MAX_LINE);
+            memcpy(&instr_buffer[nr_instr], f->code, sizeof(IR) * f->n);
+            nr_instr += f->n;
+        }
+        free(f->code);
+    }
+
+    free(func);
+}
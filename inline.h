@@ -0,0 +1,12 @@
+//
+// Inlining of small non-recursive functions
+//
+
+#ifndef NJU_COMPILER_2015_INLINE_H
+#define NJU_COMPILER_2015_INLINE_H
+
+#include "ir.h"
+
+void inline_functions();
+
+#endif //NJU_COMPILER_2015_INLINE_H
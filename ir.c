@@ -2,7 +2,24 @@
 #include "operand.h"
 #include "basic-block.h"
 #include "asm.h"
+#include "mips.h"
 #include "register.h"
+#include "liveness.h"
+#include "graph-color.h"
+#include "dag.h"
+#include "const-prop.h"
+#include "dce.h"
+#include "loop.h"
+#include "inline.h"
+#include "tail-call.h"
+#include "pattern.h"
+#include "ssa.h"
+#include "if-convert.h"
+#include "scalar-replace.h"
+#include "stack-slot.h"
+#include "profile.h"
+#include "block-layout.h"
+#include "option.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -11,11 +28,11 @@
 extern FILE *asm_file;  // Stream to store assembly code.
 
 
-static Block blk_buf[MAX_LINE];
-static int nr_blk;
+Block blk_buf[MAX_LINE];
+int nr_blk;
 
 // 指令缓冲区
-static IR instr_buffer[MAX_LINE];
+IR instr_buffer[MAX_LINE];
 // 已经生成的指令数量
 int nr_instr;
 
@@ -71,6 +88,13 @@ static const char *ir_format[] = {
     [IR_ADDR]    = "%s := &%s",            // ADDR
     [IR_DEREF_R] = "%s := *%s",            // DEREF_R
     [IR_DEREF_L] = "%s*%s := %s",          // DEREF_L, 虽然地址在左边, 但是是参数
+    [IR_SEQ]     = "%s := %s == %s",       // SEQ
+    [IR_SLT]     = "%s := %s < %s",        // SLT
+    [IR_SLE]     = "%s := %s <= %s",       // SLE
+    [IR_SGT]     = "%s := %s > %s",        // SGT
+    [IR_SGE]     = "%s := %s >= %s",       // SGE
+    [IR_SNE]     = "%s := %s != %s",       // SNE
+    [IR_MOVN]    = "%s := %s IF %s != #0", // MOVN
     [IR_JMP]     = "%sGOTO %s",            // JMP
     [IR_BEQ]     = "IF %s == %s GOTO %s",  // BEQ
     [IR_BLT]     = "IF %s < %s GOTO %s",   // BLT
@@ -125,6 +149,9 @@ void print_single_instr(IR instr, FILE *file)
 // Calculate all variables' offset to the function entry
 // Check whether the function has subroutines.
 //
+// Operands colored by the register allocator need no stack slot, so it is run again
+// on each function after coloring, see optimize_in_block.
+//
 
 #define MAP_SIZE 4096
 
@@ -146,6 +173,8 @@ int in_func_check(IR buf[], int index, int n)
         memset(exists, 0, sizeof(exists));
         curr = &buf[index];
         curr->rs->size = 0;
+        curr->rs->nr_arg = 0;
+        curr->rs->takes_address = false;
         param_size = 0;
     }
     else if (type != IR_PARAM) {
@@ -161,7 +190,7 @@ int in_func_check(IR buf[], int index, int n)
                 case OPE_TEMP:
                 case OPE_BOOL:
                 case OPE_ADDR:
-                    if (!exists[ope->index]) {
+                    if (!exists[ope->index] && !ope->color) {
                         curr->rs->size += ope->size;
                         ope->address = curr->rs->size;  // Calc afterwards because the stack grows from high to low
                         exists[ope->index] = true;
@@ -177,13 +206,25 @@ int in_func_check(IR buf[], int index, int n)
         if (type == IR_CALL || type == IR_READ || type == IR_WRITE) {
             curr->rs->has_subroutine = true;
         }
+        if (type == IR_ADDR || type == IR_DEC) {
+            curr->rs->takes_address = true;
+        }
     }
     else {
-        curr->rs->nr_arg++;
-        buf[index].rs->is_param = true;
-        buf[index].rs->address = - param_size;
-        param_size += 4;
-        exists[buf[index].rs->index] = true;
+        Operand param = buf[index].rs;
+        param->is_param = true;
+        if (curr->rs->nr_arg++ < NR_ARG_REG) {
+            // Passed in register, backed up in the callee's own frame if not colored
+            if (!param->color) {
+                curr->rs->size += 4;
+                param->address = curr->rs->size;
+            }
+        }
+        else {
+            param->address = - param_size;
+            param_size += 4;
+        }
+        exists[param->index] = true;
     }
 
     return in_func_check(buf, index + 1, n);
@@ -194,7 +235,9 @@ int in_func_check(IR buf[], int index, int n)
 // 打印指令缓冲区中所有的已生成指令
 //
 void preprocess_ir();
+void optimize_ir();
 void optimize_in_block();
+int mark_cross_call(Block *blk);
 int compress_ir(IR buf[], int n);
 
 void print_instr(FILE *file)
@@ -202,6 +245,12 @@ void print_instr(FILE *file)
     // 相当于窥孔优化
     preprocess_ir();
 
+    // 插桩的代码不做中间代码上的优化, 基本块和 -fprofile-use 读入计数时的一致
+    init_profile();
+    if (profile_generate == NULL) {
+        optimize_ir();
+    }
+
     in_func_check(instr_buffer, 0, nr_instr);
 
     optimize_in_block();
@@ -221,24 +270,45 @@ void print_instr(FILE *file)
 
     FILE *predef = fopen("predefine.S", "r");
     char linebuf[128];  // 128 is enough?
+    if (delay_slots) {
+        fputs(".set noreorder\n", asm_file);
+    }
     while (fgets(linebuf, 128, predef)) {
         fputs(linebuf, asm_file);
+        // The predefined functions only jump with jr, its delay slot gets a nop
+        char op[8];
+        if (delay_slots && sscanf(linebuf, " %7s", op) == 1 && !strcmp(op, "jr")) {
+            fputs("  nop\n", asm_file);
+        }
     }
+    emit_profile_runtime(asm_file);
 
     // Handle each basic block
 
     for (int i = 0; i < nr_blk; i++) {
 
-        fprintf(asm_file, "#########################\n");
-        fprintf(asm_file, "###    basic block    ###\n");
-        fprintf(asm_file, "#########################\n");
+        mips_comment("#########################");
+        mips_comment("###    basic block    ###");
+        mips_comment("#########################");
 
         Block *blk = &blk_buf[i];
 
+        mark_cross_call(blk);
+
+        // The counter of the block goes after its LABEL or FUNCTION
+        int counted = blk->start;
+        if (instr_buffer[counted].type == IR_LABEL || instr_buffer[counted].type == IR_FUNC) {
+            counted++;
+        }
+
         int j;
         for (j = blk->start; j < blk->end - 1; j++) {
             IR *ir = instr_buffer + j;
 
+            if (profile_generate && j == counted) {
+                count_block(i);
+            }
+
             // Update destination's liveness information
             //
             // We may use the destination's next_use field to judge whether it is worth generating.
@@ -267,20 +337,39 @@ void print_instr(FILE *file)
 
         // Handle the last IR. We should choose a proper time to spill the value into memory.
 
+        if (profile_generate && j == counted) {
+            count_block(i);
+        }
+
         if (can_jump(instr_buffer + j)) {
             push_all();  // jump instr just load data, they don't change data.
             gen_asm(instr_buffer + j);
+            if (profile_generate && is_branch(instr_buffer + j)) {
+                count_fall_through(i);
+            }
         }
         else if (instr_buffer[j].type != IR_RET) {
-            gen_asm(instr_buffer + j);  // May change variables
+            // Update the information as above, or the dead sources would be written back
+            // into slots which may be shared with other values now
+            IR *ir = instr_buffer + j;
+            if (ir->rd) ir->rd->liveness = ir->rd_info.liveness, ir->rd->next_use = ir->rd_info.next_use;
+            gen_asm(ir);  // May change variables
+            if (ir->rs) ir->rs->liveness = ir->rs_info.liveness, ir->rs->next_use = ir->rs_info.next_use;
+            if (ir->rt) ir->rt->liveness = ir->rt_info.liveness, ir->rt->next_use = ir->rt_info.next_use;
             push_all();
         }
         else {
             gen_asm(instr_buffer + j);  // Local variables do not need to store when return
         }
 
+        if (profile_generate && counted == blk->end) {
+            count_block(i);  // A block of a single LABEL
+        }
+
         clear_reg_state();
     }
+
+    mips_flush(asm_file);
 }
 
 
@@ -338,6 +427,42 @@ int is_branch(IR *pIR)
     return IR_BEQ <= pIR->type && pIR->type <= IR_BNE;
 }
 
+//
+// 比较类指令与跳转类指令一一对应
+//
+int is_compare(IR_Type type)
+{
+    return IR_SEQ <= type && type <= IR_SNE;
+}
+
+IR_Type compare_to_branch(IR_Type type)
+{
+    return (IR_Type)(IR_BEQ + (type - IR_SEQ));
+}
+
+IR_Type branch_to_compare(IR_Type relop)
+{
+    return (IR_Type)(IR_SEQ + (relop - IR_BEQ));
+}
+
+//
+// relop 在两个整数上的结果
+//
+bool eval_relop(IR_Type relop, int a, int b)
+{
+    switch (relop) {
+        case IR_BEQ: return a == b;
+        case IR_BNE: return a != b;
+        case IR_BLT: return a < b;
+        case IR_BLE: return a <= b;
+        case IR_BGT: return a > b;
+        case IR_BGE: return a >= b;
+        default:
+            PANIC("Unexpected relop");
+            return false;
+    }
+}
+
 //
 // 检查是否为跳转类指令
 //
@@ -406,6 +531,33 @@ void deref_label(IR *pIR)
     }
 }
 
+//
+// 删除一条指令, 维护其跳转目标 LABEL 的引用计数, 最后一处引用删除时 LABEL 也一起删除
+// LABEL 可能已经随不可达的基本块删除了, 这时只减少计数
+//
+void remove_instr(IR *pIR)
+{
+    Operand label = NULL;
+    if (is_branch(pIR)) {
+        label = pIR->rd;
+    }
+    else if (pIR->type == IR_JMP) {
+        label = pIR->rs;
+    }
+    pIR->type = IR_NOP;
+
+    if (label == NULL) {
+        return;
+    }
+    for (int i = 0; i < nr_instr; i++) {
+        if (instr_buffer[i].type == IR_LABEL && instr_buffer[i].rs == label) {
+            deref_label(&instr_buffer[i]);
+            return;
+        }
+    }
+    label->label_ref_cnt--;
+}
+
 //
 // 压缩指令, 删除NOP
 //
@@ -420,18 +572,104 @@ int compress_ir(IR instr[], int n)
     return size;
 }
 
+//
+// 指令的延迟插入
+// 遍历函数时基本块还在使用, 指令缓冲区不能移动, 所以要插入的指令先记录下来,
+// 遍历结束后由 insert_pending 统一插入
+//
+
+typedef struct {
+    int pos;   // Inserted before instr_buffer[pos]
+    int seq;   // Keep the order of the instructions at the same position
+    IR ir;
+} Insertion;
+
+static Insertion *pending;
+static int nr_pending;
+static int max_pending;
+
+//
+// Whether n more instructions fit in the buffer
+//
+bool has_room(int n)
+{
+    return nr_instr + nr_pending + n < MAX_LINE;
+}
+
+
+//
+// 插入的指令执行的次数取插入位置的指令的次数, 见 profile.c
+// 返回记录的指令, 在下一次插入之前有效
+//
+IR *insert_before(int pos, IR_Type type, Operand rs, Operand rt, Operand rd)
+{
+    if (nr_pending == max_pending) {
+        max_pending = max_pending * 2 + 16;
+        pending = (Insertion *)realloc(pending, sizeof(Insertion) * max_pending);
+    }
+
+    Insertion *ins = &pending[nr_pending];
+    memset(ins, 0, sizeof(*ins));
+    ins->pos = pos;
+    ins->seq = nr_pending++;
+    ins->ir.type = type;
+    ins->ir.rs = rs;
+    ins->ir.rt = rt;
+    ins->ir.rd = rd;
+    ins->ir.count = pos < nr_instr ? instr_buffer[pos].count : 0;
+    return &ins->ir;
+}
+
+
+//
+// Insert the instructions recorded, and remove the IR_NOPs
+//
+static int cmp_insertion(const void *a, const void *b)
+{
+    const Insertion *x = (const Insertion *)a, *y = (const Insertion *)b;
+    return x->pos != y->pos ? x->pos - y->pos : x->seq - y->seq;
+}
+
+void insert_pending()
+{
+    if (nr_pending == 0) {  // pending may still be NULL
+        nr_instr = compress_ir(instr_buffer, nr_instr);
+        return;
+    }
+
+    qsort(pending, nr_pending, sizeof(Insertion), cmp_insertion);
+
+    IR *buf = (IR *)malloc(sizeof(IR) * (nr_instr + 1));
+    memcpy(buf, instr_buffer, sizeof(IR) * nr_instr);
+    int n = nr_instr;
+
+    nr_instr = 0;
+    int k = 0;
+    for (int i = 0; i <= n; i++) {
+        for (; k < nr_pending && pending[k].pos == i; k++) {
+            instr_buffer[nr_instr++] = pending[k].ir;
+        }
+        if (i < n && buf[i].type != IR_NOP) {
+            instr_buffer[nr_instr++] = buf[i];
+        }
+    }
+
+    nr_pending = 0;
+    free(buf);
+}
+
 //
 // 预处理
 //   预处理主要干以下工作:
-//   1. 将 Label 的编号替换为指令编号, 方便阅读
-//   2. 将下面的模式:
+//   1. 统计 Label 的引用计数
+//   2. 按 pattern.c 中的模式表改写指令窗口, 例如将下面的模式:
 //        IF cond GOTO L0
 //        GOTO L1
 //        LABEL L0
 //      替换成:
 //        IF !cond GOTO L1
-//      当然可能要确保 L0 的引用只有这一处, 否则还是要保留 LABEL L0 的
-//   3. 将 2 产生的 NOP 通过移动数组删除(那样子标签编号要最后做)
+//      改写时维护 Label 的引用计数, 引用归零的 Label 一起删除
+//   3. 将 2 产生的 NOP 通过移动数组删除
 //
 void preprocess_ir()
 {
@@ -448,48 +686,8 @@ void preprocess_ir()
         pIR++;
     }
 
-    // 简单的模式处理: Label true 就在 GOTO false 下面
-    // 以及 goto 后面就是对应的 label
-    pIR = &instr_buffer[0];
-    for (int i = 0; i < nr_instr - 2; i++) {
-        if (is_branch(pIR) &&
-                (pIR + 1)->type == IR_JMP &&
-                (pIR + 2)->type == IR_LABEL &&
-                pIR->rd == (pIR + 2)->rs) {
-            pIR->type = get_relop_anti(pIR->type);
-            deref_label(pIR + 2);
-            pIR->rd = (pIR + 1)->rs;
-            (pIR + 1)->type = IR_NOP;
-        }
-        else if (pIR->type == IR_JMP &&
-                (pIR + 1)->type == IR_LABEL &&
-                (pIR + 1)->rs == pIR->rs) {
-            // goto 后面就是对应的 label
-            pIR->type = IR_NOP;
-            deref_label(pIR + 1);
-        }
-        pIR++;
-    }
-
-    // 简单的模式处理: 连续 Label 归一
-    IR *preLabel = NULL;
-    pIR = &instr_buffer[0];
-    for (int i = 0; i < nr_instr; i++) {
-        if (pIR->type == IR_LABEL && preLabel == NULL) {
-            preLabel = pIR;
-        }
-        else if (pIR->type != IR_LABEL) {
-            preLabel = NULL;
-        }
-        else {
-            // 连续 Label
-            preLabel->rs->label_ref_cnt += pIR->rs->label_ref_cnt;
-            replace_operand_global(preLabel->rs, pIR->rs);
-            pIR->type = IR_NOP;
-            pIR->rs = NULL;
-        }
-        pIR++;
-    }
+    // 按模式表改写指令窗口, 直到没有模式可以匹配
+    rewrite_patterns();
 
     // 第一次压缩
     nr_instr = compress_ir(instr_buffer, nr_instr);
@@ -498,9 +696,10 @@ void preprocess_ir()
 //
 // 分析基本块: 活跃性分析
 // end 不可取
+// live_out 是全局活跃性分析得到的出口活跃集合, 跨越基本块的临时变量也需要在块尾保存
 //
 
-void optimize_liveness(int start, int end)
+void optimize_liveness(int start, int end, Bitset live_out)
 {
     // Init
     for (int i = end - 1; i >= start; i--) {
@@ -516,6 +715,9 @@ void optimize_liveness(int start, int end)
             if (ope->type == OPE_VAR || ope->type == OPE_BOOL) {
                 ope->liveness = ALIVE;
             }
+            else if (is_value(ope) && bs_test(live_out, ope->id)) {
+                ope->liveness = ALIVE;
+            }
             else {
                 ope->liveness = DISALIVE;
             }
@@ -542,7 +744,7 @@ void optimize_liveness(int start, int end)
         }
 
         for (int k = 0; k < NR_OPE; k++) {
-            if (k != RD_IDX && ir->operand[k] && is_tmp(ir->operand[k])) {
+            if ((k != RD_IDX || ir->type == IR_MOVN) && ir->operand[k] && is_tmp(ir->operand[k])) {
                 ir->operand[k]->liveness = ALIVE;
                 ir->operand[k]->next_use = i;
             }
@@ -550,16 +752,222 @@ void optimize_liveness(int start, int end)
     }
 }
 
+//
+// 标记基本块中跨越函数调用的变量, 即在某次调用前后都出现的变量, 返回其个数
+// 局部分配器只把这些变量放在 callee-saved 寄存器中, 其余的值都放在 caller-saved 寄存器中
+//
+
+int mark_cross_call(Block *blk)
+{
+    for (int i = blk->start; i < blk->end; i++) {
+        for (int k = 0; k < NR_OPE; k++) {
+            Operand ope = instr_buffer[i].operand[k];
+            if (ope) {
+                ope->cross_call = 0;
+            }
+        }
+    }
+
+    int count = 0;
+    int seg = blk->start;  // 上一次调用之后的第一条指令
+    for (int i = blk->start; i < blk->end; i++) {
+        IR *ir = &instr_buffer[i];
+
+        if (ir->type == IR_CALL) {
+            for (int p = seg; p < i; p++) {
+                for (int k = 0; k < NR_OPE; k++) {
+                    Operand ope = instr_buffer[p].operand[k];
+                    if (ope && ope->cross_call == 0) {
+                        ope->cross_call = 1;
+                    }
+                }
+            }
+            seg = i;  // 调用的返回值属于调用之后
+        }
+
+        for (int k = 0; k < NR_OPE; k++) {
+            Operand ope = ir->operand[k];
+            if (ope && (ope->type == OPE_VAR || ope->type == OPE_BOOL) && ope->cross_call == 1) {
+                ope->cross_call = 2;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+//
+// 统计函数用到的 callee-saved 寄存器, 由 gen_asm_func 保存, gen_asm_return 恢复
+//   -O2 下着色结果是确定的;
+//   局部分配器在块尾清空状态, 且总是取第一个空闲的 $s 寄存器,
+//   所以用到的是 $s0 开始的一段, 长度不超过单个基本块中跨越调用的变量个数.
+//   main 直接返回到启动代码, 不需要保存.
+//
+
+static void mark_saved_regs(int func, int end, Liveness *lv)
+{
+    Operand func_ope = instr_buffer[blk_buf[func].start].rs;
+    func_ope->saved_regs = 0;
+
+    if (!strcmp(func_ope->name, "main")) {
+        return;
+    }
+
+    int nr_save = 0;
+    for (int b = func; b < end && opt_level < 2; b++) {
+        int n = mark_cross_call(&blk_buf[b]);
+        nr_save = nr_save > n ? nr_save : n;
+    }
+    for (int i = 0; i < nr_save && i <= S7 - S0; i++) {
+        func_ope->saved_regs |= 1u << (S0 + i);
+    }
+
+    for (int i = 0; i < lv->nr_ope; i++) {
+        int color = lv->ope[i]->color;
+        if (color >= S0 && color <= S7) {
+            func_ope->saved_regs |= 1u << color;
+        }
+    }
+}
+
+//
+// 在每个函数上运行一遍优化
+// 每遍都重新划分基本块, 因为上一遍可能改变了控制流
+//
+static void for_each_function(void (*pass)(Liveness *lv))
+{
+    nr_blk = block_partition(blk_buf, instr_buffer, nr_instr);
+    construct_cfg(blk_buf, nr_blk, instr_buffer, nr_instr);
+
+    for (int func = 0; func < nr_blk; ) {
+        int end = func_block_end(blk_buf, nr_blk, instr_buffer, func);
+
+        Liveness lv;
+        analyze_liveness(&lv, func, end);
+        pass(&lv);
+        free_liveness(&lv);
+
+        func = end;
+    }
+}
+
+//
+// 运行一遍优化, 之后压缩删除的指令
+//
+static void run_pass(void (*pass)(Liveness *lv))
+{
+    for_each_function(pass);
+    nr_instr = compress_ir(instr_buffer, nr_instr);
+}
+
+static void number_values(Liveness *lv)
+{
+    for (int i = lv->start; i < lv->end; i++) {
+        optimize_dag(blk_buf[i].start, blk_buf[i].end, lv->out[i - lv->start]);
+    }
+}
+
+//
+// 与机器无关的优化, -O1 起进行
+//   1. 全局的条件常量传播, 折叠结果确定的分支, 删除不可达的基本块
+//   2. 逐基本块构造 DAG, 做局部值编号(公共子表达式, 常量折叠, 代数化简)并重新生成指令,
+//      跨块活跃的临时变量由全局活跃性分析给出
+//   3. 删除不可达的基本块和结果不再使用的指令, 直到不动点
+//   在这之前把只用常量偏移访问的小数组和结构体拆成标量变量, -O2 下完全展开循环后再拆一次
+//   4. -O2 下展开计数循环, 次数少的完全展开, 否则每次迭代执行 4 份循环体, 剩余的迭代由原循环完成
+//   5. -O2 下把循环不变的计算移到循环的前置块中, 对归纳变量做强度削弱和测试替换
+//   6. -O2 下最后转成 SSA 形式做跨基本块的复制传播, 再翻译回来
+//   7. 最后把小的 if/else 变成条件复制 (movn), 由代价模型决定是否比分支更好
+//   8. 按边的频率 (静态估计或 -fprofile-use 的计数) 重新排列基本块, 循环的测试移到循环体之后
+// 在这些优化之前先把尾递归变成跳转, -O2 下再内联小的非递归函数
+//
+void optimize_ir()
+{
+    if (opt_level < 1) {
+        return;
+    }
+
+    // 尾递归变成循环后, 原来递归的函数也可以内联
+    eliminate_tail_recursion();
+
+    // 内联后被调用者的代码和调用者一起优化
+    if (opt_level >= 2) {
+        inline_functions();
+    }
+
+    // 只用常量下标访问的小数组和结构体换成变量, 之后的优化把它们当作普通变量
+    run_pass(replace_aggregates);
+    run_pass(propagate_constants);
+    run_pass(number_values);
+    run_pass(eliminate_dead_code);
+
+    // 提出循环的值和新的归纳变量跨越基本块, 只有图着色分配器能把它们留在寄存器中
+    // 循环优化插入的指令在遍历函数之后统一插入, 替换后留下的复制和死代码再清理一次
+    if (opt_level >= 2) {
+        // 展开后的循环体副本先做一遍常量传播和值编号, 完全展开时归纳变量变成常量
+        for_each_function(unroll_loops);
+        insert_pending();
+        run_pass(propagate_constants);
+        run_pass(number_values);
+        run_pass(replace_aggregates);
+        run_pass(eliminate_dead_code);
+
+        for_each_function(move_loop_invariants);
+        insert_pending();
+        for_each_function(reduce_induction_variables);
+        insert_pending();
+        run_pass(number_values);
+        run_pass(eliminate_dead_code);
+
+        // 在 SSA 形式上做稀疏的复制传播和死代码删除, 翻译回来时 phi 变成前驱中的复制,
+        // 插入之后再合并同一变量的各个版本之间互不冲突的复制
+        for_each_function(optimize_ssa);
+        insert_pending();
+        run_pass(coalesce_copies);
+    }
+
+    // 之后的优化都不认识 MOVN, 所以放在最后
+    for_each_function(convert_ifs);
+    insert_pending();
+
+    // 基本块沿着可能的路径排列, 跳转尽量变成下落
+    layout_blocks();
+}
+
 //
 // 基本块
+//   1. 划分基本块, 构造控制流图
+//   2. 逐函数进行全局活跃性分析, 然后计算块内的下次使用信息
+//   3. 最高优化级别下进行图着色寄存器分配
+//   4. -O1 起留在内存中的值按活跃区间共用栈槽, 缩小栈帧
 //
 void optimize_in_block()
 {
     nr_blk = block_partition(blk_buf, instr_buffer, nr_instr);
-    for (int i = 0; i < nr_blk; i++) {
-        int beg = blk_buf[i].start;
-        int end = blk_buf[i].end;
-        optimize_liveness(beg, end);
+    construct_cfg(blk_buf, nr_blk, instr_buffer, nr_instr);
+
+    for (int func = 0; func < nr_blk; ) {
+        int end = func_block_end(blk_buf, nr_blk, instr_buffer, func);
+
+        Liveness lv;
+        analyze_liveness(&lv, func, end);
+
+        for (int i = func; i < end; i++) {
+            optimize_liveness(blk_buf[i].start, blk_buf[i].end, lv.out[i - func]);
+        }
+
+        if (opt_level >= 2) {
+            color_registers(&lv);
+            in_func_check(instr_buffer, blk_buf[func].start, blk_buf[end - 1].end);
+        }
+
+        if (opt_level >= 1) {
+            share_stack_slots(&lv);
+        }
+
+        mark_saved_regs(func, end, &lv);
+
+        free_liveness(&lv);
+        func = end;
     }
 }
-
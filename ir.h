@@ -41,19 +41,36 @@ typedef struct {
         };
         OptimizeInfo info[NR_OPE];
     };
+    int count;       // Times executed in the profile of -fprofile-use, see profile.c
+    int taken;       // Times a branch jumped in the profile
+    bool wraps;      // Moved where it may run when it did not: addu/subu, which do not trap
 } IR;
 
+// 指令缓冲区
+extern IR instr_buffer[];
+extern int nr_instr;
+
 //
 // 中间代码模块对外接都口
 //
 int new_instr(IR_Type type, Operand rs, Operand rt, Operand rd);
 void print_instr(FILE *stream);
 IR_Type get_relop(const char *sym);
+IR_Type get_relop_anti(IR_Type relop);
 int replace_operand_global(Operand newbie, Operand old);
 bool is_const(Operand ope);
 Operand calc_const(IR_Type op, Operand left, Operand right);
 int is_branch(IR *pIR);
+int is_compare(IR_Type type);
+IR_Type compare_to_branch(IR_Type type);
+IR_Type branch_to_compare(IR_Type relop);
+bool eval_relop(IR_Type relop, int a, int b);
 bool can_jump(IR *pIR);
+void deref_label(IR *pIR);
+void remove_instr(IR *pIR);
+bool has_room(int n);
+IR *insert_before(int pos, IR_Type type, Operand rs, Operand rt, Operand rd);
+void insert_pending();
 
 const char *ir_to_s(IR *);
 #endif // __IR_H__
@@ -75,6 +75,15 @@ typedef enum IR_Type {
     IR_DEREF_R,  // 获取 rs 指向的地址的值
     IR_DEREF_L,  // 写入 rd 指向的地址
 
+    // 比较类指令, rd := rs relop rt, 结果为 0 或 1, 顺序与跳转类指令一致
+    IR_SEQ,
+    IR_SLT,
+    IR_SLE,
+    IR_SGT,
+    IR_SGE,
+    IR_SNE,
+    IR_MOVN,     // 条件复制, rt 不为 0 时 rd := rs, 否则 rd 不变, 所以 rd 也是源操作数
+
     // 跳转类指令, 含义参考 MIPS
     IR_JMP,
     IR_BEQ,
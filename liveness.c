@@ -0,0 +1,243 @@
+//
+// Global liveness analysis over the control flow graph of a function
+//
+// The classic backward data flow problem:
+//   out[b] = U in[s] for s in succ(b)
+//   in[b]  = use[b] U (out[b] - def[b])
+//
+// Value operands (variables, bools, temporaries and addresses) of the function are
+// numbered densely through Operand::id, so that the sets can be bit sets.
+//
+
+#include "liveness.h"
+#include "basic-block.h"
+#include "operand.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+//
+// Operands holding a value which can live in a register
+// REF stands for the memory of an array or a structure, it is never a value.
+//
+bool is_value(Operand ope)
+{
+    if (ope == NULL) {
+        return false;
+    }
+
+    switch (ope->type) {
+        case OPE_VAR:
+        case OPE_BOOL:
+        case OPE_TEMP:
+        case OPE_ADDR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+//
+// The value operand written by the instruction, return the count.
+// PARAM defines its parameter on the function entry.
+//
+int get_def(IR *ir, Operand def[])
+{
+    switch (ir->type) {
+        case IR_ASSIGN:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+        case IR_MOVN:
+        case IR_ADDR:
+        case IR_DEREF_R:
+        case IR_CALL:
+        case IR_READ:
+            def[0] = ir->rd;
+            return is_value(ir->rd);
+        case IR_PARAM:
+            def[0] = ir->rs;
+            return is_value(ir->rs);
+        default:
+            return 0;
+    }
+}
+
+
+//
+// The value operands read by the instruction, return the count.
+//
+// ARG does not read its operand, the value is loaded when the CALL is translated,
+// so the CALL uses all ARGs between the previous CALL and itself.
+// The address of ADDR is not a use of the value.
+// MOVN reads its destination, which keeps the old value if the condition is 0.
+//
+int get_use(IR *ir, Operand use[])
+{
+    int n = 0;
+
+    switch (ir->type) {
+        case IR_ASSIGN:
+        case IR_DEREF_R:
+        case IR_RET:
+        case IR_WRITE:
+            if (is_value(ir->rs)) use[n++] = ir->rs;
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+        case IR_DEREF_L:
+        case IR_BEQ:
+        case IR_BLT:
+        case IR_BLE:
+        case IR_BGT:
+        case IR_BGE:
+        case IR_BNE:
+            if (is_value(ir->rs)) use[n++] = ir->rs;
+            if (is_value(ir->rt)) use[n++] = ir->rt;
+            break;
+        case IR_MOVN:
+            if (is_value(ir->rs)) use[n++] = ir->rs;
+            if (is_value(ir->rt)) use[n++] = ir->rt;
+            if (is_value(ir->rd)) use[n++] = ir->rd;  // Kept when rt is 0
+            break;
+        case IR_CALL:
+            for (IR *arg = ir - 1; arg >= instr_buffer && arg->type != IR_CALL && arg->type != IR_FUNC; arg--) {
+                if (arg->type == IR_ARG && is_value(arg->rs) && n < MAX_USE) {
+                    use[n++] = arg->rs;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    return n;
+}
+
+
+//
+// Number the value operands of the function
+//
+static void number_operands(Liveness *lv)
+{
+    int first = blk_buf[lv->start].start;
+    int last = blk_buf[lv->end - 1].end;
+
+    for (int i = first; i < last; i++) {
+        for (int k = 0; k < NR_OPE; k++) {
+            Operand ope = instr_buffer[i].operand[k];
+            if (is_value(ope)) {
+                ope->id = -1;
+            }
+        }
+    }
+
+    lv->nr_ope = 0;
+    lv->ope = (Operand *)malloc(sizeof(Operand) * (3 * (last - first) + 1));
+
+    for (int i = first; i < last; i++) {
+        for (int k = 0; k < NR_OPE; k++) {
+            Operand ope = instr_buffer[i].operand[k];
+            if (is_value(ope) && ope->id == -1) {
+                ope->id = lv->nr_ope;
+                lv->ope[lv->nr_ope++] = ope;
+            }
+        }
+    }
+}
+
+
+void analyze_liveness(Liveness *lv, int start, int end)
+{
+    lv->start = start;
+    lv->end = end;
+
+    number_operands(lv);
+
+    int nr = end - start;
+    Bitset *use = (Bitset *)malloc(sizeof(Bitset) * nr);
+    Bitset *def = (Bitset *)malloc(sizeof(Bitset) * nr);
+    lv->in = (Bitset *)malloc(sizeof(Bitset) * nr);
+    lv->out = (Bitset *)malloc(sizeof(Bitset) * nr);
+
+    // Local use and def sets, scan backward
+    for (int b = 0; b < nr; b++) {
+        Block *blk = &blk_buf[start + b];
+        use[b] = new_bitset(lv->nr_ope);
+        def[b] = new_bitset(lv->nr_ope);
+        lv->in[b] = new_bitset(lv->nr_ope);
+        lv->out[b] = new_bitset(lv->nr_ope);
+
+        for (int i = blk->end - 1; i >= blk->start; i--) {
+            Operand ope[MAX_USE];
+            int n = get_def(&instr_buffer[i], ope);
+            for (int k = 0; k < n; k++) {
+                bs_set(def[b], ope[k]->id);
+                bs_reset(use[b], ope[k]->id);
+            }
+            n = get_use(&instr_buffer[i], ope);
+            for (int k = 0; k < n; k++) {
+                bs_set(use[b], ope[k]->id);
+            }
+        }
+    }
+
+    // Iterate to the fixed point, visiting blocks backward converges faster
+    Bitset tmp = new_bitset(lv->nr_ope);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = nr - 1; b >= 0; b--) {
+            Block *blk = &blk_buf[start + b];
+            for (int k = 0; k < 2; k++) {
+                int succ = blk->next[k];
+                if (start <= succ && succ < end && (k == 0 || succ != blk->next[0])) {
+                    bs_union(lv->out[b], lv->in[succ - start]);
+                }
+            }
+            bs_copy(tmp, lv->out[b]);
+            bs_subtract(tmp, def[b]);
+            bs_union(tmp, use[b]);
+            if (!bs_equal(tmp, lv->in[b])) {
+                bs_copy(lv->in[b], tmp);
+                changed = true;
+            }
+        }
+    }
+    free_bitset(tmp);
+
+    for (int b = 0; b < nr; b++) {
+        free_bitset(use[b]);
+        free_bitset(def[b]);
+    }
+    free(use);
+    free(def);
+}
+
+
+void free_liveness(Liveness *lv)
+{
+    for (int b = 0; b < lv->end - lv->start; b++) {
+        free_bitset(lv->in[b]);
+        free_bitset(lv->out[b]);
+    }
+    free(lv->in);
+    free(lv->out);
+    free(lv->ope);
+}
@@ -0,0 +1,32 @@
+//
+// Global liveness analysis over the control flow graph of a function
+//
+
+#ifndef NJU_COMPILER_2015_LIVENESS_H
+#define NJU_COMPILER_2015_LIVENESS_H
+
+#include "ir.h"
+#include "bitset.h"
+
+#define MAX_USE 64  // A call uses all of its arguments
+
+typedef struct {
+    int start;      // Blocks of the function are [start, end)
+    int end;
+    int nr_ope;     // Value operands are numbered by Operand::id from 0
+    Operand *ope;   // id -> operand
+    Bitset *in;     // Live-in set of each block, indexed by block index - start
+    Bitset *out;    // Live-out set of each block
+} Liveness;
+
+bool is_value(Operand ope);
+
+int get_def(IR *ir, Operand def[]);
+
+int get_use(IR *ir, Operand use[]);
+
+void analyze_liveness(Liveness *lv, int start, int end);
+
+void free_liveness(Liveness *lv);
+
+#endif //NJU_COMPILER_2015_LIVENESS_H
@@ -0,0 +1,1426 @@
+//
+// Natural loops, loop-invariant code motion, induction variables and unrolling
+//
+// Dominators are computed over the blocks of a function with the iterative data flow
+//   dom[entry] = { entry }
+//   dom[b]     = { b } U (^ dom[p] for p in pred(b))
+// An edge n -> h where h dominates n is a back edge. The natural loop of it consists of h
+// and the blocks reaching n without passing through h. Loops sharing a header are merged.
+//
+// A loop gets a preheader placed right before its header LABEL, so that the code falling
+// into the loop passes through it. The jumps to the header from outside of the loop are
+// redirected to a new LABEL at the start of the preheader:
+//
+//     LABEL L2 :                        t1 := &r0          (preheader)
+//     IF v1 >= #10 GOTO L1              LABEL L2 :
+//     t1 := &r0                  =>     IF v1 >= #10 GOTO L1
+//     t2 := v1 * #4                     t2 := v1 * #4
+//     ...                               ...
+//     GOTO L2                           GOTO L2
+//
+// An instruction is moved into the preheader if
+//   1. it has no side effects and can not trap: no division, and the additions and
+//      subtractions moved, which may now run when the source does not run them, are
+//      computed by addu and subu (IR::wraps), which do not trap on overflow,
+//   2. its operands are constants, not assigned in the loop, or assigned only by
+//      instructions already moved which dominate it,
+//   3. it is the only assignment of its result in the loop,
+//   4. the result is not live on the loop entry, i.e. never read before the assignment,
+//   5. the result is not live when leaving the loop, or the block dominates all exits.
+// Loads are only moved out of loops without stores or calls, and only from blocks running
+// whenever the loop is entered: the header, or, if the first test of the header is known to
+// enter the body, a block passed on every way around and out of the loop. A load the source
+// guards by a test of the index is left in the loop.
+//
+// A basic induction variable i is assigned only by i := i + #k in the loop. A value
+// c * i + b with c and b invariant, e.g. the address of a[i], is then tracked by a new
+// variable s, initialized in the preheader and increased by c * k after each update of i,
+// which replaces the multiplication:
+//
+//     LABEL L2 :                        s1 := v1 * #4
+//     IF v1 >= #10 GOTO L1              s2 := t1 + s1
+//     t2 := v1 * #4                     LABEL L2 :
+//     t3 := t1 + t2              =>     IF s2 >= t9 GOTO L1     (t9 := t1 + #40 in the preheader)
+//     *t3 := #0                         t2 := s1
+//     v1 := v1 + #1                     t3 := s2
+//     GOTO L2                           *t3 := #0
+//                                       v1 := v1 + #1
+//                                       s1 := s1 + #4
+//                                       s2 := s2 + #4
+//                                       GOTO L2
+//
+// s is computed ahead of the source, after the last update of i too, so its additions are
+// emitted by addu (IR::wraps) and do not trap.
+//
+// If i is only used by its update and compared with constants, and dead after the loop,
+// the comparisons are rewritten on s (linear function test replacement), as long as the
+// limit of s can not wrap. Then the dead updates of i and of the unused s are removed by
+// the dead code elimination.
+//
+// An innermost loop counting i by a constant step up to an invariant bound is unrolled. If i
+// starts from a constant and the bound is constant, a loop of a few iterations is replaced
+// by that many copies of its body, which the constant propagation then specializes:
+//
+//     v1 := #0                          v1 := #0
+//     LABEL L2 :                        WRITE v1
+//     IF v1 >= #3 GOTO L1               v1 := v1 + #1
+//     WRITE v1                   =>     WRITE v1
+//     v1 := v1 + #1                     v1 := v1 + #1
+//     GOTO L2                           WRITE v1
+//     LABEL L1 :                        v1 := v1 + #1
+//
+// Otherwise if the body has no branches, a loop running 4 copies of it is put in front of
+// the loop, for as long as all of the 4 iterations would run, and the original loop runs the
+// remaining ones. The copies form one block, where the value numbering merges the updates
+// of i, so that i is still an induction variable:
+//
+//     LABEL L2 :                        IF v5 < #-2147483645 GOTO L2
+//     IF v1 >= v5 GOTO L1               t9 := v5 - #3
+//     v3 := v3 + v1                     LABEL L9 :
+//     v1 := v1 + #1              =>     IF v1 >= t9 GOTO L2
+//     GOTO L2                           v3 := v3 + v1
+//                                       v1 := v1 + #1
+//                                       ...                     (4 times)
+//                                       GOTO L9
+//                                       LABEL L2 :
+//                                       ...                     (the original loop)
+//
+// The copies of the loop may add at most UNROLL_BUDGET instructions, the values and the
+// labels local to an iteration are renamed in each copy. With -fprofile-use the loops which
+// never ran, or ran fewer iterations than the copies on each entry, are not unrolled.
+//
+// The instruction buffer can not grow while the blocks are in use, so the instructions to be
+// inserted are recorded with their positions, and inserted by insert_pending afterwards.
+//
+
+#include "loop.h"
+#include "basic-block.h"
+#include "operand.h"
+#include "option.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+
+// Data of the function being optimized, blocks are indexed from 0
+static int start;
+static int nr;
+static Bitset *pred;
+static Bitset *dom;
+
+
+static void compute_dominators()
+{
+    pred = (Bitset *)malloc(sizeof(Bitset) * nr);
+    dom = (Bitset *)malloc(sizeof(Bitset) * nr);
+
+    for (int b = 0; b < nr; b++) {
+        pred[b] = new_bitset(nr);
+        dom[b] = new_bitset(nr);
+    }
+    for (int b = 0; b < nr; b++) {
+        for (int k = 0; k < 2; k++) {
+            int succ = blk_buf[start + b].next[k] - start;
+            if (0 <= succ && succ < nr) {
+                bs_set(pred[succ], b);
+            }
+        }
+    }
+
+    bs_set(dom[0], 0);
+    for (int b = 1; b < nr; b++) {
+        bs_fill(dom[b]);
+    }
+
+    Bitset tmp = new_bitset(nr);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = 1; b < nr; b++) {
+            bs_fill(tmp);
+            for (int p = 0; p < nr; p++) {
+                if (bs_test(pred[b], p)) {
+                    bs_intersect(tmp, dom[p]);
+                }
+            }
+            bs_set(tmp, b);
+            if (!bs_equal(tmp, dom[b])) {
+                bs_copy(dom[b], tmp);
+                changed = true;
+            }
+        }
+    }
+    free_bitset(tmp);
+}
+
+
+static void free_dominators()
+{
+    for (int b = 0; b < nr; b++) {
+        free_bitset(pred[b]);
+        free_bitset(dom[b]);
+    }
+    free(pred);
+    free(dom);
+}
+
+
+static bool dominates(int a, int b)
+{
+    return bs_test(dom[b], a);
+}
+
+
+//
+// The natural loop with header h, the union of the loops of all back edges into h.
+// Return NULL if h is not a loop header.
+//
+static Bitset natural_loop(int h)
+{
+    Bitset body = NULL;
+    int *stack = (int *)malloc(sizeof(int) * nr);
+
+    for (int n = 0; n < nr; n++) {
+        if (!bs_test(pred[h], n) || !dominates(h, n)) {
+            continue;
+        }
+
+        if (body == NULL) {
+            body = new_bitset(nr);
+            bs_set(body, h);
+        }
+
+        int top = 0;
+        if (!bs_test(body, n)) {
+            bs_set(body, n);
+            stack[top++] = n;
+        }
+        while (top > 0) {
+            int m = stack[--top];
+            for (int p = 0; p < nr; p++) {
+                if (bs_test(pred[m], p) && !bs_test(body, p)) {
+                    bs_set(body, p);
+                    stack[top++] = p;
+                }
+            }
+        }
+    }
+
+    free(stack);
+    return body;
+}
+
+
+static IR *last_instr(int b)
+{
+    return &instr_buffer[blk_buf[start + b].end - 1];
+}
+
+
+static Operand jump_target(IR *ir)
+{
+    if (is_branch(ir)) {
+        return ir->rd;
+    }
+    else if (ir->type == IR_JMP) {
+        return ir->rs;
+    }
+    return NULL;
+}
+
+
+static bool falls_through(int b)
+{
+    IR *ir = last_instr(b);
+    return ir->type != IR_JMP && ir->type != IR_RET && blk_buf[start + b].follow == start + b + 1;
+}
+
+
+//
+// Whether the loop can get a preheader right before its header
+//
+static bool can_insert_preheader(int h, Bitset body)
+{
+    IR *label = &instr_buffer[blk_buf[start + h].start];
+    if (label->type != IR_LABEL) {
+        return false;
+    }
+
+    // A block of the loop falling into the header would run the preheader on every iteration
+    return h == 0 || !bs_test(body, h - 1) || !falls_through(h - 1);
+}
+
+
+//
+// Whether the block has an edge leaving the loop, returning included
+//
+static bool leaves_loop(int b, Bitset body)
+{
+    for (int k = 0; k < 2; k++) {
+        int succ = blk_buf[start + b].next[k] - start;
+        if (succ < 0 || succ >= nr || !bs_test(body, succ)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool test_relop(IR_Type relop, long long a, long long b)
+{
+    switch (relop) {
+        case IR_BEQ: return a == b;
+        case IR_BNE: return a != b;
+        case IR_BLT: return a < b;
+        case IR_BLE: return a <= b;
+        case IR_BGT: return a > b;
+        case IR_BGE: return a >= b;
+        default:     assert(0); return false;
+    }
+}
+
+
+//
+// The constant an operand holds when the block before the header h falls into it, NULL if unknown
+//
+static Operand entry_value(int h, Operand ope)
+{
+    if (ope->type == OPE_INTEGER) {
+        return ope;
+    }
+    if (h == 0 || !is_value(ope)) {
+        return NULL;
+    }
+
+    Block *prev = &blk_buf[start + h - 1];
+    for (int p = prev->end - 1; p >= prev->start; p--) {
+        IR *ir = &instr_buffer[p];
+        Operand def[1];
+        if (get_def(ir, def) && def[0] == ope) {
+            return ir->type == IR_ASSIGN && ir->rs->type == OPE_INTEGER ? ir->rs : NULL;
+        }
+    }
+    return NULL;
+}
+
+
+//
+// Whether the loop runs its body at least once when entered: the header does not leave the
+// loop, or the loop is only entered by falling into a header made of the test alone, whose
+// operands are constants then and which does not leave the loop with them
+//
+static bool enters_body(int h, Bitset body)
+{
+    if (!leaves_loop(h, body)) {
+        return true;
+    }
+
+    Block *head = &blk_buf[start + h];
+    IR *test = last_instr(h);
+    if (h == 0 || bs_test(body, h - 1) || !falls_through(h - 1) ||
+            head->end - head->start != 2 || !is_branch(test)) {
+        return false;
+    }
+    for (int p = 0; p < nr; p++) {
+        if (bs_test(pred[h], p) && !bs_test(body, p) && p != h - 1) {
+            return false;
+        }
+    }
+
+    Operand a = entry_value(h, test->rs), b = entry_value(h, test->rt);
+    if (a == NULL || b == NULL) {
+        return false;
+    }
+    int succ = (test_relop(test->type, a->integer, b->integer) ? head->branch : head->follow) - start;
+    return 0 <= succ && succ < nr && bs_test(body, succ);
+}
+
+
+//
+// Whether the block runs whenever the loop is entered: it is the header, or the body is
+// entered and the block is passed before each jump back to the header and each exit
+//
+static bool always_runs(int b, int h, Bitset body, bool enters)
+{
+    if (b == h) {
+        return true;
+    }
+    if (!enters) {
+        return false;
+    }
+    for (int e = 0; e < nr; e++) {
+        if (bs_test(body, e) && e != h && (leaves_loop(e, body) || bs_test(pred[h], e)) && !dominates(b, e)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//
+// A load may trap, e.g. on an index the source checks first, so it is only moved if the
+// source runs it too, and if the loop has no stores or calls
+//
+static bool is_candidate(IR *ir, bool can_load)
+{
+    switch (ir->type) {
+        case IR_ASSIGN:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+        case IR_ADDR:
+            return true;
+        case IR_DEREF_R:
+            return can_load;
+        default:
+            return false;
+    }
+}
+
+
+
+//
+// Where to insert the preheader instructions of the loop.
+// The jumps from outside of the loop are redirected to a new LABEL inserted there.
+//
+static int open_preheader(int h, Bitset body)
+{
+    int pos = blk_buf[start + h].start;
+    Operand header = instr_buffer[pos].rs;
+    Operand label = NULL;
+
+    for (int p = 0; p < nr; p++) {
+        IR *ir = last_instr(p);
+        if (!bs_test(pred[h], p) || bs_test(body, p) || jump_target(ir) != header) {
+            continue;
+        }
+        if (label == NULL) {
+            label = new_operand(OPE_LABEL);
+            insert_before(pos, IR_LABEL, label, NULL, NULL);
+        }
+        if (is_branch(ir)) {
+            ir->rd = label;
+        }
+        else {
+            ir->rs = label;
+        }
+        header->label_ref_cnt--;
+        label->label_ref_cnt++;
+    }
+    return pos;
+}
+
+
+//
+// Number of assignments in the loop of each operand, and the last one
+//
+static void count_defs(Bitset body, int nr_def[], int def_at[])
+{
+    for (int b = 0; b < nr; b++) {
+        if (!bs_test(body, b)) {
+            continue;
+        }
+        Block *blk = &blk_buf[start + b];
+        for (int i = blk->start; i < blk->end; i++) {
+            Operand def[1];
+            if (get_def(&instr_buffer[i], def)) {
+                nr_def[def[0]->id]++;
+                def_at[def[0]->id] = i;
+            }
+        }
+    }
+}
+
+
+//
+// The operands live on some edge leaving the loop, return the number of blocks leaving the loop
+//
+static int live_on_exits(Liveness *lv, Bitset body, Bitset live)
+{
+    int exiting = 0;
+    for (int b = 0; b < nr; b++) {
+        if (!bs_test(body, b) || !leaves_loop(b, body)) {
+            continue;
+        }
+        exiting++;
+        for (int k = 0; k < 2; k++) {
+            int succ = blk_buf[start + b].next[k] - start;
+            if (0 <= succ && succ < nr && !bs_test(body, succ)) {
+                bs_union(live, lv->in[succ]);
+            }
+        }
+    }
+    return exiting;
+}
+
+
+//
+// Move the invariant instructions of the loop into its preheader, return the number of them
+//
+static int hoist_loop(Liveness *lv, int h, Bitset body)
+{
+    int n = lv->nr_ope;
+    int *nr_def = (int *)calloc(n, sizeof(int));
+    int *def_at = (int *)malloc(sizeof(int) * n);
+    bool *hoisted = (bool *)calloc(n, sizeof(bool));  // Assigned by a moved instruction
+    bool has_store = false;
+
+    Bitset live_exit = new_bitset(n);
+    int exiting = live_on_exits(lv, body, live_exit);
+
+    count_defs(body, nr_def, def_at);
+
+    for (int b = 0; b < nr; b++) {
+        if (!bs_test(body, b)) {
+            continue;
+        }
+        Block *blk = &blk_buf[start + b];
+        for (int i = blk->start; i < blk->end; i++) {
+            if (instr_buffer[i].type == IR_DEREF_L || instr_buffer[i].type == IR_CALL) {
+                has_store = true;
+            }
+        }
+    }
+
+    bool enters = enters_body(h, body);
+
+    IR *moved = (IR *)malloc(sizeof(IR) * (blk_buf[start + nr - 1].end - blk_buf[start].start));
+    int nr_moved = 0;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (int b = 0; b < nr; b++) {
+            if (!bs_test(body, b)) {
+                continue;
+            }
+
+            // The block dominates all the blocks leaving the loop
+            int dominated = 0;
+            for (int e = 0; e < nr; e++) {
+                if (bs_test(body, e) && leaves_loop(e, body) && dominates(b, e)) {
+                    dominated++;
+                }
+            }
+            bool dominates_exits = dominated == exiting;
+            bool can_load = !has_store && always_runs(b, h, body, enters);
+
+            Block *blk = &blk_buf[start + b];
+            for (int i = blk->start; i < blk->end; i++) {
+                IR *ir = &instr_buffer[i];
+                Operand def[1];
+                if (!is_candidate(ir, can_load) || !get_def(ir, def) || !has_room(nr_moved + 2)) {
+                    continue;
+                }
+
+                int d = def[0]->id;
+                if (nr_def[d] != 1 || bs_test(lv->in[h], d) ||
+                        (bs_test(live_exit, d) && !dominates_exits)) {
+                    continue;
+                }
+
+                bool invariant = true;
+                for (int k = 0; k < NR_OPE && invariant; k++) {
+                    Operand ope = ir->operand[k];
+                    if (ope == NULL || ope == ir->rd || !is_value(ope) || ir->type == IR_ADDR) {
+                        continue;
+                    }
+                    int s = ope->id;
+                    invariant = nr_def[s] == 0 ||
+                            (hoisted[s] && dominates(instr_buffer[def_at[s]].block - start, b));
+                }
+                if (!invariant) {
+                    continue;
+                }
+
+                moved[nr_moved++] = *ir;
+                ir->type = IR_NOP;
+                hoisted[d] = true;
+                changed = true;
+            }
+        }
+    }
+
+    if (nr_moved > 0) {
+        int pos = open_preheader(h, body);
+        for (int i = 0; i < nr_moved; i++) {
+            insert_before(pos, moved[i].type, moved[i].rs, moved[i].rt, moved[i].rd)->wraps = true;
+        }
+    }
+
+    free(moved);
+    free(nr_def);
+    free(def_at);
+    free(hoisted);
+    free_bitset(live_exit);
+    return nr_moved;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Induction variables
+//////////////////////////////////////////////////////////////////////////////
+
+
+//
+// value == coef * i + base, where i is a basic induction variable
+//
+typedef struct {
+    Operand basic;    // i, NULL if the operand is not an induction variable
+    Operand coef;     // Invariant
+    Operand base;     // Invariant, NULL for 0
+    Operand reduced;  // The variable tracking the value, i itself for i
+    Operand inc;      // Increment of reduced after each update of i
+    int at;           // The assignment, the operand holds the value only in its block
+} Induction;
+
+
+// Data of the loop being optimized
+static Induction *iv;
+static int nr_iv;
+static int *nr_def;
+static int *def_at;
+static int preheader;  // Position of the preheader, -1 if not opened yet
+
+
+static Operand new_integer(int value)
+{
+    Operand ope = new_operand(OPE_INTEGER);
+    ope->integer = value;
+    return ope;
+}
+
+
+//
+// Operands created by this pass are not numbered, they are treated as variant
+//
+static bool is_invariant(Operand ope)
+{
+    if (ope->type == OPE_INTEGER) {
+        return true;
+    }
+    return is_value(ope) && ope->id >= 0 && nr_def[ope->id] == 0;
+}
+
+
+static Induction *get_iv(Operand ope)
+{
+    if (!is_value(ope) || ope->id < 0 || iv[ope->id].basic == NULL) {
+        return NULL;
+    }
+    return &iv[ope->id];
+}
+
+
+static Operand new_value(Ope_Type type)
+{
+    Operand ope = new_operand(type);
+    ope->id = -1;
+    return ope;
+}
+
+
+//
+// a * b for invariant operands, computed in the preheader unless folded, NULL if impossible
+//
+static Operand multiply(Operand a, Operand b, Bitset body, int h, bool compute)
+{
+    if (a->type == OPE_INTEGER && b->type == OPE_INTEGER) {
+        long long v = (long long)a->integer * b->integer;
+        return (v == (int)v) ? new_integer((int)v) : NULL;
+    }
+    if (a->type == OPE_INTEGER && a->integer == 1) {
+        return b;
+    }
+    if (b->type == OPE_INTEGER && b->integer == 1) {
+        return a;
+    }
+    if (!compute) {
+        return NULL;
+    }
+
+    if (preheader == -1) {
+        preheader = open_preheader(h, body);
+    }
+    Operand t = new_value(OPE_TEMP);
+    insert_before(preheader, IR_MUL, a, b, t);
+    return t;
+}
+
+
+//
+// Whether x holds the value of its induction formula at instr_buffer[p]:
+// x is assigned earlier in the same block, and i is not updated between
+//
+static bool is_current(Induction *x, Operand ope, int p)
+{
+    if (x->reduced == ope) {  // i itself
+        return true;
+    }
+    int u = def_at[x->basic->id];
+    return instr_buffer[x->at].block == instr_buffer[p].block && x->at < p && !(x->at < u && u < p);
+}
+
+
+//
+// Replace t := x * c or t := x + c by t := s, where s is the new induction variable
+//
+static bool reduce(IR *ir, int p, Bitset body, int h)
+{
+    Operand x, c;
+    Induction *from = NULL;
+
+    if (ir->type != IR_MUL && ir->type != IR_ADD) {
+        return false;
+    }
+    if ((from = get_iv(ir->rs)) != NULL && is_invariant(ir->rt)) {
+        x = ir->rs;
+        c = ir->rt;
+    }
+    else if ((from = get_iv(ir->rt)) != NULL && is_invariant(ir->rs)) {
+        x = ir->rt;
+        c = ir->rs;
+    }
+    else {
+        return false;
+    }
+
+    if (!is_current(from, x, p) || !has_room(4)) {
+        return false;
+    }
+
+    Induction to = *from;
+    if (ir->type == IR_MUL) {
+        to.coef = multiply(from->coef, c, body, h, false);
+        to.inc = multiply(from->inc, c, body, h, false);
+        if (from->base != NULL || to.coef == NULL || to.inc == NULL) {
+            return false;
+        }
+    }
+    else {
+        // An addition to i itself is as cheap as the copy replacing it
+        if (from->reduced == x || from->base != NULL) {
+            return false;
+        }
+        to.base = c;
+    }
+
+    if (preheader == -1) {
+        preheader = open_preheader(h, body);
+    }
+
+    to.reduced = new_value(ir->rd->type);
+    to.at = p;
+    // Computed ahead of the source, e.g. past the last iteration, so they must not trap
+    insert_before(preheader, ir->type, from->reduced, c, to.reduced)->wraps = true;
+    insert_before(def_at[from->basic->id] + 1, IR_ADD, to.reduced, to.inc, to.reduced)->wraps = true;
+
+    ir->type = IR_ASSIGN;
+    ir->rs = to.reduced;
+    ir->rt = NULL;
+
+    if (nr_def[ir->rd->id] == 1) {
+        iv[ir->rd->id] = to;
+    }
+    return true;
+}
+
+
+//
+// The size of the array whose address the operand holds, -1 if unknown: the operand is only
+// assigned by ope := &r in the function, and r is declared in it
+//
+static int array_size(Operand ope)
+{
+    int first = blk_buf[start].start, last = blk_buf[start + nr - 1].end;
+    IR *addr = NULL;
+    for (int p = first; p < last; p++) {
+        Operand def[1];
+        if (get_def(&instr_buffer[p], def) && def[0] == ope) {
+            if (addr != NULL) {
+                return -1;
+            }
+            addr = &instr_buffer[p];
+        }
+    }
+    if (addr == NULL || addr->type != IR_ADDR) {
+        return -1;
+    }
+    for (int p = first; p < last; p++) {
+        if (instr_buffer[p].type == IR_DEC && instr_buffer[p].rs == addr->rs) {
+            return instr_buffer[p].rt->integer;
+        }
+    }
+    return -1;
+}
+
+
+//
+// Rewrite the comparisons of i with constants on a variable reduced from i, if i is used
+// nowhere else in the loop and is dead after it. The update of i is then dead.
+//
+// The comparison of s with the limit, coef * bound + base, has the result of the source only
+// if the limit does not wrap. A constant limit is kept within a small window around 0, and an
+// address base only gets limits within the array it points to, which lies in the frame.
+//
+static bool replace_test(Operand i, Bitset body, Bitset live_exit, int h)
+{
+    if (bs_test(live_exit, i->id)) {
+        return false;
+    }
+
+    // The last variable reduced from i, usually the address used by the loop
+    Induction *s = NULL;
+    for (int d = 0; d < nr_iv; d++) {
+        Induction *x = &iv[d];
+        if (x->basic == i && x->reduced != i && x->coef->type == OPE_INTEGER && x->coef->integer > 0 &&
+                (x->base == NULL || is_value(x->base) || x->base->type == OPE_INTEGER) &&
+                (s == NULL || x->at > s->at)) {
+            s = x;
+        }
+    }
+    if (s == NULL) {
+        return false;
+    }
+    int size = -1;
+    if (s->base != NULL && s->base->type != OPE_INTEGER && (size = array_size(s->base)) < 0) {
+        return false;
+    }
+
+    int nr_test = 0;
+    for (int b = 0; b < nr; b++) {
+        if (!bs_test(body, b)) {
+            continue;
+        }
+        Block *blk = &blk_buf[start + b];
+        for (int p = blk->start; p < blk->end; p++) {
+            IR *ir = &instr_buffer[p];
+            Operand use[MAX_USE];
+            int n = get_use(ir, use);
+            for (int k = 0; k < n; k++) {
+                if (use[k] != i || p == def_at[i->id]) {
+                    continue;
+                }
+                Operand bound = ir->rs == i ? ir->rt : ir->rs;
+                if (!is_branch(ir) || bound->type != OPE_INTEGER || (ir->rs == i && ir->rt == i)) {
+                    return false;
+                }
+                long long v = (long long)s->coef->integer * bound->integer;
+                if (s->base != NULL && s->base->type == OPE_INTEGER) {
+                    v += s->base->integer;
+                }
+                if (v > (1 << 24) || v < -(1 << 24) || (size >= 0 && (v < 0 || v > size))) {
+                    return false;
+                }
+                nr_test++;
+            }
+        }
+    }
+    if (nr_test == 0 || !has_room(nr_test + 2)) {
+        return false;
+    }
+
+    for (int b = 0; b < nr; b++) {
+        if (!bs_test(body, b)) {
+            continue;
+        }
+        Block *blk = &blk_buf[start + b];
+        for (int p = blk->start; p < blk->end; p++) {
+            IR *ir = &instr_buffer[p];
+            if (!is_branch(ir) || (ir->rs != i && ir->rt != i)) {
+                continue;
+            }
+
+            Operand *bound = ir->rs == i ? &ir->rt : &ir->rs;
+            Operand *var = ir->rs == i ? &ir->rs : &ir->rt;
+            long long v = (long long)s->coef->integer * (*bound)->integer;
+
+            if (s->base == NULL) {
+                *bound = new_integer((int)v);
+            }
+            else if (s->base->type == OPE_INTEGER) {
+                *bound = new_integer((int)(v + s->base->integer));
+            }
+            else {
+                if (preheader == -1) {
+                    preheader = open_preheader(h, body);
+                }
+                Operand limit = new_value(s->reduced->type);
+                insert_before(preheader, IR_ADD, s->base, new_integer((int)v), limit)->wraps = true;
+                *bound = limit;
+            }
+            *var = s->reduced;
+        }
+    }
+    return true;
+}
+
+
+//
+// Find the basic induction variables of the loop and reduce the values derived from them.
+// Return the number of new induction variables, *nr_test the number of variables whose
+// tests are replaced.
+//
+static int reduce_loop(Liveness *lv, int h, Bitset body, int *nr_test)
+{
+    nr_iv = lv->nr_ope;
+    iv = (Induction *)calloc(nr_iv, sizeof(Induction));
+    nr_def = (int *)calloc(nr_iv, sizeof(int));
+    def_at = (int *)malloc(sizeof(int) * nr_iv);
+    preheader = -1;
+
+    count_defs(body, nr_def, def_at);
+
+    // i := i + #k
+    for (int d = 0; d < nr_iv; d++) {
+        IR *ir = &instr_buffer[def_at[d]];
+        if (nr_def[d] != 1 || ir->type != IR_ADD) {
+            continue;
+        }
+        Operand step = ir->rs == ir->rd ? ir->rt : (ir->rt == ir->rd ? ir->rs : NULL);
+        if (step != NULL && step->type == OPE_INTEGER) {
+            iv[d].basic = ir->rd;
+            iv[d].coef = new_integer(1);
+            iv[d].base = NULL;
+            iv[d].reduced = ir->rd;
+            iv[d].inc = step;
+            iv[d].at = def_at[d];
+        }
+    }
+
+    int count = 0;
+    for (int b = 0; b < nr; b++) {
+        if (!bs_test(body, b)) {
+            continue;
+        }
+        Block *blk = &blk_buf[start + b];
+        for (int p = blk->start; p < blk->end; p++) {
+            if (is_value(instr_buffer[p].rd) && get_iv(instr_buffer[p].rd) == NULL) {
+                count += reduce(&instr_buffer[p], p, body, h);
+            }
+        }
+    }
+
+    Bitset live_exit = new_bitset(nr_iv);
+    live_on_exits(lv, body, live_exit);
+    *nr_test = 0;
+    for (int d = 0; d < nr_iv; d++) {
+        if (iv[d].basic != NULL && iv[d].reduced == iv[d].basic) {
+            *nr_test += replace_test(iv[d].basic, body, live_exit, h);
+        }
+    }
+
+    free_bitset(live_exit);
+    free(iv);
+    free(nr_def);
+    free(def_at);
+    return count;
+}
+
+
+//
+// The natural loops of the function, indexed by their headers, NULL if not a header
+//
+static Bitset *find_loops(int size[])
+{
+    Bitset *loops = (Bitset *)calloc(nr, sizeof(Bitset));
+    for (int h = 0; h < nr; h++) {
+        loops[h] = natural_loop(h);
+        size[h] = loops[h] != NULL ? bs_count(loops[h]) : 0;
+    }
+    return loops;
+}
+
+
+//
+// Take the largest or the smallest loop left, -1 if none
+//
+static int next_loop(Bitset loops[], int size[], bool largest)
+{
+    int h = -1;
+    for (int i = 0; i < nr; i++) {
+        if (loops[i] != NULL && (h == -1 || (largest ? size[i] > size[h] : size[i] < size[h]))) {
+            h = i;
+        }
+    }
+    return h;
+}
+
+
+//
+// The number of natural loops containing each block of the function, indexed from 0.
+// Unlike the order of the blocks, which the layout changes, it follows the control flow.
+//
+int *loop_depths(Liveness *lv)
+{
+    start = lv->start;
+    nr = lv->end - lv->start;
+    compute_dominators();
+
+    int *depth = (int *)calloc(nr, sizeof(int));
+    for (int h = 0; h < nr; h++) {
+        Bitset body = natural_loop(h);
+        if (body == NULL) {
+            continue;
+        }
+        for (int b = 0; b < nr; b++) {
+            depth[b] += bs_test(body, b);
+        }
+        free_bitset(body);
+    }
+
+    free_dominators();
+    return depth;
+}
+
+
+//
+// Find the loops of the function and record their invariant instructions.
+// Outer loops are handled first, what is left to an inner loop is moved into its own preheader.
+//
+void move_loop_invariants(Liveness *lv)
+{
+    start = lv->start;
+    nr = lv->end - lv->start;
+    compute_dominators();
+
+    int *size = (int *)malloc(sizeof(int) * nr);
+    Bitset *loops = find_loops(size);
+
+    int h;
+    while ((h = next_loop(loops, size, true)) != -1) {
+        if (can_insert_preheader(h, loops[h])) {
+            int n = hoist_loop(lv, h, loops[h]);
+            if (print_stats) {
+                fprintf(stderr, "licm: %s: loop %s, %d blocks, %d instructions hoisted\n",
+                        instr_buffer[blk_buf[start].start].rs->name,
+                        print_operand(instr_buffer[blk_buf[start + h].start].rs), size[h], n);
+            }
+        }
+        free_bitset(loops[h]);
+        loops[h] = NULL;
+    }
+
+    free(loops);
+    free(size);
+    free_dominators();
+}
+
+
+//
+// Strength reduction of the induction variables of the function's loops.
+// Inner loops are handled first, the variables they create are not reduced again.
+//
+void reduce_induction_variables(Liveness *lv)
+{
+    start = lv->start;
+    nr = lv->end - lv->start;
+    compute_dominators();
+
+    int *size = (int *)malloc(sizeof(int) * nr);
+    Bitset *loops = find_loops(size);
+
+    int h;
+    while ((h = next_loop(loops, size, false)) != -1) {
+        if (can_insert_preheader(h, loops[h])) {
+            int nr_test;
+            int n = reduce_loop(lv, h, loops[h], &nr_test);
+            if (print_stats) {
+                fprintf(stderr, "iv: %s: loop %s, %d induction variables reduced, %d tests replaced\n",
+                        instr_buffer[blk_buf[start].start].rs->name,
+                        print_operand(instr_buffer[blk_buf[start + h].start].rs), n, nr_test);
+            }
+        }
+        free_bitset(loops[h]);
+        loops[h] = NULL;
+    }
+
+    free(loops);
+    free(size);
+    free_dominators();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Loop unrolling
+//////////////////////////////////////////////////////////////////////////////
+
+
+#define UNROLL_MAX_TRIPS 16   // Loops running at most this many times are fully unrolled
+#define UNROLL_FACTOR    4    // Copies of the body in a partially unrolled loop
+#define UNROLL_BUDGET    128  // Instructions the copies of a loop may add
+
+
+//
+// A counted loop:
+//     LABEL Lh :                    (only reached by falling through and from the latch)
+//     IF i relop bound GOTO Lx      (the only exit)
+//     ...                           (the body, blocks h + 1 to l without inner loops)
+//     i := i + #k                   (the only assignment of i, in the latch l)
+//     GOTO Lh
+//
+typedef struct {
+    int h;
+    int l;
+    IR *test;
+    Operand i;
+    Operand bound;     // Constant, or not assigned in the loop
+    IR_Type relop;     // The loop is left when i relop bound
+    int step;
+    int first;         // The body is [first, last), without the test and the jump back
+    int last;
+    int size;          // Instructions in the body
+    bool straight;     // No branches in the body
+} Counted;
+
+typedef struct {
+    Operand old;
+    Operand new;
+} Rename;
+
+static Rename *renamed;
+static int nr_renamed;
+static Bitset local;   // Values assigned in the body and dead on entering each iteration
+
+
+// a relop b is b relop' a
+static IR_Type swap_relop(IR_Type relop)
+{
+    switch (relop) {
+        case IR_BLT: return IR_BGT;
+        case IR_BLE: return IR_BGE;
+        case IR_BGT: return IR_BLT;
+        case IR_BGE: return IR_BLE;
+        default:     return relop;
+    }
+}
+
+
+//
+// The step of i := i + #k or i := i - #k, 0 if not such an update
+//
+static int get_step(IR *ir, Operand i)
+{
+    if (ir->type == IR_ADD && ir->rs == i && ir->rt->type == OPE_INTEGER) {
+        return ir->rt->integer;
+    }
+    if (ir->type == IR_ADD && ir->rt == i && ir->rs->type == OPE_INTEGER) {
+        return ir->rs->integer;
+    }
+    if (ir->type == IR_SUB && ir->rs == i && ir->rt->type == OPE_INTEGER && ir->rt->integer != INT_MIN) {
+        return -ir->rt->integer;
+    }
+    return 0;
+}
+
+
+static bool match_counted(int h, Bitset body, Counted *c)
+{
+    Block *head = &blk_buf[start + h];
+    IR *label = &instr_buffer[head->start];
+    c->test = last_instr(h);
+    if (h == 0 || !falls_through(h - 1) || head->end - head->start != 2 ||
+            label->type != IR_LABEL || label->rs->label_ref_cnt != 1 || !is_branch(c->test)) {
+        return false;
+    }
+
+    // The blocks of the loop follow the header, the last one jumps back
+    c->h = h;
+    c->l = h + bs_count(body) - 1;
+    if (c->l == h || c->l >= nr) {
+        return false;
+    }
+    for (int b = h; b <= c->l; b++) {
+        if (!bs_test(body, b)) {
+            return false;
+        }
+    }
+    IR *latch = last_instr(c->l);
+    if (latch->type != IR_JMP || latch->rs != label->rs) {
+        return false;
+    }
+
+    // Leaving only by the test or by returning, no jumps backwards but the latch
+    c->straight = true;
+    for (int b = h + 1; b <= c->l; b++) {
+        if (b < c->l && (!falls_through(b) || is_branch(last_instr(b)))) {
+            c->straight = false;
+        }
+        if (last_instr(b)->type == IR_RET) {
+            continue;
+        }
+        for (int k = 0; k < 2; k++) {
+            int succ = blk_buf[start + b].next[k] - start;
+            if (blk_buf[start + b].next[k] != -1 && (succ < h || succ > c->l || (succ <= b && b != c->l))) {
+                return false;
+            }
+        }
+    }
+
+    c->i = c->test->rs;
+    c->bound = c->test->rt;
+    c->relop = c->test->type;
+    if (!is_value(c->i) || nr_def[c->i->id] != 1) {
+        c->i = c->test->rt;
+        c->bound = c->test->rs;
+        c->relop = swap_relop(c->relop);
+    }
+    if (!is_value(c->i) || nr_def[c->i->id] != 1 || instr_buffer[def_at[c->i->id]].block != start + c->l) {
+        return false;
+    }
+    if (c->bound->type != OPE_INTEGER && (!is_value(c->bound) || nr_def[c->bound->id] != 0)) {
+        return false;
+    }
+    if ((c->step = get_step(&instr_buffer[def_at[c->i->id]], c->i)) == 0) {
+        return false;
+    }
+
+    c->first = head->end;
+    c->last = blk_buf[start + c->l].end - 1;
+    c->size = 0;
+    for (int p = c->first; p < c->last; p++) {
+        if (instr_buffer[p].type == IR_DEC) {
+            return false;
+        }
+        c->size += instr_buffer[p].type != IR_NOP;
+    }
+    return true;
+}
+
+
+//
+// The number of iterations if i is assigned a constant right before the loop and the bound
+// is constant, -1 if unknown or more than UNROLL_MAX_TRIPS
+//
+static int count_trips(Counted *c)
+{
+    if (c->bound->type != OPE_INTEGER) {
+        return -1;
+    }
+
+    Operand init = entry_value(c->h, c->i);
+    if (init == NULL) {
+        return -1;
+    }
+
+    long long v = init->integer;
+    for (int n = 0; n <= UNROLL_MAX_TRIPS; n++) {
+        if (test_relop(c->relop, v, c->bound->integer)) {
+            return n;
+        }
+        v += c->step;
+        if (v != (int)v) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+
+//
+// The labels and the local values of the copy are new operands
+//
+static Operand rename_operand(Operand ope)
+{
+    if (ope == NULL || (ope->type != OPE_LABEL && !(is_value(ope) && ope->id >= 0 && bs_test(local, ope->id)))) {
+        return ope;
+    }
+
+    for (int i = 0; i < nr_renamed; i++) {
+        if (renamed[i].old == ope) {
+            return renamed[i].new;
+        }
+    }
+
+    Operand copy = new_value(ope->type);
+    copy->size = ope->size;
+    copy->base_type = ope->base_type;
+    copy->label_ref_cnt = ope->label_ref_cnt;
+    renamed[nr_renamed].old = ope;
+    renamed[nr_renamed].new = copy;
+    nr_renamed++;
+    return copy;
+}
+
+
+static void copy_body(Counted *c, int pos)
+{
+    nr_renamed = 0;
+    for (int p = c->first; p < c->last; p++) {
+        IR *ir = &instr_buffer[p];
+        if (ir->type != IR_NOP && !(ir->type == IR_LABEL && ir->rs->label_ref_cnt == 0)) {
+            IR *copy = insert_before(pos, ir->type, rename_operand(ir->rs), rename_operand(ir->rt),
+                                     rename_operand(ir->rd));
+            copy->wraps = ir->wraps;
+        }
+    }
+}
+
+
+//
+// Run the body trips times in a row, without the test and the jump back
+//
+static void unroll_fully(Counted *c, int trips)
+{
+    for (int n = 1; n < trips; n++) {
+        copy_body(c, c->first);
+    }
+    remove_instr(c->test);
+    remove_instr(last_instr(c->l));
+}
+
+
+//
+// Put a loop running factor copies of the body in front of the loop, while all of the
+// iterations i, i + k, ..., i + (factor - 1) * k stay in the loop, i.e. i relop' bound - m
+// for m = (factor - 1) * k. The original loop runs the remaining iterations.
+//
+static bool unroll_partially(Counted *c, int factor)
+{
+    bool up = c->step > 0 && (c->relop == IR_BGE || c->relop == IR_BGT);
+    bool down = c->step < 0 && (c->relop == IR_BLE || c->relop == IR_BLT);
+    long long m = (long long)(factor - 1) * c->step;
+    if (!(up || down) || m != (int)m) {
+        return false;
+    }
+
+    int pos = blk_buf[start + c->h].start;
+    Operand header = instr_buffer[pos].rs;
+    Operand limit;
+    if (c->bound->type == OPE_INTEGER) {
+        long long v = c->bound->integer - m;
+        if (v != (int)v) {
+            return false;
+        }
+        limit = new_integer((int)v);
+    }
+    else {
+        // bound - m overflows, the original loop runs all the iterations
+        if (up) {
+            insert_before(pos, IR_BLT, c->bound, new_integer((int)(INT_MIN + m)), header);
+        }
+        else {
+            insert_before(pos, IR_BGT, c->bound, new_integer((int)(INT_MAX + m)), header);
+        }
+        header->label_ref_cnt++;
+        limit = new_value(OPE_TEMP);
+        insert_before(pos, IR_SUB, c->bound, new_integer((int)m), limit);
+    }
+
+    Operand top = new_operand(OPE_LABEL);
+    insert_before(pos, IR_LABEL, top, NULL, NULL);
+    insert_before(pos, c->relop, c->i, limit, header);
+    header->label_ref_cnt++;
+    for (int n = 0; n < factor; n++) {
+        copy_body(c, pos);
+    }
+    insert_before(pos, IR_JMP, top, NULL, NULL);
+    top->label_ref_cnt = 1;
+    return true;
+}
+
+
+//
+// Unroll the loop if it is a counted loop, return the number of copies of the body
+//
+static int unroll_loop(Liveness *lv, int h, Bitset body)
+{
+    nr_def = (int *)calloc(lv->nr_ope, sizeof(int));
+    def_at = (int *)malloc(sizeof(int) * lv->nr_ope);
+    count_defs(body, nr_def, def_at);
+
+    int copies = 1;
+    Counted c;
+    if (!match_counted(h, body, &c)) {
+        free(nr_def);
+        free(def_at);
+        return copies;
+    }
+
+    // The values only living in an iteration get new operands in each copy
+    local = new_bitset(lv->nr_ope);
+    for (int p = c.first; p < c.last; p++) {
+        Operand def[1];
+        if (get_def(&instr_buffer[p], def) && (def[0]->type == OPE_TEMP || def[0]->type == OPE_ADDR) &&
+                !bs_test(lv->in[h], def[0]->id)) {
+            bs_set(local, def[0]->id);
+        }
+    }
+    renamed = (Rename *)malloc(sizeof(Rename) * NR_OPE * c.size);
+
+    int trips = count_trips(&c);
+    int factor = UNROLL_FACTOR;
+    while (factor > 1 && factor * c.size > UNROLL_BUDGET) {
+        factor /= 2;
+    }
+
+    // With -fprofile-use a loop never reached is left alone, and the copies of a partially
+    // unrolled loop should run at least once on each entry
+    if (has_profile) {
+        long long runs = instr_buffer[blk_buf[start + h].start].count;
+        long long iterations = last_instr(c.l)->count;
+        if (runs == 0) {
+            trips = -1;
+            factor = 1;
+        }
+        else if (iterations < factor * (runs - iterations)) {
+            factor = 1;
+        }
+    }
+
+    if (trips > 0 && (trips - 1) * c.size <= UNROLL_BUDGET && has_room(trips * c.size)) {
+        unroll_fully(&c, trips);
+        copies = trips;
+    }
+    else if (c.straight && factor > 1 && has_room(factor * c.size + 6) && unroll_partially(&c, factor)) {
+        copies = factor;
+    }
+
+    free(renamed);
+    free_bitset(local);
+    free(nr_def);
+    free(def_at);
+    return copies;
+}
+
+
+//
+// Unroll the innermost counted loops of the function
+//
+void unroll_loops(Liveness *lv)
+{
+    start = lv->start;
+    nr = lv->end - lv->start;
+    compute_dominators();
+
+    int *size = (int *)malloc(sizeof(int) * nr);
+    Bitset *loops = find_loops(size);
+
+    int h;
+    while ((h = next_loop(loops, size, false)) != -1) {
+        // The header LABEL is gone after the loop is fully unrolled
+        char name[32];
+        snprintf(name, sizeof(name), "%s", print_operand(instr_buffer[blk_buf[start + h].start].rs));
+        int copies = unroll_loop(lv, h, loops[h]);
+        if (print_stats) {
+            fprintf(stderr, "unroll: %s: loop %s, %d blocks, %d copies\n",
+                    instr_buffer[blk_buf[start].start].rs->name, name, size[h], copies);
+        }
+        free_bitset(loops[h]);
+        loops[h] = NULL;
+    }
+
+    free(loops);
+    free(size);
+    free_dominators();
+}
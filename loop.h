@@ -0,0 +1,18 @@
+//
+// Natural loops, loop-invariant code motion, induction variables and unrolling
+//
+
+#ifndef NJU_COMPILER_2015_LOOP_H
+#define NJU_COMPILER_2015_LOOP_H
+
+#include "liveness.h"
+
+void move_loop_invariants(Liveness *lv);
+
+void reduce_induction_variables(Liveness *lv);
+
+void unroll_loops(Liveness *lv);
+
+int *loop_depths(Liveness *lv);
+
+#endif //NJU_COMPILER_2015_LOOP_H
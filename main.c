@@ -2,6 +2,7 @@
 #include "cmm-symtab.h"
 #include "node.h"
 #include "asm.h"
+#include "option.h"
 #include <string.h>
 
 
@@ -20,21 +21,24 @@ extern bool semantic_error;
 
 int main(int argc, char *argv[])
 {
-    if (argc <= 1) {
+    // ./cc [options] src.cmm out.s
+    const char *src, *dst;
+    if (!parse_options(argc, argv, &src, &dst)) {
+        fprintf(stderr, "Usage: %s [-O0|-O1|-O2] [-fstats] [-fdelay-slots] [-flatency=op:n,...]"
+                        " [-fprofile-generate[=file]] [-fprofile-use[=file]] src.cmm out.S\n", argv[0]);
         return 1;
     }
 
-    // ./cc src.cmm out.s
     FILE *file;
-    file     = fopen(argv[1], "r");
-    asm_file = fopen(argv[2], "w");
+    file     = fopen(src, "r");
+    asm_file = fopen(dst, "w");
 
     if (!file) {
-        perror(argv[1]);
+        perror(src);
         return 1;
     }
     else if (!asm_file) {
-        perror(argv[2]);
+        perror(dst);
         return 1;
     }
 
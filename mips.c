@@ -0,0 +1,1241 @@
+//
+// MIPS instructions and the peephole optimizer on them
+//
+// emit_asm parses the operands of each instruction into registers, immediates, memory
+// references and labels, and appends it to the code list. After the whole program is
+// generated, the peephole rules are tried on each instruction until none applies:
+//
+//   self-move         move $t0, $t0                  =>  (removed)
+//   move-back         move $t0, $t1; move $t1, $t0   =>  move $t0, $t1
+//   store-load        sw $t0, 8($sp); lw $t1, 8($sp) =>  sw $t0, 8($sp); move $t1, $t0
+//   load-load         lw $t0, 8($sp); lw $t1, 8($sp) =>  lw $t0, 8($sp); move $t1, $t0
+//   zero-register     li $t0, 0; beq $t1, $t0, L1    =>  beq $t1, $zero, L1
+//   move-forward      move $t0, $t1; add $t2, $t0, 1 =>  add $t2, $t1, 1
+//   move-chain        lw $t0, 0($t1); move $v0, $t0  =>  lw $v0, 0($t1)
+//   dead-def          li $t0, 1 (never read)         =>  (removed)
+//   jump-next         j L1; L1:                      =>  L1:
+//   branch-over-jump  beq $t0, $t1, L1; j L2; L1:    =>  bne $t0, $t1, L2; L1:
+//
+// The rules removing or retargeting a register write ask whether the register is live after
+// the instruction. The liveness is computed over the whole program: a jump to a label goes
+// on at the label, jr $ra and a tail call read the result, the arguments, and the registers
+// the caller expects preserved; jal reads the arguments and writes the caller-saved registers.
+// The liveness is recomputed after each change.
+//
+// -fstats reports how many times each rule was applied.
+//
+// The code is then scheduled at -O2, and its delay slots are filled with -fdelay-slots,
+// see below.
+//
+
+#include "mips.h"
+#include "register.h"
+#include "option.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+
+#define LO_REG NR_REG        // LO and HI written by div and mult, numbered after the real registers
+#define HI_REG (NR_REG + 1)
+#define BIT(r) ((uint64_t)1 << (r))
+
+enum {
+    OP_DEF    = 1 << 0,  // arg[0] is written
+    OP_PURE   = 1 << 1,  // Writing arg[0] is the only effect
+    OP_BRANCH = 1 << 2,  // Conditional branch to the last argument
+};
+
+static const struct {
+    const char *name;
+    unsigned flags;
+    MipsOp inverse;      // Of a branch
+} op_info[NR_MIPS_OP] = {
+    [MIPS_ADD]   = { "add",   OP_DEF | OP_PURE },
+    [MIPS_ADDI]  = { "addi",  OP_DEF | OP_PURE },
+    [MIPS_ADDIU] = { "addiu", OP_DEF | OP_PURE },
+    [MIPS_ADDU]  = { "addu",  OP_DEF | OP_PURE },
+    [MIPS_SUB]   = { "sub",   OP_DEF | OP_PURE },
+    [MIPS_SUBU]  = { "subu",  OP_DEF | OP_PURE },
+    [MIPS_MUL]   = { "mul",   OP_DEF | OP_PURE },
+    [MIPS_MULT]  = { "mult",  0 },
+    [MIPS_DIV]   = { "div",   0 },
+    [MIPS_MFHI]  = { "mfhi",  OP_DEF | OP_PURE },
+    [MIPS_MFLO]  = { "mflo",  OP_DEF | OP_PURE },
+    [MIPS_SLL]   = { "sll",   OP_DEF | OP_PURE },
+    [MIPS_SRA]   = { "sra",   OP_DEF | OP_PURE },
+    [MIPS_SRL]   = { "srl",   OP_DEF | OP_PURE },
+    [MIPS_SLT]   = { "slt",   OP_DEF | OP_PURE },
+    [MIPS_SLTI]  = { "slti",  OP_DEF | OP_PURE },
+    [MIPS_SLTU]  = { "sltu",  OP_DEF | OP_PURE },
+    [MIPS_SLTIU] = { "sltiu", OP_DEF | OP_PURE },
+    [MIPS_XOR]   = { "xor",   OP_DEF | OP_PURE },
+    [MIPS_XORI]  = { "xori",  OP_DEF | OP_PURE },
+    [MIPS_LI]    = { "li",    OP_DEF | OP_PURE },
+    [MIPS_LA]    = { "la",    OP_DEF | OP_PURE },
+    [MIPS_MOVE]  = { "move",  OP_DEF | OP_PURE },
+    [MIPS_MOVN]  = { "movn",  0 },  // Reads arg[0] as well, see def_use
+    [MIPS_LW]    = { "lw",    OP_DEF | OP_PURE },
+    [MIPS_SW]    = { "sw",    0 },
+    [MIPS_BEQ]   = { "beq",   OP_BRANCH, MIPS_BNE },
+    [MIPS_BNE]   = { "bne",   OP_BRANCH, MIPS_BEQ },
+    [MIPS_BGT]   = { "bgt",   OP_BRANCH, MIPS_BLE },
+    [MIPS_BLT]   = { "blt",   OP_BRANCH, MIPS_BGE },
+    [MIPS_BGE]   = { "bge",   OP_BRANCH, MIPS_BLT },
+    [MIPS_BLE]   = { "ble",   OP_BRANCH, MIPS_BGT },
+    [MIPS_BEQZ]  = { "beqz",  OP_BRANCH, MIPS_BNEZ },
+    [MIPS_BNEZ]  = { "bnez",  OP_BRANCH, MIPS_BEQZ },
+    [MIPS_BGTZ]  = { "bgtz",  OP_BRANCH, MIPS_BLEZ },
+    [MIPS_BLTZ]  = { "bltz",  OP_BRANCH, MIPS_BGEZ },
+    [MIPS_BGEZ]  = { "bgez",  OP_BRANCH, MIPS_BLTZ },
+    [MIPS_BLEZ]  = { "blez",  OP_BRANCH, MIPS_BGTZ },
+    [MIPS_J]     = { "j",     0 },
+    [MIPS_JAL]   = { "jal",   0 },
+    [MIPS_JR]    = { "jr",    0 },
+    [MIPS_NOP]   = { "nop",   0 },
+};
+
+
+static MipsInstr *code;
+static int nr_code;
+static int max_code;
+
+
+static MipsInstr *append(MipsKind kind)
+{
+    if (nr_code == max_code) {
+        max_code = max_code * 2 + 1024;
+        code = (MipsInstr *)realloc(code, sizeof(MipsInstr) * max_code);
+    }
+    MipsInstr *ins = &code[nr_code++];
+    memset(ins, 0, sizeof(*ins));
+    ins->kind = kind;
+    return ins;
+}
+
+
+static int find_reg(const char *s)
+{
+    for (int i = 0; i < NR_REG; i++) {
+        const char *name = reg_to_s(i);
+        size_t len = strlen(name);
+        if (!strncmp(s, name, len) && !isalnum((unsigned char)s[len])) {
+            return i;
+        }
+    }
+    PANIC("Unknown register %s", s);
+    return ZERO;
+}
+
+
+static char *trim(char *s)
+{
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+
+static void parse_arg(MipsArg *arg, char *s)
+{
+    char *paren = strchr(s, '(');
+    if (s[0] == '$') {
+        arg->kind = ARG_REG;
+        arg->reg = find_reg(s);
+    }
+    else if (paren != NULL) {
+        arg->kind = ARG_MEM;
+        arg->imm = (int)strtol(s, NULL, 10);
+        arg->reg = find_reg(paren + 1);
+    }
+    else if (isdigit((unsigned char)s[0]) || s[0] == '-') {
+        arg->kind = ARG_IMM;
+        arg->imm = (int)strtol(s, NULL, 10);
+    }
+    else {
+        arg->kind = ARG_LABEL;
+        arg->label = cmm_strdup(s);
+    }
+}
+
+
+void mips_emit(const char *op, const char *format, ...)
+{
+    char buf[NAME_LEN * 4];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+
+    MipsInstr *ins = append(MIPS_INSTR);
+    ins->op = NR_MIPS_OP;
+    for (int i = 0; i < NR_MIPS_OP; i++) {
+        if (!strcmp(op_info[i].name, op)) {
+            ins->op = (MipsOp)i;
+        }
+    }
+    TEST(ins->op != NR_MIPS_OP, "Unknown instruction %s", op);
+
+    char *comment = strchr(buf, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+        ins->text = cmm_strdup(trim(comment + 1));
+    }
+
+    for (char *tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        tok = trim(tok);
+        if (*tok != '\0') {
+            assert(ins->nr_arg < 3);
+            parse_arg(&ins->arg[ins->nr_arg++], tok);
+        }
+    }
+}
+
+
+void mips_label(const char *name, bool func)
+{
+    MipsInstr *ins = append(func ? MIPS_FUNC : MIPS_LABEL);
+    ins->text = cmm_strdup(name);
+}
+
+
+void mips_comment(const char *format, ...)
+{
+    char buf[NAME_LEN * 4];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+
+    MipsInstr *ins = append(MIPS_COMMENT);
+    ins->text = cmm_strdup(buf);
+}
+
+
+//
+// Labels, looked up by the name in a hash table
+//
+
+static int *label_at;
+static int label_cap;
+
+
+static unsigned hash(const char *s)
+{
+    unsigned h = 5381;
+    while (*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+
+static void index_labels()
+{
+    free(label_at);
+    label_cap = 2 * nr_code + 1;
+    label_at = (int *)malloc(sizeof(int) * label_cap);
+    for (int i = 0; i < label_cap; i++) {
+        label_at[i] = -1;
+    }
+
+    for (int i = 0; i < nr_code; i++) {
+        if (code[i].kind == MIPS_LABEL || code[i].kind == MIPS_FUNC) {
+            unsigned h = hash(code[i].text) % label_cap;
+            while (label_at[h] != -1) {
+                h = (h + 1) % label_cap;
+            }
+            label_at[h] = i;
+        }
+    }
+}
+
+
+static int find_label(const char *name)
+{
+    unsigned h = hash(name) % label_cap;
+    while (label_at[h] != -1) {
+        if (!strcmp(code[label_at[h]].text, name)) {
+            return label_at[h];
+        }
+        h = (h + 1) % label_cap;
+    }
+    return -1;
+}
+
+
+static const char *target_name(MipsInstr *ins)
+{
+    MipsArg *last = &ins->arg[ins->nr_arg - 1];
+    return last->kind == ARG_LABEL ? last->label : NULL;
+}
+
+
+//
+// The label a jump or a branch goes to in the same function, -1 for the others
+//
+static int local_target(MipsInstr *ins)
+{
+    if (ins->kind != MIPS_INSTR || (ins->op != MIPS_J && !(op_info[ins->op].flags & OP_BRANCH))) {
+        return -1;
+    }
+    int at = find_label(target_name(ins));
+    return at != -1 && code[at].kind == MIPS_LABEL ? at : -1;
+}
+
+
+//
+// Register liveness
+//
+
+static uint64_t *live_out;
+static bool stale = true;
+
+
+static uint64_t reg_range(int first, int last)
+{
+    uint64_t set = 0;
+    for (int r = first; r <= last; r++) {
+        set |= BIT(r);
+    }
+    return set;
+}
+
+
+// A pseudo-instruction the assembler expands with a scratch value in $at
+static bool expands_through_at(MipsInstr *ins)
+{
+    switch (ins->op) {
+        case MIPS_BGT:
+        case MIPS_BLT:
+        case MIPS_BGE:
+        case MIPS_BLE:
+        case MIPS_LA:
+            return true;
+        case MIPS_BEQ:
+        case MIPS_BNE:
+            return ins->arg[1].kind == ARG_IMM;
+        case MIPS_ADDI:
+        case MIPS_ADDIU:
+        case MIPS_SLTI:
+        case MIPS_SLTIU:
+            return ins->arg[2].kind == ARG_IMM && !IS_IMM16(ins->arg[2].imm);
+        case MIPS_XORI:
+            return ins->arg[2].kind == ARG_IMM && !(0 <= ins->arg[2].imm && ins->arg[2].imm <= 0xffff);
+        case MIPS_LW:
+        case MIPS_SW:
+            return !IS_IMM16(ins->arg[1].imm);
+        default:
+            return false;
+    }
+}
+
+
+static void def_use(MipsInstr *ins, uint64_t *def, uint64_t *use)
+{
+    // What the caller of the function expects on return
+    uint64_t preserved = BIT(SP) | BIT(RA) | BIT(GP) | BIT(S8) | reg_range(S0, S7);
+    uint64_t args = reg_range(A0, A3);
+
+    *def = *use = 0;
+    if (ins->kind != MIPS_INSTR) {
+        return;
+    }
+
+    switch (ins->op) {
+        case MIPS_MULT:
+        case MIPS_DIV:
+            *def = BIT(LO_REG) | BIT(HI_REG);
+            break;
+        case MIPS_MFHI:
+            *use = BIT(HI_REG);
+            break;
+        case MIPS_MFLO:
+            *use = BIT(LO_REG);
+            break;
+        case MIPS_JAL:
+            if (!strcmp(target_name(ins), "write")) {  // See predefine.S
+                *use = BIT(A0);
+                *def = BIT(V0) | BIT(A0);
+            }
+            else if (!strcmp(target_name(ins), "read")) {
+                *def = BIT(V0) | BIT(A0);
+            }
+            else {
+                *use = args | BIT(SP);
+                *def = BIT(AT) | reg_range(V0, T7) | BIT(T8) | BIT(T9) | BIT(RA) | BIT(LO_REG) | BIT(HI_REG);
+            }
+            return;
+        case MIPS_JR:
+            *use = BIT(V0) | preserved;
+            return;
+        case MIPS_J:
+            if (local_target(ins) == -1) {  // Tail call
+                *use = args | preserved;
+            }
+            return;
+        case MIPS_MOVN:
+            *def = BIT(ins->arg[0].reg);  // All the arguments are read below
+            break;
+        default:
+            break;
+    }
+
+    for (int k = 0; k < ins->nr_arg; k++) {
+        MipsArg *arg = &ins->arg[k];
+        if (arg->kind == ARG_MEM) {
+            *use |= BIT(arg->reg);
+        }
+        else if (arg->kind == ARG_REG) {
+            if (k == 0 && (op_info[ins->op].flags & OP_DEF)) {
+                *def |= BIT(arg->reg);
+            }
+            else {
+                *use |= BIT(arg->reg);
+            }
+        }
+    }
+    if (expands_through_at(ins)) {
+        *def |= BIT(AT);
+    }
+    *def &= ~BIT(ZERO);
+    *use &= ~BIT(ZERO);
+}
+
+
+static void compute_liveness()
+{
+    index_labels();
+    free(live_out);
+    live_out = (uint64_t *)calloc(nr_code + 1, sizeof(uint64_t));
+    uint64_t *live_in = (uint64_t *)calloc(nr_code + 1, sizeof(uint64_t));
+    uint64_t *def = (uint64_t *)malloc(sizeof(uint64_t) * (nr_code + 1));
+    uint64_t *use = (uint64_t *)malloc(sizeof(uint64_t) * (nr_code + 1));
+    int *target = (int *)malloc(sizeof(int) * (nr_code + 1));
+
+    for (int i = 0; i < nr_code; i++) {
+        def_use(&code[i], &def[i], &use[i]);
+        target[i] = local_target(&code[i]);
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = nr_code - 1; i >= 0; i--) {
+            MipsInstr *ins = &code[i];
+            bool falls = !(ins->kind == MIPS_INSTR && (ins->op == MIPS_J || ins->op == MIPS_JR));
+
+            uint64_t out = falls ? live_in[i + 1] : 0;
+            if (target[i] != -1) {
+                out |= live_in[target[i]];
+            }
+            uint64_t in = use[i] | (out & ~def[i]);
+            if (out != live_out[i] || in != live_in[i]) {
+                live_out[i] = out;
+                live_in[i] = in;
+                changed = true;
+            }
+        }
+    }
+
+    free(live_in);
+    free(def);
+    free(use);
+    free(target);
+    stale = false;
+}
+
+
+static bool live_after(int i, int reg)
+{
+    if (stale) {
+        compute_liveness();
+    }
+    return (live_out[i] & BIT(reg)) != 0;
+}
+
+
+//
+// Helpers of the rules
+//
+
+// The next instruction or label, nr_code if none
+static int next_of(int i)
+{
+    do {
+        i++;
+    } while (i < nr_code && (code[i].kind == MIPS_COMMENT || code[i].kind == MIPS_DELETED));
+    return i;
+}
+
+
+static bool is_op(int i, MipsOp op)
+{
+    return i < nr_code && code[i].kind == MIPS_INSTR && code[i].op == op;
+}
+
+
+static bool is_reg(MipsArg *arg, int reg)
+{
+    return arg->kind == ARG_REG && arg->reg == reg;
+}
+
+
+static bool same_mem(MipsArg *a, MipsArg *b)
+{
+    return a->kind == ARG_MEM && b->kind == ARG_MEM && a->reg == b->reg && a->imm == b->imm;
+}
+
+
+static void delete(int i)
+{
+    code[i].kind = MIPS_DELETED;
+    stale = true;
+}
+
+
+// Turn instruction i into move dst, src
+static void make_move(int i, int dst, int src)
+{
+    code[i].op = MIPS_MOVE;
+    code[i].nr_arg = 2;
+    code[i].arg[0].kind = ARG_REG;
+    code[i].arg[0].reg = dst;
+    code[i].arg[1].kind = ARG_REG;
+    code[i].arg[1].reg = src;
+    stale = true;
+}
+
+
+// Whether the label follows the instruction i, with only labels between
+static bool label_follows(int i, const char *name)
+{
+    for (int j = next_of(i); j < nr_code && code[j].kind == MIPS_LABEL; j = next_of(j)) {
+        if (!strcmp(code[j].text, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//
+// The rules, each tried on instruction i, return true if the code is changed
+//
+
+static bool remove_self_move(int i)
+{
+    if (is_op(i, MIPS_MOVE) && code[i].arg[0].reg == code[i].arg[1].reg) {
+        delete(i);
+        return true;
+    }
+    return false;
+}
+
+
+static bool remove_move_back(int i)
+{
+    int j = next_of(i);
+    if (is_op(i, MIPS_MOVE) && is_op(j, MIPS_MOVE) &&
+            code[j].arg[0].reg == code[i].arg[1].reg && code[j].arg[1].reg == code[i].arg[0].reg) {
+        delete(j);
+        return true;
+    }
+    return false;
+}
+
+
+static bool forward_to_load(int i, MipsOp first)
+{
+    int j = next_of(i);
+    if (!is_op(i, first) || !is_op(j, MIPS_LW) || !same_mem(&code[i].arg[1], &code[j].arg[1])) {
+        return false;
+    }
+
+    int value = code[i].arg[0].reg;
+    if (first == MIPS_LW && value == code[i].arg[1].reg) {
+        return false;  // The load changed the base
+    }
+
+    if (code[j].arg[0].reg == value) {
+        delete(j);
+    }
+    else {
+        make_move(j, code[j].arg[0].reg, value);
+    }
+    return true;
+}
+
+
+static bool forward_store(int i)
+{
+    return forward_to_load(i, MIPS_SW);
+}
+
+
+static bool forward_load(int i)
+{
+    return forward_to_load(i, MIPS_LW);
+}
+
+
+//
+// Replace the reads of the copy t by src in the next instruction, if t is not read later
+//
+static bool propagate_copy(int i, int t, int src)
+{
+    int j = next_of(i);
+    if (j >= nr_code || code[j].kind != MIPS_INSTR || code[j].op == MIPS_MOVN ||
+            code[j].op == MIPS_JAL || code[j].op == MIPS_JR || code[j].op == MIPS_J) {
+        return false;
+    }
+
+    MipsInstr *ins = &code[j];
+    bool defines_t = (op_info[ins->op].flags & OP_DEF) && is_reg(&ins->arg[0], t);
+    bool reads_t = false;
+    for (int k = (op_info[ins->op].flags & OP_DEF) ? 1 : 0; k < ins->nr_arg; k++) {
+        if (ins->arg[k].kind == ARG_MEM && ins->arg[k].reg == t && src == ZERO) {
+            return false;
+        }
+        if ((ins->arg[k].kind == ARG_REG || ins->arg[k].kind == ARG_MEM) && ins->arg[k].reg == t) {
+            reads_t = true;
+        }
+    }
+    if (!reads_t || (!defines_t && live_after(j, t))) {
+        return false;
+    }
+
+    for (int k = (op_info[ins->op].flags & OP_DEF) ? 1 : 0; k < ins->nr_arg; k++) {
+        if ((ins->arg[k].kind == ARG_REG || ins->arg[k].kind == ARG_MEM) && ins->arg[k].reg == t) {
+            ins->arg[k].reg = src;
+        }
+    }
+    delete(i);
+    return true;
+}
+
+
+static bool use_zero_register(int i)
+{
+    if (is_op(i, MIPS_LI) && code[i].arg[1].imm == 0 && code[i].arg[0].reg != SP) {
+        return propagate_copy(i, code[i].arg[0].reg, ZERO);
+    }
+    return false;
+}
+
+
+static bool forward_move(int i)
+{
+    if (is_op(i, MIPS_MOVE) && code[i].arg[0].reg != SP) {
+        return propagate_copy(i, code[i].arg[0].reg, code[i].arg[1].reg);
+    }
+    return false;
+}
+
+
+static bool fold_move_chain(int i)
+{
+    int j = next_of(i);
+    if (i >= nr_code || code[i].kind != MIPS_INSTR || !(op_info[code[i].op].flags & OP_PURE) ||
+            !is_op(j, MIPS_MOVE)) {
+        return false;
+    }
+
+    int t = code[i].arg[0].reg;
+    int dst = code[j].arg[0].reg;
+    if (code[j].arg[1].reg != t || dst == t || t == SP || live_after(j, t)) {
+        return false;
+    }
+
+    code[i].arg[0].reg = dst;
+    delete(j);
+    return true;
+}
+
+
+static bool remove_dead_def(int i)
+{
+    if (code[i].kind != MIPS_INSTR || !(op_info[code[i].op].flags & OP_PURE)) {
+        return false;
+    }
+    int reg = code[i].arg[0].reg;
+    if (reg == SP || live_after(i, reg)) {
+        return false;
+    }
+    delete(i);
+    return true;
+}
+
+
+static bool remove_jump_to_next(int i)
+{
+    if (code[i].kind != MIPS_INSTR || (code[i].op != MIPS_J && !(op_info[code[i].op].flags & OP_BRANCH))) {
+        return false;
+    }
+    if (label_follows(i, target_name(&code[i]))) {
+        delete(i);
+        return true;
+    }
+    return false;
+}
+
+
+static bool invert_branch_over_jump(int i)
+{
+    int j = next_of(i);
+    if (code[i].kind != MIPS_INSTR || !(op_info[code[i].op].flags & OP_BRANCH) || !is_op(j, MIPS_J)) {
+        return false;
+    }
+    if (stale) {
+        compute_liveness();  // For the labels
+    }
+    if (local_target(&code[j]) == -1 || !label_follows(j, target_name(&code[i]))) {
+        return false;
+    }
+
+    MipsArg *label = &code[i].arg[code[i].nr_arg - 1];
+    free(label->label);
+    label->label = cmm_strdup(target_name(&code[j]));
+    code[i].op = op_info[code[i].op].inverse;
+    delete(j);
+    return true;
+}
+
+
+static struct {
+    const char *name;
+    bool (*apply)(int i);
+    int count;
+} rules[] = {
+    { "self-move",        remove_self_move },
+    { "move-back",        remove_move_back },
+    { "store-load",       forward_store },
+    { "load-load",        forward_load },
+    { "zero-register",    use_zero_register },
+    { "move-forward",     forward_move },
+    { "move-chain",       fold_move_chain },
+    { "dead-def",         remove_dead_def },
+    { "jump-next",        remove_jump_to_next },
+    { "branch-over-jump", invert_branch_over_jump },
+};
+
+#define NR_RULE ((int)(sizeof(rules) / sizeof(*rules)))
+
+
+static void optimize_peephole()
+{
+    stale = true;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < nr_code; i++) {
+            for (int r = 0; r < NR_RULE && code[i].kind == MIPS_INSTR; r++) {
+                if (rules[r].apply(i)) {
+                    rules[r].count++;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    if (print_stats) {
+        for (int r = 0; r < NR_RULE; r++) {
+            fprintf(stderr, "peephole: %s: %d\n", rules[r].name, rules[r].count);
+        }
+    }
+}
+
+
+static void free_instr(MipsInstr *ins)
+{
+    for (int k = 0; k < ins->nr_arg; k++) {
+        if (ins->arg[k].kind == ARG_LABEL) {
+            free(ins->arg[k].label);
+        }
+    }
+    free(ins->text);
+}
+
+
+static void drop_deleted()
+{
+    int m = 0;
+    for (int i = 0; i < nr_code; i++) {
+        if (code[i].kind == MIPS_DELETED) {
+            free_instr(&code[i]);
+        }
+        else {
+            code[m++] = code[i];
+        }
+    }
+    nr_code = m;
+    index_labels();
+    stale = true;
+}
+
+
+//
+// Instruction scheduling
+//
+// At -O2, the instructions of each block, from a label up to a jump, a branch or a call, are
+// reordered by a list scheduler. An instruction stays after those whose registers it reads
+// or writes (LO and HI included) and after the stores its memory access may alias; two slots
+// of the frame at different offsets from $sp are apart. The scheduler simulates a single-issue
+// pipeline cycle by cycle, and issues among the ready instructions whose operands are
+// available the one heading the longest latency path to the end of the block, so that a load
+// or a multiplication moves away from its first use:
+//
+//   lw    $t0, 8($sp)               lw    $t0, 8($sp)
+//   addu  $t1, $t0, $t2      =>     li    $t3, 5
+//   li    $t3, 5                    addu  $t1, $t0, $t2
+//
+// The latency of an instruction is the number of cycles from its issue to the first
+// instruction reading its result without a stall. The table follows the R3000 and can be
+// overridden with -flatency, e.g. -flatency=lw:3,div:20.
+//
+// With -fdelay-slots the code is emitted under .set noreorder, and the slot after each jump
+// and branch is filled with an instruction moved from before it, or a nop.
+//
+// -fstats reports the stall cycles the pipeline model estimates over the blocks, before and
+// after the scheduling, and how many delay slots are filled.
+//
+
+#define MAX_BLOCK 64   // Longer blocks are scheduled in pieces
+#define MAX_SLOT_SEARCH 8
+
+static int latency[NR_MIPS_OP] = {
+    [MIPS_LW]   = 2,
+    [MIPS_MUL]  = 12,
+    [MIPS_MULT] = 12,
+    [MIPS_DIV]  = 35,
+};
+
+static int stalls_before, stalls_after;
+
+
+bool set_latency(const char *spec)
+{
+    char *buf = cmm_strdup(spec);
+    bool ok = true;
+    for (char *tok = strtok(buf, ","); tok != NULL && ok; tok = strtok(NULL, ",")) {
+        char *colon = strchr(tok, ':');
+        ok = false;
+        if (colon == NULL) {
+            break;
+        }
+        *colon = '\0';
+        int cycles = atoi(colon + 1);
+        for (int i = 0; i < NR_MIPS_OP; i++) {
+            if (!strcmp(op_info[i].name, tok) && cycles >= 1) {
+                latency[i] = cycles;
+                ok = true;
+            }
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+
+static int latency_of(MipsInstr *ins)
+{
+    return latency[ins->op] > 0 ? latency[ins->op] : 1;
+}
+
+
+static bool is_control(MipsInstr *ins)
+{
+    return ins->op == MIPS_J || ins->op == MIPS_JAL || ins->op == MIPS_JR ||
+           (op_info[ins->op].flags & OP_BRANCH);
+}
+
+
+static bool may_alias(MipsInstr *a, MipsInstr *b)
+{
+    bool is_mem_a = a->op == MIPS_LW || a->op == MIPS_SW;
+    bool is_mem_b = b->op == MIPS_LW || b->op == MIPS_SW;
+    if (!is_mem_a || !is_mem_b || (a->op == MIPS_LW && b->op == MIPS_LW)) {
+        return false;
+    }
+    // Two slots of the frame at different offsets are apart
+    return a->arg[1].reg != SP || b->arg[1].reg != SP || a->arg[1].imm == b->arg[1].imm;
+}
+
+
+//
+// The cycles b issues at least after a, 0 if they are independent
+//
+static int dependence(MipsInstr *a, MipsInstr *b, uint64_t def_a, uint64_t use_a, uint64_t def_b, uint64_t use_b)
+{
+    if (def_a & use_b) {
+        return latency_of(a);
+    }
+    if ((use_a & def_b) || (def_a & def_b) || may_alias(a, b) || is_control(b)) {
+        return 1;
+    }
+    return 0;
+}
+
+
+//
+// The stall cycles of the instructions of a block in the order given
+//
+static int count_stalls(int block[], int order[], int n)
+{
+    int ready[NR_REG + 2] = { 0 };  // When each register can be read
+    int cycle = -1, stalls = 0;
+    for (int k = 0; k < n; k++) {
+        MipsInstr *ins = &code[block[order[k]]];
+        uint64_t def, use;
+        def_use(ins, &def, &use);
+
+        int issue = cycle + 1;
+        for (int r = 0; r < NR_REG + 2; r++) {
+            if ((use & BIT(r)) && ready[r] > issue) {
+                issue = ready[r];
+            }
+        }
+        stalls += issue - cycle - 1;
+        cycle = issue;
+        for (int r = 0; r < NR_REG + 2; r++) {
+            if (def & BIT(r)) {
+                ready[r] = issue + latency_of(ins);
+            }
+        }
+    }
+    return stalls;
+}
+
+
+static void schedule_block(int block[], int n, int order[])
+{
+    uint64_t def[MAX_BLOCK], use[MAX_BLOCK];
+    int dep[MAX_BLOCK][MAX_BLOCK];
+    int height[MAX_BLOCK], nr_pred[MAX_BLOCK], earliest[MAX_BLOCK];
+    bool done[MAX_BLOCK];
+
+    for (int a = 0; a < n; a++) {
+        def_use(&code[block[a]], &def[a], &use[a]);
+        nr_pred[a] = earliest[a] = 0;
+        done[a] = false;
+    }
+    for (int b = 0; b < n; b++) {
+        for (int a = 0; a < b; a++) {
+            dep[a][b] = dependence(&code[block[a]], &code[block[b]], def[a], use[a], def[b], use[b]);
+            nr_pred[b] += dep[a][b] > 0;
+        }
+    }
+    for (int a = n - 1; a >= 0; a--) {
+        height[a] = latency_of(&code[block[a]]);
+        for (int b = a + 1; b < n; b++) {
+            if (dep[a][b] && dep[a][b] + height[b] > height[a]) {
+                height[a] = dep[a][b] + height[b];
+            }
+        }
+    }
+
+    int cycle = 0;
+    for (int k = 0; k < n; k++) {
+        // The available one heading the longest path, or the first to be available
+        int best = -1;
+        for (int a = 0; a < n; a++) {
+            if (done[a] || nr_pred[a] > 0) {
+                continue;
+            }
+            if (best == -1) {
+                best = a;
+                continue;
+            }
+            bool avail = earliest[a] <= cycle, best_avail = earliest[best] <= cycle;
+            if (avail != best_avail ? avail :
+                    avail ? height[a] > height[best] : earliest[a] < earliest[best]) {
+                best = a;
+            }
+        }
+
+        order[k] = best;
+        done[best] = true;
+        if (earliest[best] > cycle) {
+            cycle = earliest[best];
+        }
+        for (int b = best + 1; b < n; b++) {
+            if (dep[best][b]) {
+                nr_pred[b]--;
+                if (cycle + dep[best][b] > earliest[b]) {
+                    earliest[b] = cycle + dep[best][b];
+                }
+            }
+        }
+        cycle++;
+    }
+}
+
+
+//
+// Append the entries [first, end) of the code to out, with the instructions of the block
+// scheduled. The comments before an instruction move with it.
+//
+static int emit_block(MipsInstr *out, int nr_out, int first, int end, int block[], int n)
+{
+    int order[MAX_BLOCK], original[MAX_BLOCK];
+    for (int k = 0; k < n; k++) {
+        original[k] = k;
+    }
+    schedule_block(block, n, order);
+
+    int before = count_stalls(block, original, n);
+    int after = count_stalls(block, order, n);
+    if (after > before) {
+        memcpy(order, original, sizeof(int) * n);
+        after = before;
+    }
+    stalls_before += before;
+    stalls_after += after;
+
+    for (int k = 0; k < n; k++) {
+        int b = order[k];
+        for (int i = b == 0 ? first : block[b - 1] + 1; i <= block[b]; i++) {
+            out[nr_out++] = code[i];
+        }
+    }
+    for (int i = n == 0 ? first : block[n - 1] + 1; i < end; i++) {
+        out[nr_out++] = code[i];
+    }
+    return nr_out;
+}
+
+
+static void schedule()
+{
+    drop_deleted();
+
+    MipsInstr *out = (MipsInstr *)malloc(sizeof(MipsInstr) * (nr_code + 1));
+    int block[MAX_BLOCK];
+    int nr_out = 0, n = 0, first = 0;
+
+    for (int i = 0; i < nr_code; i++) {
+        if (code[i].kind == MIPS_LABEL || code[i].kind == MIPS_FUNC) {
+            nr_out = emit_block(out, nr_out, first, i, block, n);
+            out[nr_out++] = code[i];
+            first = i + 1;
+            n = 0;
+        }
+        else if (code[i].kind == MIPS_INSTR) {
+            block[n++] = i;
+            if (is_control(&code[i]) || n == MAX_BLOCK) {
+                nr_out = emit_block(out, nr_out, first, i + 1, block, n);
+                first = i + 1;
+                n = 0;
+            }
+        }
+    }
+    nr_out = emit_block(out, nr_out, first, nr_code, block, n);
+
+    free(code);
+    code = out;
+    nr_code = max_code = nr_out;
+    stale = true;
+
+    if (print_stats) {
+        fprintf(stderr, "schedule: %d stall cycles before, %d after\n", stalls_before, stalls_after);
+    }
+}
+
+
+//
+// Delay slots
+//
+
+// Whether the assembler translates the instruction to a single one, which a slot can hold
+static bool is_single(MipsInstr *ins)
+{
+    switch (ins->op) {
+        case MIPS_LI:
+            return IS_IMM16(ins->arg[1].imm);
+        case MIPS_MUL:
+        case MIPS_DIV:
+        case MIPS_NOP:
+            return false;
+        default:
+            return !is_control(ins) && !expands_through_at(ins);
+    }
+}
+
+
+// The registers a jump or a branch reads and writes before its delay slot runs
+static void slot_def_use(MipsInstr *ins, uint64_t *def, uint64_t *use)
+{
+    switch (ins->op) {
+        case MIPS_JAL:
+            *def = BIT(RA);
+            *use = 0;
+            break;
+        case MIPS_JR:
+            *def = 0;
+            *use = BIT(ins->arg[0].reg);
+            break;
+        case MIPS_J:
+            *def = *use = 0;
+            break;
+        default:
+            def_use(ins, def, use);
+            break;
+    }
+}
+
+
+//
+// The instruction before the jump at j, in the same block, that can move into its delay slot,
+// -1 if none
+//
+static int find_slot_filler(int j)
+{
+    uint64_t def_j, use_j;
+    slot_def_use(&code[j], &def_j, &use_j);
+
+    int seen = 0;
+    for (int k = j - 1; k >= 0 && seen < MAX_SLOT_SEARCH; k--) {
+        if (code[k].kind == MIPS_LABEL || code[k].kind == MIPS_FUNC ||
+                (code[k].kind == MIPS_INSTR && is_control(&code[k]))) {
+            break;
+        }
+        if (code[k].kind != MIPS_INSTR) {
+            continue;
+        }
+        seen++;
+
+        uint64_t def_k, use_k;
+        def_use(&code[k], &def_k, &use_k);
+        bool movable = is_single(&code[k]) && !(def_k & (def_j | use_j)) && !(use_k & def_j) &&
+                       !((def_k | use_k) & BIT(RA));
+        for (int m = k + 1; m < j && movable; m++) {
+            if (code[m].kind == MIPS_INSTR) {
+                uint64_t def_m, use_m;
+                def_use(&code[m], &def_m, &use_m);
+                movable = !dependence(&code[k], &code[m], def_k, use_k, def_m, use_m);
+            }
+        }
+        if (movable) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+
+static void fill_delay_slots()
+{
+    drop_deleted();
+
+    // The blocks end at the jumps, so an instruction fills a slot at most
+    int *filler = (int *)malloc(sizeof(int) * (nr_code + 1));
+    bool *moved = (bool *)calloc(nr_code + 1, sizeof(bool));
+    for (int i = 0; i < nr_code; i++) {
+        filler[i] = code[i].kind == MIPS_INSTR && is_control(&code[i]) ? find_slot_filler(i) : -1;
+        if (filler[i] != -1) {
+            moved[filler[i]] = true;
+        }
+    }
+
+    MipsInstr *out = (MipsInstr *)malloc(sizeof(MipsInstr) * (2 * nr_code + 1));
+    int nr_out = 0, filled = 0, nops = 0;
+    for (int i = 0; i < nr_code; i++) {
+        if (moved[i]) {
+            continue;
+        }
+        out[nr_out++] = code[i];
+        if (filler[i] != -1) {
+            out[nr_out++] = code[filler[i]];
+            filled++;
+        }
+        else if (code[i].kind == MIPS_INSTR && is_control(&code[i])) {
+            MipsInstr *nop = &out[nr_out++];
+            memset(nop, 0, sizeof(*nop));
+            nop->kind = MIPS_INSTR;
+            nop->op = MIPS_NOP;
+            nops++;
+        }
+    }
+
+    free(code);
+    free(filler);
+    free(moved);
+    code = out;
+    nr_code = max_code = nr_out;
+    stale = true;
+
+    if (print_stats) {
+        fprintf(stderr, "delay slots: %d filled, %d nops\n", filled, nops);
+    }
+}
+
+
+static void print_arg(FILE *file, MipsArg *arg)
+{
+    switch (arg->kind) {
+        case ARG_REG:   fprintf(file, "%s", reg_to_s(arg->reg)); break;
+        case ARG_IMM:   fprintf(file, "%d", arg->imm); break;
+        case ARG_MEM:   fprintf(file, "%d(%s)", arg->imm, reg_to_s(arg->reg)); break;
+        case ARG_LABEL: fprintf(file, "%s", arg->label); break;
+    }
+}
+
+
+//
+// Optimize the code, print it and clear the list
+//
+void mips_flush(FILE *file)
+{
+    if (opt_level >= 1) {
+        optimize_peephole();
+    }
+    if (opt_level >= 2) {
+        schedule();
+    }
+    if (delay_slots) {
+        fill_delay_slots();
+    }
+
+    for (int i = 0; i < nr_code; i++) {
+        MipsInstr *ins = &code[i];
+        switch (ins->kind) {
+            case MIPS_LABEL:
+            case MIPS_FUNC:
+                fprintf(file, "%s:\n", ins->text);
+                break;
+            case MIPS_COMMENT:
+                fprintf(file, "%s\n", ins->text);
+                break;
+            case MIPS_INSTR:
+                fprintf(file, "  %-7s", op_info[ins->op].name);
+                for (int k = 0; k < ins->nr_arg; k++) {
+                    if (k > 0) {
+                        fprintf(file, ", ");
+                    }
+                    print_arg(file, &ins->arg[k]);
+                }
+                if (ins->text != NULL) {
+                    fprintf(file, "  # %s", ins->text);
+                }
+                fprintf(file, "\n");
+                break;
+            default:
+                break;
+        }
+        free_instr(ins);
+    }
+
+    nr_code = 0;
+    free(live_out);
+    free(label_at);
+    live_out = NULL;
+    label_at = NULL;
+}
@@ -0,0 +1,106 @@
+//
+// MIPS instructions emitted by the code generator
+//
+// The code of the program is kept in a list of instructions with parsed operands until the
+// end of the code generation, so that the peephole optimizer can work on it, then printed.
+//
+
+#ifndef NJU_COMPILER_2015_MIPS_H
+#define NJU_COMPILER_2015_MIPS_H
+
+#include "lib.h"
+#include <stdio.h>
+
+typedef enum {
+    MIPS_ADD,
+    MIPS_ADDI,
+    MIPS_ADDIU,
+    MIPS_ADDU,
+    MIPS_SUB,
+    MIPS_SUBU,
+    MIPS_MUL,
+    MIPS_MULT,
+    MIPS_DIV,
+    MIPS_MFHI,
+    MIPS_MFLO,
+    MIPS_SLL,
+    MIPS_SRA,
+    MIPS_SRL,
+    MIPS_SLT,
+    MIPS_SLTI,
+    MIPS_SLTU,
+    MIPS_SLTIU,
+    MIPS_XOR,
+    MIPS_XORI,
+    MIPS_LI,
+    MIPS_LA,
+    MIPS_MOVE,
+    MIPS_MOVN,
+    MIPS_LW,
+    MIPS_SW,
+    MIPS_BEQ,
+    MIPS_BNE,
+    MIPS_BGT,
+    MIPS_BLT,
+    MIPS_BGE,
+    MIPS_BLE,
+    MIPS_BEQZ,
+    MIPS_BNEZ,
+    MIPS_BGTZ,
+    MIPS_BLTZ,
+    MIPS_BGEZ,
+    MIPS_BLEZ,
+    MIPS_J,
+    MIPS_JAL,
+    MIPS_JR,
+    MIPS_NOP,
+    NR_MIPS_OP
+} MipsOp;
+
+// Fits the 16-bit immediate of an I-type instruction
+#define IS_IMM16(c) (-32768 <= (c) && (c) <= 32767)
+
+typedef enum {
+    MIPS_INSTR,
+    MIPS_LABEL,
+    MIPS_FUNC,     // Label of a function
+    MIPS_COMMENT,
+    MIPS_DELETED
+} MipsKind;
+
+typedef enum {
+    ARG_REG,
+    ARG_IMM,
+    ARG_MEM,       // imm(reg)
+    ARG_LABEL
+} ArgKind;
+
+typedef struct {
+    ArgKind kind;
+    int reg;       // ARG_REG, the base of ARG_MEM
+    int imm;       // ARG_IMM, the offset of ARG_MEM
+    char *label;
+} MipsArg;
+
+typedef struct {
+    MipsKind kind;
+    MipsOp op;
+    int nr_arg;
+    MipsArg arg[3];
+    char *text;    // Name of a label, a comment, or the comment after an instruction
+} MipsInstr;
+
+void mips_emit(const char *op, const char *format, ...);
+
+void mips_label(const char *name, bool func);
+
+void mips_comment(const char *format, ...);
+
+void mips_flush(FILE *file);
+
+//
+// Override the latencies of the scheduler, e.g. "lw:3,div:20", return false if malformed
+//
+bool set_latency(const char *spec);
+
+#endif //NJU_COMPILER_2015_MIPS_H
@@ -32,6 +32,8 @@ struct Operand_ {
     int size;          // Total variables size for a function
     int nr_arg;        // The number of arguments
     bool has_subroutine;
+    bool takes_address;   // Addresses into the frame may escape, no tail calls
+    unsigned saved_regs;  // Callee-saved registers the function writes, bit i for register i
     bool is_param;
 
     // OPE_REF
@@ -44,6 +46,12 @@ struct Operand_ {
     int liveness;
     int next_use;
     pDagNode dep;       // 依赖结点
+    Operand origin;     // SSA: the variable this operand is a version of, NULL for the variable itself
+
+    // 寄存器分配相关
+    int id;             // Dense number in the current function, see liveness.c
+    int color;          // Register assigned by graph coloring, 0 ($zero) if none
+    int cross_call;     // 局部分配: 0 未跨越调用, 1 在当前块某次调用前出现过, 2 调用前后都出现
 };
 
 // 判定接口
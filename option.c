@@ -0,0 +1,84 @@
+//
+// Command line options
+//
+// Usage: ./cmm [options] src.cmm out.S
+//
+
+#include "option.h"
+#include "mips.h"
+#include <stdio.h>
+#include <string.h>
+
+
+int opt_level = 1;
+
+bool print_stats = false;
+
+bool delay_slots = false;
+
+const char *profile_generate = NULL;
+
+const char *profile_use = NULL;
+
+#define DEFAULT_PROFILE "cmm.prof"
+
+
+//
+// Parse the command line, options can appear anywhere.
+// Return false if the command line is malformed.
+//
+bool parse_options(int argc, char *argv[], const char **src, const char **dst)
+{
+    *src = NULL;
+    *dst = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (arg[0] != '-') {
+            if (*src == NULL) {
+                *src = arg;
+            }
+            else if (*dst == NULL) {
+                *dst = arg;
+            }
+            else {
+                fprintf(stderr, "Unexpected argument '%s'\n", arg);
+                return false;
+            }
+        }
+        else if (arg[1] == 'O' && '0' <= arg[2] && arg[2] <= '2' && arg[3] == '\0') {
+            opt_level = arg[2] - '0';
+        }
+        else if (!strcmp(arg, "-fstats")) {
+            print_stats = true;
+        }
+        else if (!strcmp(arg, "-fdelay-slots")) {
+            delay_slots = true;
+        }
+        else if (!strcmp(arg, "-fprofile-generate")) {
+            profile_generate = DEFAULT_PROFILE;
+        }
+        else if (!strncmp(arg, "-fprofile-generate=", 19)) {
+            profile_generate = arg + 19;
+        }
+        else if (!strcmp(arg, "-fprofile-use")) {
+            profile_use = DEFAULT_PROFILE;
+        }
+        else if (!strncmp(arg, "-fprofile-use=", 14)) {
+            profile_use = arg + 14;
+        }
+        else if (!strncmp(arg, "-flatency=", 10)) {
+            if (!set_latency(arg + 10)) {
+                fprintf(stderr, "Bad latency table '%s'\n", arg + 10);
+                return false;
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option '%s'\n", arg);
+            return false;
+        }
+    }
+
+    return *src != NULL && *dst != NULL;
+}
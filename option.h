@@ -0,0 +1,38 @@
+//
+// Command line options
+//
+
+#ifndef NJU_COMPILER_2015_OPTION_H
+#define NJU_COMPILER_2015_OPTION_H
+
+#include "lib.h"
+
+//
+// Optimization levels:
+//   -O0  no optional optimization
+//   -O1  optimizations on the intermediate code, local register allocation (default)
+//   -O2  all of -O1 plus inlining, loop optimizations and graph-coloring register allocation
+//
+extern int opt_level;
+
+//
+// -fstats: report what the optimizations did for each function to stderr
+//
+extern bool print_stats;
+
+//
+// -fdelay-slots: emit .set noreorder code, filling the delay slot after each jump and branch
+//
+extern bool delay_slots;
+
+//
+// -fprofile-generate[=file]: count the executions of the blocks, written to the file (cmm.prof
+// by default) when main returns
+// -fprofile-use[=file]: read the counts back to guide the optimizations, see profile.c
+//
+extern const char *profile_generate;
+extern const char *profile_use;
+
+bool parse_options(int argc, char *argv[], const char **src, const char **dst);
+
+#endif //NJU_COMPILER_2015_OPTION_H
@@ -0,0 +1,397 @@
+//
+// Table-driven rewriting of instruction windows
+//
+// Each pattern matches a window of consecutive instructions (NOPs skipped) by their types,
+// and then by an optional condition on the operands. The engine slides over the buffer and
+// applies the first matching pattern at each position, until no pattern applies anywhere:
+//
+//   goto-next           GOTO L1; LABEL L1                    =>  LABEL L1
+//   branch-next         IF x < y GOTO L1; LABEL L1           =>  LABEL L1
+//   branch-over-goto    IF x < y GOTO L1; GOTO L2; LABEL L1  =>  IF x >= y GOTO L2
+//   label-merge         LABEL L1; LABEL L2                   =>  LABEL L1 (L2 renamed)
+//   identity            x := y + #0, y * #1, ...             =>  x := y
+//   self-assign         x := x                               =>  (removed)
+//   assign-chain        t := y + z; x := t                   =>  x := y + z
+//   inverted-branch     IF x < y GOTO L1; IF x >= y GOTO L2  =>  IF x < y GOTO L1; GOTO L2
+//   same-branch         IF x < y GOTO L1; IF x < y GOTO L2   =>  IF x < y GOTO L1
+//   dead-after-goto     GOTO L1; x := y                      =>  GOTO L1
+//   dead-after-return   RETURN x; x := y                     =>  RETURN x
+//   branch-fused        t := x < y; IF t != #0 GOTO L1       =>  IF x < y GOTO L1
+//
+// The rewrites keep the reference counts of the labels: a removed jump dereferences its
+// label, which is removed with the last reference.
+// A pattern applies from its -O level on; the first cleanups of jumps and labels are done
+// even at -O0.
+//
+
+#include "pattern.h"
+#include "operand.h"
+#include "option.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+
+#define MAX_WINDOW 3
+
+// Classes of instructions matched besides the IR types
+#define PAT_BRANCH (NR_IR_TYPE + 0)  // Any conditional branch
+#define PAT_ARITH  (NR_IR_TYPE + 1)  // ADD, SUB, MUL, DIV
+#define PAT_DEF    (NR_IR_TYPE + 2)  // Any instruction assigning rd
+#define PAT_ANY    (NR_IR_TYPE + 3)  // Any instruction but LABEL, FUNCTION and DEC
+#define PAT_CMP    (NR_IR_TYPE + 4)  // SEQ, SLT, ... SNE
+
+
+// Uses and assignments of the temporaries, indexed by the operand index
+static int *nr_use;
+static int *nr_def;
+static int max_index;
+
+
+static void count_operand(Operand ope, int *count)
+{
+    if (ope != NULL && ope->type == OPE_TEMP) {
+        count[ope->index]++;
+    }
+}
+
+
+static bool defines_rd(IR *ir)
+{
+    switch (ir->type) {
+        case IR_ASSIGN:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+        case IR_ADDR:
+        case IR_DEREF_R:
+        case IR_CALL:
+        case IR_READ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+static void count_temps()
+{
+    max_index = 0;
+    for (int i = 0; i < nr_instr; i++) {
+        for (int k = 0; k < NR_OPE; k++) {
+            Operand ope = instr_buffer[i].operand[k];
+            if (ope != NULL && ope->type == OPE_TEMP && ope->index >= max_index) {
+                max_index = ope->index + 1;
+            }
+        }
+    }
+
+    nr_use = (int *)calloc(max_index + 1, sizeof(int));
+    nr_def = (int *)calloc(max_index + 1, sizeof(int));
+    for (int i = 0; i < nr_instr; i++) {
+        IR *ir = &instr_buffer[i];
+        if (defines_rd(ir)) {
+            count_operand(ir->rd, nr_def);
+        }
+        else {
+            count_operand(ir->rd, nr_use);  // DEREF_L reads its operands
+        }
+        count_operand(ir->rs, nr_use);
+        count_operand(ir->rt, nr_use);
+    }
+}
+
+
+static bool is_integer(Operand ope, int value)
+{
+    return ope != NULL && ope->type == OPE_INTEGER && ope->integer == value;
+}
+
+
+//
+// Conditions and rewrites of the patterns
+//
+
+static bool jumps_to_next(IR *w[])
+{
+    Operand label = w[0]->type == IR_JMP ? w[0]->rs : w[0]->rd;
+    return label == w[1]->rs;
+}
+
+
+static void remove_jump(IR *w[])
+{
+    w[0]->type = IR_NOP;
+    deref_label(w[1]);
+}
+
+
+static bool branches_over_goto(IR *w[])
+{
+    return w[0]->rd == w[2]->rs;
+}
+
+
+static void invert_branch(IR *w[])
+{
+    w[0]->type = get_relop_anti(w[0]->type);
+    w[0]->rd = w[1]->rs;  // The reference of GOTO moves to the branch
+    w[1]->type = IR_NOP;
+    deref_label(w[2]);
+}
+
+
+static void merge_labels(IR *w[])
+{
+    Operand label = w[1]->rs;
+    w[0]->rs->label_ref_cnt += label->label_ref_cnt;
+    replace_operand_global(w[0]->rs, label);
+    w[1]->type = IR_NOP;
+    w[1]->rs = NULL;
+}
+
+
+// x := y op c is x := y
+static Operand identity_operand(IR *ir)
+{
+    switch (ir->type) {
+        case IR_ADD:
+            if (is_integer(ir->rt, 0)) return ir->rs;
+            if (is_integer(ir->rs, 0)) return ir->rt;
+            return NULL;
+        case IR_SUB:
+            return is_integer(ir->rt, 0) ? ir->rs : NULL;
+        case IR_MUL:
+            if (is_integer(ir->rt, 1)) return ir->rs;
+            if (is_integer(ir->rs, 1)) return ir->rt;
+            return NULL;
+        case IR_DIV:
+            return is_integer(ir->rt, 1) ? ir->rs : NULL;
+        default:
+            return NULL;
+    }
+}
+
+
+static bool is_identity(IR *w[])
+{
+    return identity_operand(w[0]) != NULL;
+}
+
+
+static void to_assign(IR *w[])
+{
+    w[0]->rs = identity_operand(w[0]);
+    w[0]->rt = NULL;
+    w[0]->type = IR_ASSIGN;
+}
+
+
+static bool is_self_assign(IR *w[])
+{
+    return w[0]->rs == w[0]->rd;
+}
+
+
+static void remove_first(IR *w[])
+{
+    w[0]->type = IR_NOP;
+}
+
+
+// The temporary assigned by w[0] is only copied by w[1]. An update x := x + y is left to the
+// value numbering, which folds the updates of x through the temporaries.
+static bool is_chain(IR *w[])
+{
+    Operand t = w[0]->rd;
+    return t != NULL && t->type == OPE_TEMP && t->index < max_index && w[1]->rs == t &&
+           w[1]->rd != t && w[1]->rd != w[0]->rs && w[1]->rd != w[0]->rt &&
+           nr_use[t->index] == 1 && nr_def[t->index] == 1;
+}
+
+
+static void fold_chain(IR *w[])
+{
+    nr_use[w[0]->rd->index]--;
+    nr_def[w[0]->rd->index]--;
+    w[0]->rd = w[1]->rd;
+    w[1]->type = IR_NOP;
+}
+
+
+static bool same_operands(IR *w[])
+{
+    return cmp_operand(w[0]->rs, w[1]->rs) && cmp_operand(w[0]->rt, w[1]->rt);
+}
+
+
+// Not taken by the first branch, the opposite is always taken
+static bool is_inverted_branch(IR *w[])
+{
+    return same_operands(w) && w[1]->type == get_relop_anti(w[0]->type);
+}
+
+
+static void to_goto(IR *w[])
+{
+    w[1]->type = IR_JMP;
+    w[1]->rs = w[1]->rd;
+    w[1]->rt = w[1]->rd = NULL;
+}
+
+
+// Not taken by the first branch, the same is never taken
+static bool is_same_branch(IR *w[])
+{
+    return same_operands(w) && w[1]->type == w[0]->type;
+}
+
+
+static void remove_second(IR *w[])
+{
+    remove_instr(w[1]);
+}
+
+
+// The branch tests the value of the comparison just computed. The comparison is kept when
+// its value is used elsewhere, then it must not overwrite its operands.
+static bool tests_compare(IR *w[])
+{
+    Operand t = w[0]->rd;
+    return (w[1]->type == IR_BNE || w[1]->type == IR_BEQ) && w[1]->rs == t &&
+           is_integer(w[1]->rt, 0) && t != w[0]->rs && t != w[0]->rt;
+}
+
+
+static void fuse_branch(IR *w[])
+{
+    IR_Type relop = compare_to_branch(w[0]->type);
+    w[1]->type = w[1]->type == IR_BNE ? relop : get_relop_anti(relop);
+    w[1]->rs = w[0]->rs;
+    w[1]->rt = w[0]->rt;
+
+    Operand t = w[0]->rd;
+    if (t->type == OPE_TEMP && t->index < max_index) {
+        nr_use[t->index]--;
+        if (nr_use[t->index] == 0 && nr_def[t->index] == 1) {
+            nr_def[t->index]--;
+            w[0]->type = IR_NOP;
+        }
+    }
+}
+
+
+static struct {
+    const char *name;
+    int level;                  // Lowest -O level applying the pattern
+    int length;
+    int type[MAX_WINDOW];       // IR types or PAT_ classes
+    bool (*match)(IR *w[]);     // Condition on the operands, NULL if the types are enough
+    void (*rewrite)(IR *w[]);
+    int count;
+} patterns[] = {
+    { "goto-next",         0, 2, { IR_JMP, IR_LABEL },             jumps_to_next,      remove_jump },
+    { "branch-next",       1, 2, { PAT_BRANCH, IR_LABEL },         jumps_to_next,      remove_jump },
+    { "branch-over-goto",  0, 3, { PAT_BRANCH, IR_JMP, IR_LABEL }, branches_over_goto, invert_branch },
+    { "label-merge",       0, 2, { IR_LABEL, IR_LABEL },           NULL,               merge_labels },
+    { "identity",          1, 1, { PAT_ARITH },                    is_identity,        to_assign },
+    { "self-assign",       1, 1, { IR_ASSIGN },                    is_self_assign,     remove_first },
+    { "assign-chain",      1, 2, { PAT_DEF, IR_ASSIGN },           is_chain,           fold_chain },
+    { "inverted-branch",   1, 2, { PAT_BRANCH, PAT_BRANCH },       is_inverted_branch, to_goto },
+    { "same-branch",       1, 2, { PAT_BRANCH, PAT_BRANCH },       is_same_branch,     remove_second },
+    { "dead-after-goto",   1, 2, { IR_JMP, PAT_ANY },              NULL,               remove_second },
+    { "dead-after-return", 1, 2, { IR_RET, PAT_ANY },              NULL,               remove_second },
+    { "branch-fused",      1, 2, { PAT_CMP, PAT_BRANCH },          tests_compare,      fuse_branch },
+};
+
+#define NR_PATTERN ((int)(sizeof(patterns) / sizeof(*patterns)))
+
+
+static bool match_type(int type, IR *ir)
+{
+    switch (type) {
+        case PAT_BRANCH: return is_branch(ir);
+        case PAT_ARITH:  return IR_ADD <= ir->type && ir->type <= IR_DIV;
+        case PAT_DEF:    return defines_rd(ir);
+        case PAT_ANY:    return ir->type != IR_LABEL && ir->type != IR_FUNC && ir->type != IR_DEC;
+        case PAT_CMP:    return is_compare(ir->type);
+        default:         return ir->type == (IR_Type)type;
+    }
+}
+
+
+//
+// The window of instructions from i, return its length
+//
+static int get_window(int i, IR *w[])
+{
+    int n = 0;
+    for (; i < nr_instr && n < MAX_WINDOW; i++) {
+        if (instr_buffer[i].type != IR_NOP) {
+            w[n++] = &instr_buffer[i];
+        }
+    }
+    return n;
+}
+
+
+static bool try_patterns(IR *w[], int n)
+{
+    for (int p = 0; p < NR_PATTERN; p++) {
+        if (patterns[p].level > opt_level || patterns[p].length > n) {
+            continue;
+        }
+
+        bool match = true;
+        for (int k = 0; k < patterns[p].length && match; k++) {
+            match = match_type(patterns[p].type[k], w[k]);
+        }
+        if (match && (patterns[p].match == NULL || patterns[p].match(w))) {
+            patterns[p].rewrite(w);
+            patterns[p].count++;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void rewrite_patterns()
+{
+    count_temps();
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < nr_instr; i++) {
+            // Try again at the same position after a rewrite
+            while (instr_buffer[i].type != IR_NOP) {
+                IR *w[MAX_WINDOW];
+                int n = get_window(i, w);
+                if (!try_patterns(w, n)) {
+                    break;
+                }
+                changed = true;
+            }
+        }
+    }
+
+    if (print_stats) {
+        for (int p = 0; p < NR_PATTERN; p++) {
+            if (patterns[p].level <= opt_level) {
+                fprintf(stderr, "pattern: %s: %d\n", patterns[p].name, patterns[p].count);
+            }
+        }
+    }
+
+    free(nr_use);
+    free(nr_def);
+}
@@ -0,0 +1,12 @@
+//
+// Table-driven rewriting of instruction windows
+//
+
+#ifndef NJU_COMPILER_2015_PATTERN_H
+#define NJU_COMPILER_2015_PATTERN_H
+
+#include "ir.h"
+
+void rewrite_patterns();
+
+#endif //NJU_COMPILER_2015_PATTERN_H
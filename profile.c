@@ -0,0 +1,227 @@
+//
+// Profile-guided optimization
+//
+// With -fprofile-generate the code counts how many times each basic block runs, and how many
+// times the conditional branch ending it falls through, in a table in .data:
+//
+//   _prof_counts: .word 12, 80123456, 0:24      blocks, checksum of the code, 2 counters a block
+//
+//   L3:                                         LABEL L3 :
+//     la    $k1, _prof_counts                   ...
+//     lw    $k0, 16($k1)                        IF v1 < v2 GOTO L5
+//     addi  $k0, $k0, 1
+//     sw    $k0, 16($k1)
+//     ...
+//     blt   $t0, $t1, L5
+//     la    $k1, _prof_counts
+//     lw    $k0, 20($k1)
+//     ...
+//
+// $k0 and $k1 belong to the kernel and are never allocated, so the counters can be updated
+// anywhere. main returns through _prof_dump, which writes the table into the profile file with
+// the file syscalls of SPIM.
+//
+// The blocks are numbered as they are right after preprocess_ir. The instrumented code skips
+// the optimizations on the intermediate code to keep them, so that -fprofile-use, reading the
+// table back at the same point, finds the same blocks. The profile of another program, or of
+// another optimization level, is told by the checksum and ignored.
+//
+// -fprofile-use gives each instruction the count of its block, and each branch the times it
+// jumped. The counts follow the instructions through the optimizations: an instruction
+// inserted gets the count of the one it is inserted before, and the inlined copies of a callee
+// are scaled to the count of the call. They guide:
+//   - inlining: a call never run is not inlined, a hot call accepts a larger callee;
+//   - unrolling: a loop never run is not unrolled, and a loop running fewer iterations than
+//     the copies on each entry is not unrolled partially;
+//   - register allocation: the spill costs are weighted by the counts instead of the loop depth;
+//   - block layout: the blocks are chained along the edges counted, see block-layout.c.
+//
+
+#include "profile.h"
+#include "asm.h"
+#include "operand.h"
+#include "option.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+#define HOT_RATIO 10  // A hot block runs at least 1/HOT_RATIO as often as the hottest one
+
+bool has_profile = false;
+
+static int nr_counted;     // Blocks numbered by init_profile
+static unsigned checksum;
+static int max_count;
+
+
+// FNV-1a over the instructions and the blocks
+static unsigned compute_checksum()
+{
+    unsigned h = 2166136261u;
+    for (int i = 0; i < nr_instr; i++) {
+        h = (h ^ (unsigned)instr_buffer[i].type) * 16777619u;
+    }
+    for (int b = 0; b < nr_blk; b++) {
+        h = (h ^ (unsigned)(blk_buf[b].end - blk_buf[b].start)) * 16777619u;
+    }
+    return h & 0x7fffffff;
+}
+
+
+static void print_profile()
+{
+    for (int b = 0; b < nr_blk; ) {
+        Operand func = instr_buffer[blk_buf[b].start].rs;
+        int calls = instr_buffer[blk_buf[b].start].count;
+        int run = 0, n = 0;
+        do {
+            run += block_count(&blk_buf[b]) > 0;
+            n++;
+            b++;
+        } while (b < nr_blk && instr_buffer[blk_buf[b].start].type != IR_FUNC);
+        fprintf(stderr, "profile: %s: called %d times, %d of %d blocks run\n", func->name, calls, run, n);
+    }
+}
+
+
+static void read_profile()
+{
+    FILE *file = fopen(profile_use, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot read the profile '%s', ignored\n", profile_use);
+        return;
+    }
+
+    int header[2];
+    int *counter = (int *)malloc(sizeof(int) * 2 * nr_counted);
+    bool ok = fread(header, sizeof(int), 2, file) == 2 &&
+              header[0] == nr_counted && header[1] == (int)checksum &&
+              fread(counter, sizeof(int), 2 * nr_counted, file) == (size_t)(2 * nr_counted);
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "The profile '%s' does not match the program, ignored\n", profile_use);
+        free(counter);
+        return;
+    }
+
+    for (int b = 0; b < nr_counted; b++) {
+        Block *blk = &blk_buf[b];
+        for (int i = blk->start; i < blk->end; i++) {
+            instr_buffer[i].count = counter[2 * b];
+            instr_buffer[i].taken = 0;
+        }
+        IR *last = &instr_buffer[blk->end - 1];
+        if (is_branch(last)) {
+            last->taken = counter[2 * b] - counter[2 * b + 1];
+        }
+        if (counter[2 * b] > max_count) {
+            max_count = counter[2 * b];
+        }
+    }
+    free(counter);
+    has_profile = true;
+
+    if (print_stats) {
+        print_profile();
+    }
+}
+
+
+//
+// Number the blocks of the code just preprocessed, and read the profile with -fprofile-use
+//
+void init_profile()
+{
+    if (profile_generate == NULL && profile_use == NULL) {
+        return;
+    }
+
+    nr_blk = block_partition(blk_buf, instr_buffer, nr_instr);
+    nr_counted = nr_blk;
+    checksum = compute_checksum();
+
+    if (profile_generate == NULL) {
+        read_profile();
+    }
+}
+
+
+static void increment(int offset)
+{
+    emit_asm(la, "$k1, _prof_counts");
+    emit_asm(lw, "$k0, %d($k1)", offset);
+    emit_asm(addi, "$k0, $k0, 1");
+    emit_asm(sw, "$k0, %d($k1)", offset);
+}
+
+
+//
+// Count an execution of block b, emitted after its LABEL or FUNCTION
+//
+void count_block(int b)
+{
+    increment(8 + 8 * b);
+}
+
+
+//
+// Count the branch ending block b falling through, emitted right after the branch
+//
+void count_fall_through(int b)
+{
+    increment(12 + 8 * b);
+}
+
+
+//
+// The table of the counters and _prof_dump, after the predefined functions
+//
+void emit_profile_runtime(FILE *file)
+{
+    if (profile_generate == NULL) {
+        return;
+    }
+
+    fprintf(file, "\n.data\n");
+    fprintf(file, "_prof_counts: .word %d, %u, 0:%d\n", nr_counted, checksum, 2 * nr_counted);
+    fprintf(file, "_prof_file: .asciiz \"%s\"\n", profile_generate);
+    fprintf(file, "\n.text\n");
+    fprintf(file, "_prof_dump:\n");
+    fprintf(file, "  li $v0, 13\n");
+    fprintf(file, "  la $a0, _prof_file\n");
+    fprintf(file, "  li $a1, 577  # O_WRONLY | O_CREAT | O_TRUNC\n");
+    fprintf(file, "  li $a2, 420  # 0644\n");
+    fprintf(file, "  syscall\n");
+    fprintf(file, "  move $a0, $v0\n");
+    fprintf(file, "  li $v0, 15\n");
+    fprintf(file, "  la $a1, _prof_counts\n");
+    fprintf(file, "  li $a2, %d\n", 4 * (2 + 2 * nr_counted));
+    fprintf(file, "  syscall\n");
+    fprintf(file, "  li $v0, 16\n");
+    fprintf(file, "  syscall\n");
+    fprintf(file, "  jr $ra\n");
+    if (delay_slots) {
+        fprintf(file, "  nop\n");
+    }
+}
+
+
+//
+// The times the block ran in the profile
+//
+int block_count(Block *blk)
+{
+    int count = 0;
+    for (int i = blk->start; i < blk->end; i++) {
+        if (instr_buffer[i].type != IR_NOP && instr_buffer[i].count > count) {
+            count = instr_buffer[i].count;
+        }
+    }
+    return count;
+}
+
+
+bool is_hot(int count)
+{
+    return has_profile && count > 0 && (long long)count * HOT_RATIO >= max_count;
+}
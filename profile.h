@@ -0,0 +1,26 @@
+//
+// Profile-guided optimization: counting the blocks and reading the counts back
+//
+
+#ifndef NJU_COMPILER_2015_PROFILE_H
+#define NJU_COMPILER_2015_PROFILE_H
+
+#include "basic-block.h"
+#include <stdio.h>
+
+// The counts of -fprofile-use have been read into the instructions
+extern bool has_profile;
+
+void init_profile();
+
+void count_block(int b);
+
+void count_fall_through(int b);
+
+void emit_profile_runtime(FILE *file);
+
+int block_count(Block *blk);
+
+bool is_hot(int count);
+
+#endif //NJU_COMPILER_2015_PROFILE_H
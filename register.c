@@ -7,6 +7,7 @@
 #include "lib.h"
 #include "ir.h"
 #include "operand.h"
+#include "option.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,22 +17,6 @@
 extern FILE *asm_file;
 
 
-enum reg {
-    ZERO,
-    AT,
-    V0, V1,
-    A0, A1, A2, A3,
-    T0, T1, T2, T3, T4, T5, T6, T7,
-    S0, S1, S2, S3, S4, S5, S6, S7,
-    T8, T9,
-    K0, k1,
-    GP,
-    SP,
-    S8,
-    RA
-};
-
-
 const char *reg_s[] = {
     "$zero",                                                  // $0
     "$at",                                                    // $1
@@ -48,9 +33,6 @@ const char *reg_s[] = {
 };
 
 
-#define NR_REG (sizeof(reg_s) / sizeof(reg_s[0]))
-
-
 #define NR_SAVE ((int)(S7 - S0))
 
 #define MAX_VAR 4096
@@ -77,38 +59,106 @@ const char *reg_to_s(int index)
 }
 
 
-int get_reg(int start, int end)  // [start, end]
+//
+// Register pools of the local allocator
+//
+// With graph coloring, the colored operands own their registers for the whole function,
+// and the local allocator only serves the spilled ones with a few reserved registers.
+// Otherwise any value may take any free register of the function: the caller-saved ones,
+// including $a1-$a3 which only carry arguments at calls, and the callee-saved $s ones the
+// function saves anyway (all of them in main). Variables used both before and after a call
+// in the current block (see mark_cross_call) try the $s registers first, the other values
+// the caller-saved ones first.
+//
+static const int caller_pool[] = { T0, T1, T2, T3, T4, T5, T6, T7, T8, T9, V1, A1, A2, A3 };
+static const int scratch_pool[] = { V1, T8, T9 };
+
+#define POOL_SIZE(pool) ((int)(sizeof(pool) / sizeof(pool[0])))
+
+
+//
+// Registers holding the source operands of the instruction being translated.
+// Loading another source must not evict them.
+//
+static bool pinned[NR_REG];
+
+
+void unpin_all()
+{
+    memset(pinned, 0, sizeof(pinned));
+}
+
+
+//
+// Instructions added by evicting the value of a register: a reload if the value is read
+// again in the block, and a store if it is dirty and would not be written back at the end
+// of the block anyway. A constant is reloaded by li, which does not wait like lw.
+//
+#define LOAD_COST  2
+#define LI_COST    1
+#define STORE_COST 1
+
+static int evict_cost(int reg)
+{
+    Operand ope = ope_in_reg[reg];
+    if (ope->next_use == NO_USE || ope->next_use == MAX_LINE) {
+        return 0;
+    }
+    int cost = is_const(ope) ? LI_COST : LOAD_COST;
+    if (dirty[reg] && !ope->liveness) {
+        cost += STORE_COST;
+    }
+    return cost;
+}
+
+
+//
+// Take a register of the pool, an empty one if any. Otherwise the victim is the cheapest to
+// evict, and among those the one read the farthest away.
+//
+int get_reg(const int pool[], int n)
 {
-    int victim = MAX_LINE;           // The one to be replaced
+    int victim = MAX_LINE;     // The one to be replaced
+    int victim_cost = 0;
     int victim_next_use = -1;  // The limit of instruction buffer
+    bool victim_pinned = true;
 
     int i;  // Need to use the break index
 
-    for (i = start; i <= end; i++) {
-        Operand ope = ope_in_reg[i];
+    for (i = 0; i < n; i++) {
+        Operand ope = ope_in_reg[pool[i]];
 
         if (ope == NULL) {  // An empty register
             break;
         }
-        else if (victim_next_use < ope->next_use) {
-            victim = i;
-            victim_next_use = ope->next_use;
+
+        // A dead value is the best victim
+        int next_use = ope->next_use == NO_USE ? MAX_LINE + 1 : ope->next_use;
+        int cost = evict_cost(pool[i]);
+        if ((victim_pinned && !pinned[pool[i]]) ||
+                (victim_pinned == pinned[pool[i]] &&
+                 (cost < victim_cost || (cost == victim_cost && victim_next_use < next_use)))) {
+            victim = pool[i];
+            victim_cost = cost;
+            victim_next_use = next_use;
+            victim_pinned = pinned[pool[i]];
         }
     }
 
-    if (i <= end) {  // Find empty register
-        return i;
+    if (i < n) {  // Find empty register
+        return pool[i];
     }
     else {
-        TEST(start <= victim && victim <= end && ope_in_reg[victim], "Victim should be updated");
+        TEST(victim != MAX_LINE && ope_in_reg[victim], "Victim should be updated");
         Operand vic = ope_in_reg[victim];
-        if (vic->next_use != MAX_LINE || vic->liveness) {
+        if (dirty[victim] && vic->next_use != NO_USE && (vic->next_use != MAX_LINE || vic->liveness)) {
             if (vic->type == OPE_TEMP || vic->type == OPE_ADDR) {
                 WARN("Back up temporary variable");
             }
             emit_asm(sw, "%s, %d($sp)  # Back up victim", reg_s[victim], sp_offset - ope_in_reg[victim]->address);
         }
         ope_in_reg[victim] = NULL;
+        dirty[victim] = 0;
         return victim;
     }
 }
@@ -119,12 +169,12 @@ int get_reg(int start, int end)  // [start, end]
 //
 // Registers are selected by the follow priority:
 //   1. Empty register
-//   2. Register with a value that is the least currently needed.
+//   2. Register with a value that is the cheapest to evict, then the least currently needed.
 //
 
 void remove_value(Operand ope)
 {
-    for (int i = 0; i <= NR_REG; i++) {
+    for (int i = 0; i < NR_REG; i++) {
         if (ope_in_reg[i] == ope) {
             ope_in_reg[i] = NULL;
         }
@@ -132,24 +182,56 @@ void remove_value(Operand ope)
 }
 
 
+//
+// Append the $s registers the current function may write to the pool
+//
+static int add_saved_regs(int pool[], int n)
+{
+    bool is_main = !strcmp(curr_func->name, "main");
+    for (int i = S0; i <= S7; i++) {
+        if (is_main || (curr_func->saved_regs & (1u << i))) {
+            pool[n++] = i;
+        }
+    }
+    return n;
+}
+
+
 int allocate(Operand ope)
 {
     TEST(ope, "Operand is null");
 
-    int reg;
-    
+    if (ope->color) {
+        return ope->color;
+    }
+
     remove_value(ope);  // Must remove ope's value stored in register, otherwise `ensure' will return old one.
 
     // Select a suitable register group
+    int reg;
     switch (ope->type) {
     case OPE_VAR:
     case OPE_BOOL:
-        reg = get_reg(S0, S7);
-        break;
     case OPE_TEMP:
     case OPE_ADDR:
     case OPE_INTEGER:
-        reg = get_reg(T0, T7);
+        if (opt_level >= 2) {
+            reg = get_reg(scratch_pool, POOL_SIZE(scratch_pool));
+        }
+        else {
+            int pool[NR_REG];
+            int n = 0;
+            if (ope->cross_call == 2) {
+                n = add_saved_regs(pool, n);
+            }
+            for (int i = 0; i < POOL_SIZE(caller_pool); i++) {
+                pool[n++] = caller_pool[i];
+            }
+            if (ope->cross_call != 2) {
+                n = add_saved_regs(pool, n);
+            }
+            reg = get_reg(pool, n);
+        }
         break;
     default:
         PANIC("Unexpected operand type when allocating registers");
@@ -163,14 +245,17 @@ int allocate(Operand ope)
 
 
 //
-// Ensure an operand's value is in a register,
-// otherwise emit a load instruction
+// Find the register holding an operand's value, 0 if none
 //
 
-int ensure(Operand ope)
+int lookup(Operand ope)
 {
     TEST(ope, "Operand is null");
 
+    if (ope->color) {
+        return ope->color;
+    }
+
     for (int i = 0; i < NR_REG; i++) {
         if (ope_in_reg[i] && cmp_operand(ope, ope_in_reg[i])) {
             LOG("Find %s at %s", print_operand(ope), reg_to_s(i));
@@ -178,20 +263,76 @@ int ensure(Operand ope)
         }
     }
 
-    int result = allocate(ope);  // The reg name string to be printed.
+    return 0;
+}
+
 
+//
+// Load an operand's value from its stack slot, or load the constant
+//
+
+void load_value(int reg, Operand ope)
+{
     if (is_const(ope)) {
-        emit_asm(li, "%s, %d", reg_s[result], ope->integer); // Jump '#' required by ir
+        emit_asm(li, "%s, %d", reg_s[reg], ope->integer); // Jump '#' required by ir
     }
     else {
         emit_asm(lw, "%s, %d($sp)  # sp_offset %d addr %d",
-                reg_s[result], sp_offset - ope->address, sp_offset, ope->address);
+                reg_s[reg], sp_offset - ope->address, sp_offset, ope->address);
     }
+}
 
+
+//
+// Ensure an operand's value is in a register,
+// otherwise emit a load instruction. From -O1 on, 0 is read from $zero.
+//
+
+int ensure(Operand ope)
+{
+    if (opt_level >= 1 && ope->type == OPE_INTEGER && ope->integer == 0) {
+        return ZERO;
+    }
+
+    int result = lookup(ope);
+
+    if (result == 0) {
+        result = allocate(ope);  // The reg name string to be printed.
+        load_value(result, ope);
+    }
+
+    pinned[result] = true;
     return result;
 }
 
 
+//
+// Record that a register outside the pools holds an operand's value, e.g. a parameter in $a0
+//
+
+void bind_reg(int reg, Operand ope)
+{
+    remove_value(ope);
+    ope_in_reg[reg] = ope;
+    dirty[reg] = 1;
+}
+
+
+//
+// Free a register going to be clobbered, write back its value if still needed
+//
+
+void spill_reg(int reg)
+{
+    Operand ope = ope_in_reg[reg];
+    if (ope != NULL && dirty[reg] && ope->next_use != NO_USE && (ope->next_use != MAX_LINE || ope->liveness)) {
+        emit_asm(sw, "%s, %d($sp)  # spill %s", reg_s[reg], sp_offset - ope->address, print_operand(ope));
+    }
+    ope_in_reg[reg] = NULL;
+    dirty[reg] = 0;
+}
+
+
 //
 // Push variables and bools onto stak
 //
@@ -211,6 +352,43 @@ void push_all()
 }
 
 
+//
+// Calling convention: $s0-$s7 are callee-saved, the other registers are clobbered by a call.
+//
+// Before a call, only the caller-saved registers holding values still needed are written back,
+// and after the call only they are forgotten.
+//
+
+static bool is_callee_saved(int reg)
+{
+    return reg >= S0 && reg <= S7;
+}
+
+
+void push_caller_saved()
+{
+    for (int i = 0; i < NR_REG; i++) {
+        Operand ope = ope_in_reg[i];
+        if (ope != NULL && dirty[i] && !is_callee_saved(i) &&
+                ope->next_use != NO_USE && (ope->next_use != MAX_LINE || ope->liveness)) {
+            emit_asm(sw, "%s, %d($sp)  # push %s", reg_s[i], sp_offset - ope->address, print_operand(ope));
+            dirty[i] = 0;
+        }
+    }
+}
+
+
+void clear_caller_saved()
+{
+    for (int i = 0; i < NR_REG; i++) {
+        if (!is_callee_saved(i)) {
+            ope_in_reg[i] = NULL;
+            dirty[i] = 0;
+        }
+    }
+}
+
+
 //
 // Clear the operands' value stored in registers
 //
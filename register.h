@@ -7,16 +7,49 @@
 
 #include "operand.h"
 
+enum reg {
+    ZERO,
+    AT,
+    V0, V1,
+    A0, A1, A2, A3,
+    T0, T1, T2, T3, T4, T5, T6, T7,
+    S0, S1, S2, S3, S4, S5, S6, S7,
+    T8, T9,
+    K0, k1,
+    GP,
+    SP,
+    S8,
+    RA
+};
+
+#define NR_REG (RA + 1)
+
+#define NR_ARG_REG 4  // Arguments passed in $a0-$a3
+
+int lookup(Operand ope);
+
 int ensure(Operand ope);
 
+void load_value(int reg, Operand ope);
+
+void bind_reg(int reg, Operand ope);
+
+void spill_reg(int reg);
+
 int allocate(Operand ope);
 
 void clear_reg_state();
 
 void push_all();
 
+void push_caller_saved();
+
+void clear_caller_saved();
+
 void set_dirty(int index);
 
+void unpin_all();
+
 const char *reg_to_s(int index);
 
 #endif //NJU_COMPILER_2015_REGISTER_H
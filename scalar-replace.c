@@ -0,0 +1,281 @@
+//
+// Scalar replacement of small local arrays and structures
+//
+// A local aggregate (DEC) whose addresses are only computed with constant offsets and used
+// to load and store words is replaced by one variable per word, which the register
+// allocator can keep in a register:
+//
+//   DEC r0_8 8
+//   a1 := &r0_8
+//   *a1 := t1                    v1 := t1
+//   a2 := a1 + #4         =>     t2 := v1
+//   t2 := *a1                    t3 := t2 + #2
+//   t3 := t2 + #2                v2 := t3
+//   *a2 := t3
+//
+// The offsets are followed through copies and additions or subtractions of constants,
+// until a fixed point since the temporaries of the addresses may be assigned more than
+// once after unrolling and value numbering, as long as always to the same address.
+// The aggregate stays in memory if one of its addresses escapes: passed to a call, stored,
+// compared, or added to a value not known, e.g. a[i] with i not constant. So does an
+// aggregate larger than MAX_ELEMENTS words, or accessed outside of its bounds.
+//
+// The pass runs before the constant propagation, which then forwards the new variables,
+// and at -O2 again after the unrolling, whose copies of a loop over a small array access
+// it with constant indices.
+//
+
+#include "scalar-replace.h"
+#include "basic-block.h"
+#include "operand.h"
+#include "option.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define MAX_ELEMENTS 16
+
+
+typedef struct {
+    Operand ref;
+    int size;
+    bool escaped;
+    Operand elem[MAX_ELEMENTS];  // Created on the first access of each word
+} Aggregate;
+
+static Aggregate *agg;
+static int nr_agg;
+
+// The aggregate and offset an address value points to, agg_of -1 if none
+static int *agg_of;
+static int *offset_of;
+
+
+static int find_aggregate(Operand ref)
+{
+    for (int i = 0; i < nr_agg; i++) {
+        if (agg[i].ref == ref) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static bool is_tracked(Operand ope)
+{
+    return is_value(ope) && ope->id >= 0 && agg_of[ope->id] != -1;
+}
+
+
+//
+// The address computed by ir from the address of an aggregate, return false if none
+//
+static bool derive(IR *ir, int *a, int *off)
+{
+    switch (ir->type) {
+        case IR_ADDR:
+            *a = find_aggregate(ir->rs);
+            *off = 0;
+            return *a != -1;
+        case IR_ASSIGN:
+            if (!is_tracked(ir->rs)) {
+                return false;
+            }
+            *a = agg_of[ir->rs->id];
+            *off = offset_of[ir->rs->id];
+            return true;
+        case IR_ADD:
+        case IR_SUB:
+            if (is_tracked(ir->rs) && ir->rt->type == OPE_INTEGER) {
+                *a = agg_of[ir->rs->id];
+                *off = offset_of[ir->rs->id] + (ir->type == IR_ADD ? ir->rt->integer : -ir->rt->integer);
+                return true;
+            }
+            if (ir->type == IR_ADD && is_tracked(ir->rt) && ir->rs->type == OPE_INTEGER) {
+                *a = agg_of[ir->rt->id];
+                *off = offset_of[ir->rt->id] + ir->rs->integer;
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+
+static void propagate_addresses(int first, int last)
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = first; i < last; i++) {
+            IR *ir = &instr_buffer[i];
+            int a, off;
+            if (!derive(ir, &a, &off) || !is_value(ir->rd)) {
+                continue;
+            }
+            int id = ir->rd->id;
+            if (agg_of[id] == -1) {
+                agg_of[id] = a;
+                offset_of[id] = off;
+                changed = true;
+            }
+            else if (agg_of[id] != a || offset_of[id] != off) {
+                agg[agg_of[id]].escaped = true;
+                agg[a].escaped = true;
+            }
+        }
+    }
+}
+
+
+static void escape(Operand ope)
+{
+    if (is_tracked(ope)) {
+        agg[agg_of[ope->id]].escaped = true;
+    }
+    else if (ope != NULL && ope->type == OPE_REF && find_aggregate(ope) != -1) {
+        agg[find_aggregate(ope)].escaped = true;
+    }
+}
+
+
+// A load or store of the word at address
+static void check_access(Operand address)
+{
+    if (is_tracked(address)) {
+        int off = offset_of[address->id];
+        Aggregate *pa = &agg[agg_of[address->id]];
+        if (off < 0 || off >= pa->size || off % 4 != 0) {
+            pa->escaped = true;
+        }
+    }
+}
+
+
+static void find_escapes(int first, int last)
+{
+    for (int i = first; i < last; i++) {
+        IR *ir = &instr_buffer[i];
+        int a, off;
+        switch (ir->type) {
+            case IR_DEC:
+                break;
+            case IR_DEREF_R:
+                check_access(ir->rs);
+                escape(ir->rd);
+                break;
+            case IR_DEREF_L:
+                check_access(ir->rs);
+                escape(ir->rt);
+                break;
+            default:
+                if (derive(ir, &a, &off)) {
+                    break;
+                }
+                for (int k = 0; k < NR_OPE; k++) {
+                    escape(ir->operand[k]);
+                }
+        }
+    }
+}
+
+
+static Operand get_element(Operand address)
+{
+    Aggregate *pa = &agg[agg_of[address->id]];
+    int k = offset_of[address->id] / 4;
+    if (pa->elem[k] == NULL) {
+        pa->elem[k] = new_operand(OPE_VAR);
+        pa->elem[k]->id = -1;
+    }
+    return pa->elem[k];
+}
+
+
+static bool is_replaced(Operand address)
+{
+    return is_tracked(address) && !agg[agg_of[address->id]].escaped;
+}
+
+
+static void rewrite(int first, int last)
+{
+    for (int i = first; i < last; i++) {
+        IR *ir = &instr_buffer[i];
+        int a, off;
+        if (ir->type == IR_DEC) {
+            a = find_aggregate(ir->rs);
+            if (a != -1 && !agg[a].escaped) {
+                ir->type = IR_NOP;
+            }
+        }
+        else if (ir->type == IR_DEREF_R && is_replaced(ir->rs)) {
+            ir->type = IR_ASSIGN;
+            ir->rs = get_element(ir->rs);
+        }
+        else if (ir->type == IR_DEREF_L && is_replaced(ir->rs)) {
+            ir->type = IR_ASSIGN;
+            ir->rd = get_element(ir->rs);
+            ir->rs = ir->rt;
+            ir->rt = NULL;
+        }
+        else if (derive(ir, &a, &off) && !agg[a].escaped) {
+            ir->type = IR_NOP;
+        }
+    }
+}
+
+
+void replace_aggregates(Liveness *lv)
+{
+    int first = blk_buf[lv->start].start, last = blk_buf[lv->end - 1].end;
+
+    agg = malloc(sizeof(Aggregate) * (last - first));
+    nr_agg = 0;
+    for (int i = first; i < last; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type == IR_DEC) {
+            Aggregate *pa = &agg[nr_agg++];
+            memset(pa, 0, sizeof(*pa));
+            pa->ref = ir->rs;
+            pa->size = ir->rt->integer;
+            pa->escaped = pa->size > MAX_ELEMENTS * 4;
+        }
+    }
+
+    if (nr_agg > 0) {
+        agg_of = malloc(sizeof(int) * lv->nr_ope);
+        offset_of = malloc(sizeof(int) * lv->nr_ope);
+        for (int i = 0; i < lv->nr_ope; i++) {
+            agg_of[i] = -1;
+        }
+
+        propagate_addresses(first, last);
+        find_escapes(first, last);
+        rewrite(first, last);
+
+        free(agg_of);
+        free(offset_of);
+    }
+
+    if (print_stats) {
+        int nr_replaced = 0, nr_elem = 0;
+        for (int a = 0; a < nr_agg; a++) {
+            if (!agg[a].escaped) {
+                nr_replaced++;
+                for (int k = 0; k < MAX_ELEMENTS; k++) {
+                    nr_elem += agg[a].elem[k] != NULL;
+                }
+            }
+        }
+        if (nr_replaced > 0) {
+            fprintf(stderr, "scalar: %s: %d of %d aggregates replaced, %d variables\n",
+                    instr_buffer[blk_buf[lv->start].start].rs->name, nr_replaced, nr_agg, nr_elem);
+        }
+    }
+
+    free(agg);
+}
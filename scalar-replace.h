@@ -0,0 +1,12 @@
+//
+// Scalar replacement of small local arrays and structures
+//
+
+#ifndef NJU_COMPILER_2015_SCALAR_REPLACE_H
+#define NJU_COMPILER_2015_SCALAR_REPLACE_H
+
+#include "liveness.h"
+
+void replace_aggregates(Liveness *lv);
+
+#endif //NJU_COMPILER_2015_SCALAR_REPLACE_H
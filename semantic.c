@@ -312,6 +312,23 @@ static void exp_is_binary(Node exp)
 }
 
 
+static void exp_is_logic(Node exp)
+{
+    Node lexp = exp->child;
+    Node rexp = lexp->sibling;
+
+    sema_visit(lexp);
+    sema_visit(rexp);
+
+    if (!typecmp(lexp->sema.type, BASIC_INT) || !typecmp(rexp->sema.type, BASIC_INT)) {
+        SEMA_ERROR_MSG(exp->lineno, "The type is not allowed in operation '%s'",
+                exp->tag == EXP_is_AND ? "&&" : "||");
+    }
+
+    exp->sema.type = BASIC_INT;
+}
+
+
 static void exp_is_assign(Node exp)
 {
     Node lexp = exp->child;
@@ -678,8 +695,11 @@ static ast_visitor sema_visitors[] = {
     [EXP_is_ID_ARG]              = exp_is_id_arg,
     [EXP_is_EXP_FIELD]           = exp_is_exp_field,
     [EXP_is_UNARY]               = exp_is_unary,
+    [EXP_is_NOT]                 = exp_is_unary,
     [EXP_is_BINARY]              = exp_is_binary,
     [EXP_is_RELOP]               = exp_is_binary,
+    [EXP_is_AND]                 = exp_is_logic,
+    [EXP_is_OR]                  = exp_is_logic,
 };
 
 
@@ -0,0 +1,1079 @@
+//
+// Static single assignment form of a function
+//
+// Construction, with the dominance frontiers of Cytron et al.:
+//   1. The dominator tree is computed with the iterative algorithm of Cooper, Harvey and
+//      Kennedy over the reverse postorder of the reachable blocks.
+//   2. A variable assigned in block d gets a phi in each block of the dominance frontier
+//      of d where it is live on entry (pruned SSA), and the phi is an assignment itself.
+//   3. The blocks are visited in the dominator tree, each assignment makes a new version
+//      of its variable, and each use reads the version on top of the stack of its variable.
+//      The variable itself stands for its value on the function entry: the parameters
+//      keep their PARAMs, and a use before any assignment reads the variable.
+//
+// The variables whose address is taken, and the REFs, are not renamed. A CALL reads its
+// arguments when it is translated, so the ARGs are renamed at the CALL.
+//
+// Each version keeps its definition and the list of its uses, so the optimizations on the
+// SSA form are sparse: a worklist of the affected uses instead of a data flow iteration.
+//   - Copy propagation: the uses of x2 after x2 := y1 read y1, and a phi whose arguments are
+//     all the same value, or the phi itself, is replaced by that value.
+//   - Dead code elimination: a pure assignment or a phi whose version has no uses is
+//     removed, which may leave the versions it reads without uses.
+//
+// Destruction, without lost copies or swapped values (method I of Sreedhar et al.):
+// each phi x3 = phi(x1, x2) gets a fresh variable p, the predecessors assign p := x1 and
+// p := x2 at their ends, and the block starts with x3 := p. A predecessor branching to the
+// block from a block with another successor (a critical edge) is redirected to a new block,
+// placed before the LABEL of the block and jumped over:
+//
+//     IF v1 < v2 GOTO L1                IF v1 < v2 GOTO L9
+//     ...                               ...
+//     GOTO L2                           GOTO L2
+//     LABEL L1 :                 =>     LABEL L9 :
+//                                       p := x1
+//                                       LABEL L1 :
+//                                       x3 := p
+//
+// The copies are then coalesced: the copies between versions of a variable whose live
+// ranges do not interfere are removed by renaming them to one operand, the variable
+// itself if possible.
+//
+
+#include "ssa.h"
+#include "basic-block.h"
+#include "operand.h"
+#include "option.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+
+static bool is_pure(IR *ir)
+{
+    switch (ir->type) {
+        case IR_ASSIGN:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+        case IR_ADDR:
+        case IR_DEREF_R:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+//
+// The operand slots read by the instruction, as get_use, return the count
+//
+static int use_slots(IR *ir, Operand *slot[])
+{
+    int n = 0;
+
+    switch (ir->type) {
+        case IR_ASSIGN:
+        case IR_DEREF_R:
+        case IR_RET:
+        case IR_WRITE:
+            if (is_value(ir->rs)) slot[n++] = &ir->rs;
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_SEQ:
+        case IR_SLT:
+        case IR_SLE:
+        case IR_SGT:
+        case IR_SGE:
+        case IR_SNE:
+        case IR_DEREF_L:
+        case IR_BEQ:
+        case IR_BLT:
+        case IR_BLE:
+        case IR_BGT:
+        case IR_BGE:
+        case IR_BNE:
+            if (is_value(ir->rs)) slot[n++] = &ir->rs;
+            if (is_value(ir->rt)) slot[n++] = &ir->rt;
+            break;
+        case IR_CALL:
+            for (IR *arg = ir - 1; arg >= instr_buffer && arg->type != IR_CALL && arg->type != IR_FUNC; arg--) {
+                if (arg->type == IR_ARG && is_value(arg->rs) && n < MAX_USE) {
+                    slot[n++] = &arg->rs;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    return n;
+}
+
+
+//
+// The successors of a block in the function, return the count
+//
+static int get_succ(Ssa *ssa, int b, int succ[])
+{
+    Block *blk = &blk_buf[ssa->start + b];
+    int n = 0;
+    for (int k = 0; k < 2; k++) {
+        int s = blk->next[k] - ssa->start;
+        if (0 <= s && s < ssa->nr && (n == 0 || succ[0] != s)) {
+            succ[n++] = s;
+        }
+    }
+    return n;
+}
+
+
+static int pred_index(Ssa *ssa, int b, int p)
+{
+    for (int j = 0; j < ssa->nr_pred[b]; j++) {
+        if (ssa->pred[b][j] == p) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+
+//
+// Dominator tree
+//
+
+static int *rpo;       // Blocks in reverse postorder
+static int *rpo_num;   // Position of a block in rpo, -1 if unreachable
+static int nr_reached;
+
+static void number_postorder(Ssa *ssa, int b, int *count)
+{
+    int succ[2];
+    rpo_num[b] = 0;
+    for (int k = get_succ(ssa, b, succ) - 1; k >= 0; k--) {
+        if (rpo_num[succ[k]] == -1) {
+            number_postorder(ssa, succ[k], count);
+        }
+    }
+    rpo[(*count)++] = b;
+}
+
+
+static int intersect(Ssa *ssa, int a, int b)
+{
+    while (a != b) {
+        while (rpo_num[a] > rpo_num[b]) a = ssa->idom[a];
+        while (rpo_num[b] > rpo_num[a]) b = ssa->idom[b];
+    }
+    return a;
+}
+
+
+static void compute_dominators(Ssa *ssa)
+{
+    int nr = ssa->nr;
+    rpo = (int *)malloc(sizeof(int) * nr);
+    rpo_num = (int *)malloc(sizeof(int) * nr);
+    for (int b = 0; b < nr; b++) {
+        rpo_num[b] = -1;
+    }
+
+    nr_reached = 0;
+    number_postorder(ssa, 0, &nr_reached);
+    for (int i = 0; i < nr_reached / 2; i++) {
+        int t = rpo[i];
+        rpo[i] = rpo[nr_reached - 1 - i];
+        rpo[nr_reached - 1 - i] = t;
+    }
+    for (int i = 0; i < nr_reached; i++) {
+        rpo_num[rpo[i]] = i;
+    }
+
+    // Predecessors from the reachable blocks
+    ssa->nr_pred = (int *)calloc(nr, sizeof(int));
+    ssa->pred = (int **)malloc(sizeof(int *) * nr);
+    for (int b = 0; b < nr; b++) {
+        ssa->pred[b] = (int *)malloc(sizeof(int) * nr);
+    }
+    for (int i = 0; i < nr_reached; i++) {
+        int succ[2];
+        int n = get_succ(ssa, rpo[i], succ);
+        for (int k = 0; k < n; k++) {
+            ssa->pred[succ[k]][ssa->nr_pred[succ[k]]++] = rpo[i];
+        }
+    }
+
+    ssa->idom = (int *)malloc(sizeof(int) * nr);
+    for (int b = 0; b < nr; b++) {
+        ssa->idom[b] = -1;
+    }
+    ssa->idom[0] = 0;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 1; i < nr_reached; i++) {
+            int b = rpo[i], idom = -1;
+            for (int j = 0; j < ssa->nr_pred[b]; j++) {
+                int p = ssa->pred[b][j];
+                if (ssa->idom[p] != -1) {
+                    idom = idom == -1 ? p : intersect(ssa, p, idom);
+                }
+            }
+            if (idom != ssa->idom[b]) {
+                ssa->idom[b] = idom;
+                changed = true;
+            }
+        }
+    }
+    ssa->idom[0] = -1;
+}
+
+
+//
+// Construction
+//
+
+static Liveness *live;
+static bool *renamed;        // Indexed by the liveness id of the variable
+static Operand **stack;      // Versions of each variable on the path in the dominator tree
+static int *top;
+static int *pushed;          // Variables pushed, to pop them when leaving a block
+static int nr_pushed;
+static Operand *created;     // The new versions
+static int nr_created;
+static int *child;           // Dominator tree as the first child and the next sibling
+static int *sibling;
+
+
+static Operand new_version(Operand var)
+{
+    Operand ope = new_operand(var->type);
+    ope->size = var->size;
+    ope->base_type = var->base_type;
+    ope->origin = var;
+    created[nr_created++] = ope;
+    return ope;
+}
+
+
+static void push(int var, Operand ope)
+{
+    stack[var][top[var]++] = ope;
+    pushed[nr_pushed++] = var;
+}
+
+
+static bool is_renamed(Operand ope)
+{
+    return is_value(ope) && ope->origin == NULL && renamed[ope->id];
+}
+
+
+static void rename_block(Ssa *ssa, int b)
+{
+    Block *blk = &blk_buf[ssa->start + b];
+    int mark = nr_pushed;
+
+    for (Phi phi = ssa->phi[b]; phi != NULL; phi = phi->next) {
+        phi->dst = new_version(phi->var);
+        push(phi->var->id, phi->dst);
+    }
+
+    for (int i = blk->start; i < blk->end; i++) {
+        IR *ir = &instr_buffer[i];
+        Operand *slot[MAX_USE];
+        int n = use_slots(ir, slot);
+        for (int k = 0; k < n; k++) {
+            if (is_renamed(*slot[k])) {
+                int var = (*slot[k])->id;
+                *slot[k] = stack[var][top[var] - 1];
+            }
+        }
+
+        Operand def[1];
+        if (get_def(ir, def) && is_renamed(def[0])) {
+            int var = def[0]->id;
+            if (ir->type == IR_PARAM) {
+                push(var, def[0]);
+            }
+            else {
+                ir->rd = new_version(def[0]);
+                push(var, ir->rd);
+            }
+        }
+    }
+
+    int succ[2];
+    int n = get_succ(ssa, b, succ);
+    for (int k = 0; k < n; k++) {
+        int j = pred_index(ssa, succ[k], b);
+        for (Phi phi = ssa->phi[succ[k]]; phi != NULL; phi = phi->next) {
+            int var = phi->var->id;
+            phi->arg[j] = stack[var][top[var] - 1];
+        }
+    }
+
+    for (int c = child[b]; c != -1; c = sibling[c]) {
+        rename_block(ssa, c);
+    }
+
+    while (nr_pushed > mark) {
+        top[pushed[--nr_pushed]]--;
+    }
+}
+
+
+static void add_use(Ssa *ssa, Operand ope, Operand *slot, int instr, Phi phi)
+{
+    Version *ver = &ssa->ver[ope->id];
+    if (ver->nr_use == ver->cap_use) {
+        ver->cap_use = ver->cap_use * 2 + 4;
+        ver->use = (Use *)realloc(ver->use, sizeof(Use) * ver->cap_use);
+    }
+    Use *use = &ver->use[ver->nr_use++];
+    use->slot = slot;
+    use->instr = instr;
+    use->phi = phi;
+}
+
+
+bool is_version(Ssa *ssa, Operand ope)
+{
+    return is_value(ope) && ope->id >= 0 && ope->id < ssa->nr_ver && ssa->ver[ope->id].ope == ope;
+}
+
+
+//
+// Number the versions and link them to their definitions and uses
+//
+static void link_versions(Ssa *ssa)
+{
+    ssa->nr_ver = 0;
+    ssa->ver = (Version *)calloc(live->nr_ope + nr_created + 1, sizeof(Version));
+
+    for (int i = 0; i < live->nr_ope; i++) {
+        if (renamed[i]) {
+            ssa->ver[ssa->nr_ver++].ope = live->ope[i];
+        }
+    }
+    for (int i = 0; i < nr_created; i++) {
+        ssa->ver[ssa->nr_ver++].ope = created[i];
+    }
+    for (int v = 0; v < ssa->nr_ver; v++) {
+        ssa->ver[v].ope->id = v;
+        ssa->ver[v].def = -1;
+    }
+
+    for (int b = 0; b < ssa->nr; b++) {
+        if (rpo_num[b] == -1) {
+            continue;
+        }
+        for (Phi phi = ssa->phi[b]; phi != NULL; phi = phi->next) {
+            ssa->ver[phi->dst->id].phi = phi;
+            for (int j = 0; j < ssa->nr_pred[b]; j++) {
+                add_use(ssa, phi->arg[j], &phi->arg[j], -1, phi);
+            }
+        }
+
+        Block *blk = &blk_buf[ssa->start + b];
+        for (int i = blk->start; i < blk->end; i++) {
+            IR *ir = &instr_buffer[i];
+            Operand ope[MAX_USE];
+            Operand *slot[MAX_USE];
+            if (get_def(ir, ope) && is_version(ssa, ope[0]) && ir->type != IR_PARAM) {
+                ssa->ver[ope[0]->id].def = i;
+            }
+            int n = use_slots(ir, slot);
+            for (int k = 0; k < n; k++) {
+                if (is_version(ssa, *slot[k])) {
+                    add_use(ssa, *slot[k], slot[k], i, NULL);
+                }
+            }
+        }
+    }
+}
+
+
+//
+// Place the phis of a variable in the dominance frontiers of its assignments
+//
+static int place_phis(Ssa *ssa, int var, Bitset def_blk, Bitset *frontier)
+{
+    int nr = ssa->nr, nr_phi = 0;
+    Bitset has_phi = new_bitset(nr);
+    int *work = (int *)malloc(sizeof(int) * (nr + 1));
+    int n = 0;
+
+    for (int b = 0; b < nr; b++) {
+        if (bs_test(def_blk, b)) {
+            work[n++] = b;
+        }
+    }
+    while (n > 0) {
+        int d = work[--n];
+        for (int y = 0; y < nr; y++) {
+            if (!bs_test(frontier[d], y) || bs_test(has_phi, y) || !bs_test(live->in[y], var)) {
+                continue;
+            }
+            Phi phi = NEW(struct Phi_);
+            memset(phi, 0, sizeof(*phi));
+            phi->var = live->ope[var];
+            phi->block = y;
+            phi->arg = (Operand *)calloc(ssa->nr_pred[y] + 1, sizeof(Operand));
+            phi->next = ssa->phi[y];
+            ssa->phi[y] = phi;
+            bs_set(has_phi, y);
+            nr_phi++;
+            if (!bs_test(def_blk, y)) {
+                bs_set(def_blk, y);
+                work[n++] = y;
+            }
+        }
+    }
+
+    free_bitset(has_phi);
+    free(work);
+    return nr_phi;
+}
+
+
+//
+// Translate the function into SSA form, return false if there is no room for the copies
+// of the phis in the instruction buffer when leaving it
+//
+bool build_ssa(Ssa *ssa, Liveness *lv)
+{
+    int nr = lv->end - lv->start;
+    int first = blk_buf[lv->start].start, last = blk_buf[lv->end - 1].end;
+    memset(ssa, 0, sizeof(*ssa));
+    ssa->start = lv->start;
+    ssa->nr = nr;
+    live = lv;
+
+    compute_dominators(ssa);
+
+    // Dominance frontiers
+    Bitset *frontier = (Bitset *)malloc(sizeof(Bitset) * nr);
+    for (int b = 0; b < nr; b++) {
+        frontier[b] = new_bitset(nr);
+    }
+    for (int b = 0; b < nr; b++) {
+        if (ssa->nr_pred[b] < 2) {
+            continue;
+        }
+        for (int j = 0; j < ssa->nr_pred[b]; j++) {
+            for (int r = ssa->pred[b][j]; r != ssa->idom[b] && r != -1; r = ssa->idom[r]) {
+                bs_set(frontier[r], b);
+            }
+        }
+    }
+
+    // The variables renamed and the blocks assigning them
+    renamed = (bool *)malloc(sizeof(bool) * (lv->nr_ope + 1));
+    for (int i = 0; i < lv->nr_ope; i++) {
+        renamed[i] = lv->ope[i]->origin == NULL;
+    }
+    int nr_def = 0;
+    int *nr_def_of = (int *)calloc(lv->nr_ope + 1, sizeof(int));
+    Bitset *def_blk = (Bitset *)calloc(lv->nr_ope + 1, sizeof(Bitset));
+    for (int i = first; i < last; i++) {
+        IR *ir = &instr_buffer[i];
+        Operand def[1];
+        if (ir->type == IR_ADDR && is_value(ir->rs)) {
+            renamed[ir->rs->id] = false;
+        }
+        if (get_def(ir, def)) {
+            if (def_blk[def[0]->id] == NULL) {
+                def_blk[def[0]->id] = new_bitset(nr);
+            }
+            bs_set(def_blk[def[0]->id], ir->block - lv->start);
+            nr_def_of[def[0]->id]++;
+            nr_def++;
+        }
+    }
+
+    ssa->phi = (Phi *)calloc(nr, sizeof(Phi));
+    int nr_copy = 0;
+    for (int v = 0; v < lv->nr_ope; v++) {
+        if (renamed[v] && def_blk[v] != NULL) {
+            int n = place_phis(ssa, v, def_blk[v], frontier);
+            nr_def_of[v] += n;
+            nr_def += n;
+        }
+    }
+    for (int b = 0; b < nr; b++) {
+        for (Phi phi = ssa->phi[b]; phi != NULL; phi = phi->next) {
+            nr_copy += 1 + 4 * ssa->nr_pred[b];  // With the new blocks for the critical edges
+        }
+    }
+
+    for (int b = 0; b < nr; b++) {
+        free_bitset(frontier[b]);
+    }
+    for (int v = 0; v < lv->nr_ope; v++) {
+        free_bitset(def_blk[v]);
+    }
+    free(frontier);
+    free(def_blk);
+
+    if (!has_room(nr_copy)) {
+        free(renamed);
+        free(nr_def_of);
+        leave_ssa(ssa);
+        return false;
+    }
+
+    // Rename along the dominator tree
+    child = (int *)malloc(sizeof(int) * nr);
+    sibling = (int *)malloc(sizeof(int) * nr);
+    for (int b = 0; b < nr; b++) {
+        child[b] = sibling[b] = -1;
+    }
+    for (int b = nr - 1; b > 0; b--) {
+        if (ssa->idom[b] != -1) {
+            sibling[b] = child[ssa->idom[b]];
+            child[ssa->idom[b]] = b;
+        }
+    }
+
+    stack = (Operand **)malloc(sizeof(Operand *) * (lv->nr_ope + 1));
+    top = (int *)calloc(lv->nr_ope + 1, sizeof(int));
+    for (int v = 0; v < lv->nr_ope; v++) {
+        stack[v] = (Operand *)malloc(sizeof(Operand) * (nr_def_of[v] + 2));
+        stack[v][top[v]++] = lv->ope[v];
+    }
+    pushed = (int *)malloc(sizeof(int) * (nr_def + 1));
+    nr_pushed = 0;
+    created = (Operand *)malloc(sizeof(Operand) * (nr_def + 1));
+    nr_created = 0;
+
+    rename_block(ssa, 0);
+    link_versions(ssa);
+
+    for (int v = 0; v < lv->nr_ope; v++) {
+        free(stack[v]);
+    }
+    free(stack);
+    free(top);
+    free(pushed);
+    free(created);
+    free(child);
+    free(sibling);
+    free(renamed);
+    free(nr_def_of);
+    return true;
+}
+
+
+//
+// Destruction
+//
+
+static Operand new_label()
+{
+    Operand label = new_operand(OPE_LABEL);
+    label->label_ref_cnt = 1;
+    return label;
+}
+
+
+static void insert_copies(Phi phi, int j, int pos)
+{
+    for (; phi != NULL; phi = phi->next) {
+        if (!phi->dead) {
+            insert_before(pos, IR_ASSIGN, phi->arg[j], NULL, phi->var);
+        }
+    }
+}
+
+
+//
+// The copies of the phis in block b on the edges from its predecessors.
+// The fresh variable of each phi is kept in its var field.
+//
+static void insert_edge_copies(Ssa *ssa, int b)
+{
+    Block *blk = &blk_buf[ssa->start + b];
+    assert(instr_buffer[blk->start].type == IR_LABEL);
+    Operand label = instr_buffer[blk->start].rs;
+
+    // The copies on the edge falling into the block go first, before the new blocks
+    int nr_split = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int j = 0; j < ssa->nr_pred[b]; j++) {
+            Block *pb = &blk_buf[ssa->start + ssa->pred[b][j]];
+            int last = pb->end - 1;
+            while (last > pb->start && instr_buffer[last].type == IR_NOP) {
+                last--;
+            }
+            IR *ir = &instr_buffer[last];
+            bool critical = is_branch(ir) && pb->follow != pb->branch && pb->branch == blk->index;
+
+            if (pass == 0 && !critical) {
+                int pos;
+                if (ir->type == IR_JMP || (is_branch(ir) && pb->follow == pb->branch)) {
+                    pos = last;
+                }
+                else {
+                    pos = pb->end;  // Falls into the block
+                }
+                insert_copies(ssa->phi[b], j, pos);
+            }
+            else if (pass == 1 && critical) {
+                // Jump over the new block, unless the code before it can not fall through
+                int prev = blk->start - 1;
+                while (instr_buffer[prev].type == IR_NOP) {
+                    prev--;
+                }
+                if (nr_split > 0 || (instr_buffer[prev].type != IR_JMP && instr_buffer[prev].type != IR_RET)) {
+                    insert_before(blk->start, IR_JMP, label, NULL, NULL);
+                    label->label_ref_cnt++;
+                }
+                nr_split++;
+
+                Operand split = new_label();
+                label->label_ref_cnt--;
+                ir->rd = split;
+                insert_before(blk->start, IR_LABEL, split, NULL, NULL);
+                insert_copies(ssa->phi[b], j, blk->start);
+            }
+        }
+    }
+}
+
+
+//
+// Translate the function out of SSA form, the copies are inserted by insert_pending
+//
+void leave_ssa(Ssa *ssa)
+{
+    // A block may end right after its LABEL, its phis are assigned before its own copies
+    bool *has_phi = (bool *)calloc(ssa->nr + 1, sizeof(bool));
+    for (int b = 0; ssa->ver != NULL && b < ssa->nr; b++) {
+        for (Phi phi = ssa->phi[b]; phi != NULL; phi = phi->next) {
+            if (!phi->dead) {
+                Operand p = new_operand(phi->dst->type);
+                p->size = phi->dst->size;
+                p->base_type = phi->dst->base_type;
+                p->origin = phi->var;
+                phi->var = p;
+                insert_before(blk_buf[ssa->start + b].start + 1, IR_ASSIGN, p, NULL, phi->dst);
+                has_phi[b] = true;
+            }
+        }
+    }
+    for (int b = 0; b < ssa->nr; b++) {
+        if (has_phi[b]) {
+            insert_edge_copies(ssa, b);
+        }
+    }
+    free(has_phi);
+
+    for (int b = 0; b < ssa->nr; b++) {
+        Phi phi = ssa->phi != NULL ? ssa->phi[b] : NULL;
+        while (phi != NULL) {
+            Phi next = phi->next;
+            free(phi->arg);
+            free(phi);
+            phi = next;
+        }
+        free(ssa->pred[b]);
+    }
+    for (int v = 0; v < ssa->nr_ver; v++) {
+        free(ssa->ver[v].use);
+    }
+    free(ssa->phi);
+    free(ssa->pred);
+    free(ssa->nr_pred);
+    free(ssa->idom);
+    free(ssa->ver);
+    free(rpo);
+    free(rpo_num);
+}
+
+
+
+
+//
+// Sparse optimizations
+//
+
+typedef struct {
+    int *instr;      // Copies to look at
+    int nr_instr;
+    int cap_instr;
+    Phi *phi;        // Phis to look at
+    int nr_phi;
+    int cap_phi;
+} Worklist;
+
+static void push_instr(Worklist *work, int i)
+{
+    if (work->nr_instr == work->cap_instr) {
+        work->cap_instr = work->cap_instr * 2 + 16;
+        work->instr = (int *)realloc(work->instr, sizeof(int) * work->cap_instr);
+    }
+    work->instr[work->nr_instr++] = i;
+}
+
+
+static void push_phi(Worklist *work, Phi phi)
+{
+    if (work->nr_phi == work->cap_phi) {
+        work->cap_phi = work->cap_phi * 2 + 16;
+        work->phi = (Phi *)realloc(work->phi, sizeof(Phi) * work->cap_phi);
+    }
+    work->phi[work->nr_phi++] = phi;
+}
+
+
+//
+// Read to instead of from, and look again at the copies and the phis reading it
+//
+static void replace_uses(Ssa *ssa, Operand from, Operand to, Worklist *work)
+{
+    for (int u = 0; u < ssa->ver[from->id].nr_use; u++) {
+        Use use = ssa->ver[from->id].use[u];
+        if (*use.slot != from) {
+            continue;  // Replaced before
+        }
+        *use.slot = to;
+        add_use(ssa, to, use.slot, use.instr, use.phi);
+
+        if (use.phi != NULL) {
+            push_phi(work, use.phi);
+        }
+        else if (instr_buffer[use.instr].type == IR_ASSIGN) {
+            push_instr(work, use.instr);
+        }
+    }
+}
+
+
+//
+// The value of a phi if all its arguments are the same but itself, NULL if none
+//
+static Operand same_argument(Ssa *ssa, Phi phi)
+{
+    Operand same = NULL;
+    for (int j = 0; j < ssa->nr_pred[phi->block]; j++) {
+        Operand arg = phi->arg[j];
+        if (arg == phi->dst || arg == same) {
+            continue;
+        }
+        if (same != NULL) {
+            return NULL;
+        }
+        same = arg;
+    }
+    return same;
+}
+
+
+//
+// Copy propagation, return the number of copies and phis removed
+//
+static int propagate_copies(Ssa *ssa)
+{
+    Worklist work;
+    memset(&work, 0, sizeof(work));
+
+    for (int b = 0; b < ssa->nr; b++) {
+        Block *blk = &blk_buf[ssa->start + b];
+        for (Phi phi = ssa->phi[b]; phi != NULL; phi = phi->next) {
+            push_phi(&work, phi);
+        }
+        for (int i = blk->start; i < blk->end && rpo_num[b] != -1; i++) {
+            if (instr_buffer[i].type == IR_ASSIGN) {
+                push_instr(&work, i);
+            }
+        }
+    }
+
+    int count = 0;
+    while (work.nr_instr > 0 || work.nr_phi > 0) {
+        if (work.nr_instr > 0) {
+            IR *ir = &instr_buffer[work.instr[--work.nr_instr]];
+            if (ir->type == IR_ASSIGN && ir->rd != ir->rs &&
+                    is_version(ssa, ir->rd) && is_version(ssa, ir->rs)) {
+                ir->type = IR_NOP;
+                replace_uses(ssa, ir->rd, ir->rs, &work);
+                count++;
+            }
+            continue;
+        }
+
+        Phi phi = work.phi[--work.nr_phi];
+        Operand same = phi->dead ? NULL : same_argument(ssa, phi);
+        if (same != NULL) {
+            phi->dead = true;
+            replace_uses(ssa, phi->dst, same, &work);
+            count++;
+        }
+    }
+
+    free(work.instr);
+    free(work.phi);
+    return count;
+}
+
+
+//
+// The live uses of a version, but those of a phi reading itself
+//
+static int count_uses(Ssa *ssa, Operand ope)
+{
+    Version *ver = &ssa->ver[ope->id];
+    int n = 0;
+    for (int u = 0; u < ver->nr_use; u++) {
+        Use *use = &ver->use[u];
+        if (*use->slot != ope) {
+            continue;
+        }
+        if (use->phi != NULL ? !use->phi->dead && use->phi->dst != ope :
+                instr_buffer[use->instr].type != IR_NOP) {
+            n++;
+        }
+    }
+    return n;
+}
+
+
+//
+// Dead code elimination, return the number of assignments and phis removed
+//
+static int remove_dead_values(Ssa *ssa)
+{
+    int *nr_use = (int *)malloc(sizeof(int) * (ssa->nr_ver + 1));
+    int *work = (int *)malloc(sizeof(int) * (ssa->nr_ver + 1));
+    int top = 0;
+
+    for (int v = 0; v < ssa->nr_ver; v++) {
+        nr_use[v] = count_uses(ssa, ssa->ver[v].ope);
+        if (nr_use[v] == 0) {
+            work[top++] = v;
+        }
+    }
+
+    int count = 0;
+    while (top > 0) {
+        Version *ver = &ssa->ver[work[--top]];
+        Operand *slot[MAX_USE];
+        int n = 0;
+
+        if (ver->phi != NULL && !ver->phi->dead) {
+            ver->phi->dead = true;
+            for (int j = 0; j < ssa->nr_pred[ver->phi->block]; j++) {
+                if (ver->phi->arg[j] != ver->ope) {
+                    slot[n++] = &ver->phi->arg[j];
+                }
+            }
+        }
+        else if (ver->def != -1 && instr_buffer[ver->def].type != IR_NOP &&
+                 is_pure(&instr_buffer[ver->def]) && instr_buffer[ver->def].rd == ver->ope) {
+            instr_buffer[ver->def].type = IR_NOP;
+            n = use_slots(&instr_buffer[ver->def], slot);
+        }
+        else {
+            continue;
+        }
+        count++;
+
+        for (int k = 0; k < n; k++) {
+            Operand ope = *slot[k];
+            if (is_version(ssa, ope) && --nr_use[ope->id] == 0) {
+                work[top++] = ope->id;
+            }
+        }
+    }
+
+    free(nr_use);
+    free(work);
+    return count;
+}
+
+
+//
+// Optimize a function in SSA form, then translate it back.
+// The copies are coalesced by coalesce_copies after insert_pending.
+//
+void optimize_ssa(Liveness *lv)
+{
+    Ssa ssa;
+    if (!build_ssa(&ssa, lv)) {
+        return;
+    }
+
+    int nr_phi = 0;
+    for (int b = 0; b < ssa.nr; b++) {
+        for (Phi phi = ssa.phi[b]; phi != NULL; phi = phi->next) {
+            nr_phi++;
+        }
+    }
+    int nr_copy = propagate_copies(&ssa);
+    int nr_dead = remove_dead_values(&ssa);
+
+    if (print_stats) {
+        const char *name = instr_buffer[blk_buf[lv->start].start].rs->name;
+        fprintf(stderr, "ssa: %s: %d versions, %d phis, %d copies propagated, %d dead values removed\n",
+                name, ssa.nr_ver, nr_phi, nr_copy, nr_dead);
+    }
+
+    leave_ssa(&ssa);
+}
+
+
+//
+// Coalescing
+//
+
+static int *parent;
+
+static int find(int x)
+{
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+
+
+static Operand origin_of(Operand ope)
+{
+    return ope->origin != NULL ? ope->origin : ope;
+}
+
+
+//
+// Remove the copies between versions of a variable whose live ranges do not interfere.
+// Two values interfere if one is live where the other is assigned, but at a copy between
+// them; the classes of coalesced values interfere if any of their members do.
+//
+void coalesce_copies(Liveness *lv)
+{
+    int n = lv->nr_ope;
+    int first = blk_buf[lv->start].start, last = blk_buf[lv->end - 1].end;
+    Bitset *adj = (Bitset *)malloc(sizeof(Bitset) * (n + 1));
+    for (int v = 0; v < n; v++) {
+        adj[v] = new_bitset(n);
+    }
+
+    Bitset live_now = new_bitset(n);
+    for (int b = lv->start; b < lv->end; b++) {
+        Block *blk = &blk_buf[b];
+        bs_copy(live_now, lv->out[b - lv->start]);
+
+        for (int i = blk->end - 1; i >= blk->start; i--) {
+            IR *ir = &instr_buffer[i];
+            Operand ope[MAX_USE];
+            if (get_def(ir, ope)) {
+                int d = ope[0]->id;
+                int src = ir->type == IR_ASSIGN && is_value(ir->rs) ? ir->rs->id : -1;
+                for (int l = 0; l < n; l++) {
+                    if (l != d && l != src && bs_test(live_now, l)) {
+                        bs_set(adj[d], l);
+                        bs_set(adj[l], d);
+                    }
+                }
+                bs_reset(live_now, d);
+            }
+            int nr_use = get_use(ir, ope);
+            for (int k = 0; k < nr_use; k++) {
+                bs_set(live_now, ope[k]->id);
+            }
+        }
+    }
+    free_bitset(live_now);
+
+    // A class has at most one parameter, the values live on the entry are left alone
+    parent = (int *)malloc(sizeof(int) * (n + 1));
+    bool *is_param = (bool *)calloc(n + 1, sizeof(bool));     // Assigned by a PARAM
+    bool *has_param = (bool *)calloc(n + 1, sizeof(bool));    // The class has a parameter
+    for (int v = 0; v < n; v++) {
+        parent[v] = v;
+    }
+    for (int i = first; i < last; i++) {
+        if (instr_buffer[i].type == IR_PARAM && is_value(instr_buffer[i].rs)) {
+            is_param[instr_buffer[i].rs->id] = has_param[instr_buffer[i].rs->id] = true;
+        }
+    }
+
+    int count = 0;
+    for (int i = first; i < last; i++) {
+        IR *ir = &instr_buffer[i];
+        if (ir->type != IR_ASSIGN || !is_value(ir->rs) || !is_value(ir->rd) ||
+                origin_of(ir->rs) != origin_of(ir->rd)) {
+            continue;
+        }
+        if (bs_test(lv->in[0], ir->rs->id) || bs_test(lv->in[0], ir->rd->id)) {
+            continue;
+        }
+
+        int a = find(ir->rd->id), b = find(ir->rs->id);
+        if (a == b || (has_param[a] && has_param[b])) {
+            continue;
+        }
+        bool interfere = false;
+        for (int m = 0; m < n && !interfere; m++) {
+            interfere = find(m) == b && bs_test(adj[a], m);
+        }
+        if (!interfere) {
+            parent[b] = a;
+            bs_union(adj[a], adj[b]);
+            has_param[a] = has_param[a] || has_param[b];
+            count++;
+        }
+    }
+
+    // Each class is renamed to its parameter, or else the variable itself, or else any member
+    Operand *name = (Operand *)calloc(n + 1, sizeof(Operand));
+    int *rank = (int *)calloc(n + 1, sizeof(int));
+    for (int v = 0; v < n; v++) {
+        int r = find(v);
+        Operand ope = lv->ope[v];
+        int k = is_param[v] ? 3 : ope->origin == NULL ? 2 : 1;
+        if (k > rank[r]) {
+            name[r] = ope;
+            rank[r] = k;
+        }
+    }
+    for (int i = first; i < last; i++) {
+        IR *ir = &instr_buffer[i];
+        for (int k = 0; k < NR_OPE; k++) {
+            if (is_value(ir->operand[k])) {
+                ir->operand[k] = name[find(ir->operand[k]->id)];
+            }
+        }
+        if (ir->type == IR_ASSIGN && ir->rd == ir->rs) {
+            ir->type = IR_NOP;
+        }
+    }
+
+    if (print_stats) {
+        fprintf(stderr, "ssa: %s: %d copies coalesced\n", instr_buffer[first].rs->name, count);
+    }
+
+    for (int v = 0; v < n; v++) {
+        free_bitset(adj[v]);
+    }
+    free(adj);
+    free(parent);
+    free(is_param);
+    free(has_param);
+    free(name);
+    free(rank);
+}
@@ -0,0 +1,57 @@
+//
+// Static single assignment form of a function
+//
+
+#ifndef NJU_COMPILER_2015_SSA_H
+#define NJU_COMPILER_2015_SSA_H
+
+#include "liveness.h"
+
+typedef struct Phi_ *Phi;
+
+struct Phi_ {
+    Operand var;     // The variable merged
+    Operand dst;
+    Operand *arg;    // arg[j] flows in from the j-th predecessor of the block
+    int block;
+    bool dead;
+    Phi next;
+};
+
+typedef struct {
+    Operand *slot;   // Where the version is read
+    int instr;       // The reading instruction, -1 for a phi
+    Phi phi;
+} Use;
+
+typedef struct {
+    Operand ope;
+    int def;         // The defining instruction, -1 for a phi or the function entry
+    Phi phi;         // The defining phi
+    Use *use;
+    int nr_use;
+    int cap_use;
+} Version;
+
+typedef struct {
+    int start;       // Blocks of the function are [start, start + nr)
+    int nr;
+    int **pred;      // Predecessors of each block, blocks are indexed from 0
+    int *nr_pred;
+    int *idom;       // Immediate dominator, -1 for the entry and the unreachable blocks
+    Phi *phi;        // Phis at the start of each block
+    Version *ver;    // Versions indexed by Operand::id in SSA form
+    int nr_ver;
+} Ssa;
+
+bool build_ssa(Ssa *ssa, Liveness *lv);
+
+void leave_ssa(Ssa *ssa);
+
+bool is_version(Ssa *ssa, Operand ope);
+
+void optimize_ssa(Liveness *lv);
+
+void coalesce_copies(Liveness *lv);
+
+#endif //NJU_COMPILER_2015_SSA_H
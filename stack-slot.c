@@ -0,0 +1,210 @@
+//
+// Stack slots shared by the values in memory whose lifetimes are disjoint
+//
+// in_func_check gives each value not kept in a register its own word of the frame. Two
+// values which are never live at the same time can use the same word instead, like the
+// temporaries of two statements:
+//
+//   t1 := v1 * #3                t1 -> 4($sp)
+//   v2 := t1 + #1         =>     t2 -> 4($sp)
+//   t2 := v2 * v2                v2 -> 8($sp)
+//   WRITE t2
+//
+// The slots are colored greedily over an interference graph built from the liveness like
+// the one of the register allocator: a value written interferes with all the values live
+// after it. The local allocator writes a dirty variable back at the end of the block even
+// if it is dead, so a variable is taken as live from its first assignment in a block to the
+// end of the block. A value whose address is taken keeps a slot of its own, the parameters
+// passed on the stack stay in the frame of the caller, and arrays and structures are placed
+// first as before.
+//
+// This shrinks the frames of functions with long sequences of expressions, which matters
+// for deep recursions.
+//
+
+#include "stack-slot.h"
+#include "basic-block.h"
+#include "operand.h"
+#include "option.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static int nr_value;
+static Bitset adj_set;     // nr_value * nr_value
+static bool *in_frame;     // The value has a slot in this frame
+static bool *is_private;   // The address of the value is taken
+
+
+static void add_edge(int a, int b)
+{
+    if (a != b) {
+        bs_set(adj_set, a * nr_value + b);
+        bs_set(adj_set, b * nr_value + a);
+    }
+}
+
+
+static bool is_variable(Operand ope)
+{
+    return ope->type == OPE_VAR || ope->type == OPE_BOOL;
+}
+
+
+static void build_block(Liveness *lv, int b, Bitset live)
+{
+    Block *blk = &blk_buf[b];
+    Operand ope[MAX_USE];
+
+    // The first assignment of each variable in the block, scanning forward
+    bool *first_def = (bool *)calloc(blk->end - blk->start, sizeof(bool));
+    Bitset assigned = new_bitset(nr_value);
+    for (int i = blk->start; i < blk->end; i++) {
+        int n = get_def(&instr_buffer[i], ope);
+        for (int k = 0; k < n; k++) {
+            if (is_variable(ope[k]) && !bs_test(assigned, ope[k]->id)) {
+                bs_set(assigned, ope[k]->id);
+                first_def[i - blk->start] = true;
+            }
+        }
+    }
+
+    bs_copy(live, lv->out[b - lv->start]);
+    bs_union(live, assigned);
+
+    for (int i = blk->end - 1; i >= blk->start; i--) {
+        IR *ir = &instr_buffer[i];
+        int n = get_def(ir, ope);
+        for (int k = 0; k < n; k++) {
+            int d = ope[k]->id;
+            if (!in_frame[d]) {
+                continue;
+            }
+            for (int x = 0; x < nr_value; x++) {
+                if (in_frame[x] && bs_test(live, x)) {
+                    add_edge(d, x);
+                }
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            if (!is_variable(ope[k]) || first_def[i - blk->start]) {
+                bs_reset(live, ope[k]->id);
+            }
+        }
+        n = get_use(ir, ope);
+        for (int k = 0; k < n; k++) {
+            bs_set(live, ope[k]->id);
+        }
+    }
+
+    free_bitset(assigned);
+    free(first_def);
+}
+
+
+static void build_graph(Liveness *lv)
+{
+    Bitset live = new_bitset(nr_value);
+    for (int b = lv->start; b < lv->end; b++) {
+        build_block(lv, b, live);
+    }
+    free_bitset(live);
+
+    // The values live on the entry, e.g. read before assigned, are live together
+    Bitset entry = lv->in[0];
+    for (int x = 0; x < nr_value; x++) {
+        if (!in_frame[x] || !bs_test(entry, x)) {
+            continue;
+        }
+        for (int y = x + 1; y < nr_value; y++) {
+            if (in_frame[y] && bs_test(entry, y)) {
+                add_edge(x, y);
+            }
+        }
+    }
+}
+
+
+void share_stack_slots(Liveness *lv)
+{
+    int first = blk_buf[lv->start].start, last = blk_buf[lv->end - 1].end;
+    Operand func = instr_buffer[first].rs;
+    int size_before = func->size;
+
+    nr_value = lv->nr_ope;
+    in_frame = (bool *)calloc(nr_value, sizeof(bool));
+    is_private = (bool *)calloc(nr_value, sizeof(bool));
+    for (int i = 0; i < nr_value; i++) {
+        // Parameters on the stack have addresses into the frame of the caller, see in_func_check
+        in_frame[i] = !lv->ope[i]->color && lv->ope[i]->address > 0;
+    }
+
+    // Arrays and structures first, in the order of in_func_check
+    Operand *refs = (Operand *)malloc(sizeof(Operand) * NR_OPE * (last - first));
+    int nr_ref = 0, size = 0;
+    for (int i = first; i < last; i++) {
+        IR *ir = &instr_buffer[i];
+        for (int k = 0; k < NR_OPE && ir->type != IR_FUNC; k++) {
+            Operand ope = ir->operand[k];
+            if (ope == NULL || ope->type != OPE_REF) {
+                continue;
+            }
+            int r = 0;
+            while (r < nr_ref && refs[r] != ope) {
+                r++;
+            }
+            if (r == nr_ref) {
+                refs[nr_ref++] = ope;
+                size += ope->size;
+                ope->address = size;
+            }
+        }
+        if (ir->type == IR_ADDR && is_value(ir->rs)) {
+            is_private[ir->rs->id] = true;
+        }
+    }
+    free(refs);
+
+    adj_set = new_bitset(nr_value * nr_value);
+    build_graph(lv);
+
+    // Greedy coloring in the order of the values, the slot of value i is slot[i]
+    int *slot = (int *)malloc(sizeof(int) * nr_value);
+    bool *used = (bool *)malloc(sizeof(bool) * (nr_value + 1));
+    int nr_slot = 0, nr_in_frame = 0;
+    for (int i = 0; i < nr_value; i++) {
+        slot[i] = -1;
+        if (!in_frame[i]) {
+            continue;
+        }
+        nr_in_frame++;
+        memset(used, 0, sizeof(bool) * (nr_slot + 1));
+        for (int j = 0; j < i; j++) {
+            if (slot[j] != -1 && (is_private[i] || is_private[j] || bs_test(adj_set, i * nr_value + j))) {
+                used[slot[j]] = true;
+            }
+        }
+        int s = 0;
+        while (used[s]) {
+            s++;
+        }
+        slot[i] = s;
+        if (s == nr_slot) {
+            nr_slot++;
+        }
+        lv->ope[i]->address = size + 4 * (s + 1);
+    }
+    func->size = size + 4 * nr_slot;
+
+    if (print_stats) {
+        fprintf(stderr, "frame: %s: %d -> %d bytes, %d values in %d slots\n",
+                func->name, size_before, func->size, nr_in_frame, nr_slot);
+    }
+
+    free(slot);
+    free(used);
+    free_bitset(adj_set);
+    free(in_frame);
+    free(is_private);
+}
@@ -0,0 +1,12 @@
+//
+// Stack slots shared by the values in memory whose lifetimes are disjoint
+//
+
+#ifndef NJU_COMPILER_2015_STACK_SLOT_H
+#define NJU_COMPILER_2015_STACK_SLOT_H
+
+#include "liveness.h"
+
+void share_stack_slots(Liveness *lv);
+
+#endif //NJU_COMPILER_2015_STACK_SLOT_H
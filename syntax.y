@@ -187,7 +187,7 @@ Exp             : Exp ASSIGNOP Exp { $$ = create_tree(EXP_is_ASSIGN, $2, $1, $3)
                 | Exp DOT ID       { $$ = create_tree(EXP_is_EXP_FIELD, $2, $1, $3); }
                 | LP Exp RP        { $$ = $2; }
                 | MINUS Exp        { $$ = create_tree(EXP_is_UNARY, $1.lineno, $2); $$->val.operator = $1.s;}
-                | NOT Exp          { $$ = create_tree(EXP_is_UNARY, $1.lineno, $2); $$->val.operator = $1.s;}
+                | NOT Exp          { $$ = create_tree(EXP_is_NOT, $1.lineno, $2); $$->val.operator = $1.s;}
                 | ID LP Args RP    { $$ = create_tree(EXP_is_ID_ARG, $1->lineno, $1, $3); }
                 | ID LP RP         { $$ = create_tree(EXP_is_ID_ARG, $1->lineno, $1, NULL); }
                 | ID               { $$ = create_tree(EXP_is_ID, $1->lineno, $1); }
@@ -0,0 +1,161 @@
+//
+// Tail recursion elimination
+//
+// A call of the function itself whose result is returned at once is replaced by assignments
+// to the parameters and a jump to a new LABEL after the PARAMs, so the recursion runs as a
+// loop in one frame:
+//
+//     FUNCTION gcd :                    FUNCTION gcd :
+//     PARAM v0                          PARAM v0
+//     PARAM v1                          PARAM v1
+//     ...                               LABEL L9 :
+//     ARG t5                            ...
+//     ARG v1                     =>     t10 := t5
+//     t6 := CALL gcd                    t11 := v1
+//     RETURN t6                         v0 := t11
+//                                       v1 := t10
+//                                       GOTO L9
+//
+// The arguments go through new temporaries first, since an argument may read a parameter
+// assigned before it. A function taking the address of its variables or arrays is left as it
+// is: the address passed to the recursive call would point to storage the jump reuses.
+//
+// Tail calls of other functions are left to the code generator, see gen_asm_call.
+//
+
+#include "tail-call.h"
+#include "operand.h"
+#include "option.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+
+static void emit(IR *ir)
+{
+    assert(nr_instr < MAX_LINE);
+    instr_buffer[nr_instr++] = *ir;
+}
+
+
+static int next_instr(IR buf[], int i, int end)
+{
+    do {
+        i++;
+    } while (i < end && buf[i].type == IR_NOP);
+    return i;
+}
+
+
+static bool is_self_tail_call(IR buf[], int i, int end, Operand func)
+{
+    if (buf[i].type != IR_CALL || strcmp(buf[i].rs->name, func->name)) {
+        return false;
+    }
+    int next = next_instr(buf, i, end);
+    return next < end && buf[next].type == IR_RET && buf[next].rs == buf[i].rd;
+}
+
+
+//
+// Copy the function in buf[start, end) back to the instruction buffer
+//
+static void rewrite_function(IR buf[], int start, int end)
+{
+    Operand func = buf[start].rs;
+    int body = start + 1;
+    while (body < end && buf[body].type == IR_PARAM) {
+        body++;
+    }
+    int nr_param = body - start - 1;
+
+    bool safe = true;
+    int nr_tail = 0;
+    for (int i = body; i < end; i++) {
+        if (buf[i].type == IR_ADDR || buf[i].type == IR_DEC) {
+            safe = false;
+        }
+        nr_tail += is_self_tail_call(buf, i, end, func);
+    }
+
+    if (!safe || nr_tail == 0) {
+        for (int i = start; i < end; i++) {
+            emit(&buf[i]);
+        }
+        return;
+    }
+
+    for (int i = start; i < body; i++) {
+        emit(&buf[i]);
+    }
+    Operand entry = new_operand(OPE_LABEL);
+    IR label = { .type = IR_LABEL, .rs = entry };
+    emit(&label);
+
+    Operand *tmp = (Operand *)malloc(sizeof(Operand) * (nr_param + 1));
+    for (int i = body; i < end; i++) {
+        if (!is_self_tail_call(buf, i, end, func)) {
+            emit(&buf[i]);
+            continue;
+        }
+
+        // The ARG nearest to the CALL passes the first parameter
+        int k = 0;
+        for (int j = nr_instr - 1; j > 0 && k < nr_param; j--) {
+            IR *ir = &instr_buffer[j];
+            if (ir->type == IR_CALL || ir->type == IR_FUNC) {
+                break;
+            }
+            if (ir->type == IR_ARG) {
+                tmp[k] = new_operand(OPE_TEMP);
+                ir->type = IR_ASSIGN;
+                ir->rd = tmp[k++];
+            }
+        }
+        assert(k == nr_param);
+
+        for (k = 0; k < nr_param; k++) {
+            IR assign = { .type = IR_ASSIGN, .rs = tmp[k], .rd = buf[start + 1 + k].rs };
+            emit(&assign);
+        }
+        IR jmp = { .type = IR_JMP, .rs = entry };
+        emit(&jmp);
+        entry->label_ref_cnt++;
+
+        i = next_instr(buf, i, end);  // Skip the RETURN
+    }
+    free(tmp);
+
+    if (print_stats) {
+        fprintf(stderr, "tail: %s: %d recursive calls replaced by jumps\n", func->name, nr_tail);
+    }
+}
+
+
+void eliminate_tail_recursion()
+{
+    IR *buf = (IR *)malloc(sizeof(IR) * (nr_instr + 1));
+    memcpy(buf, instr_buffer, sizeof(IR) * nr_instr);
+    int n = nr_instr;
+
+    nr_instr = 0;
+    for (int start = 0; start < n; ) {
+        int end = start + 1;
+        while (end < n && buf[end].type != IR_FUNC) {
+            end++;
+        }
+
+        if (buf[start].type == IR_FUNC) {
+            rewrite_function(buf, start, end);
+        }
+        else {
+            for (int i = start; i < end; i++) {
+                emit(&buf[i]);
+            }
+        }
+        start = end;
+    }
+
+    free(buf);
+}
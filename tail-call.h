@@ -0,0 +1,12 @@
+//
+// Tail recursion elimination
+//
+
+#ifndef NJU_COMPILER_2015_TAIL_CALL_H
+#define NJU_COMPILER_2015_TAIL_CALL_H
+
+#include "ir.h"
+
+void eliminate_tail_recursion();
+
+#endif //NJU_COMPILER_2015_TAIL_CALL_H
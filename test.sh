@@ -3,19 +3,21 @@
 TESTCASE=$(find ./test/ -name "*.cmm")
 ASM="./tmp.S"
 
-for file in $TESTCASE; do
-    echo test $file
+for opt in -O0 -O1 -O2; do
+    for file in $TESTCASE; do
+        echo test $opt $file
 
-    ./cmm $file $ASM
-    if [ $? -ne 0 ]; then
-        echo "Compilation failed."
-        continue
-    fi
+        ./cmm $opt $file $ASM
+        if [ $? -ne 0 ]; then
+            echo "Compilation failed."
+            continue
+        fi
 
-    spim -file $ASM 2> /dev/null # Only check the validation of the asm file
-    if [ $? -ne 0 ]; then
-        echo "Compilation incorrect."
-    fi
+        spim -file $ASM 2> /dev/null # Only check the validation of the asm file
+        if [ $? -ne 0 ]; then
+            echo "Compilation incorrect."
+        fi
+    done
 done
 
 rm $ASM
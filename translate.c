@@ -370,6 +370,8 @@ static void translate_unary_operation(Node exp)
 {
     Node rexp = exp->child;
     rexp->dst = new_operand(OPE_TEMP);
+    translate_dispatcher(rexp);
+    try_deref(rexp);
 
     // 常量计算
     Operand const_ope = new_operand(OPE_NOT_USED);
@@ -698,6 +700,167 @@ static void translate_cond_prepare(Node node)
 }
 
 
+//
+// 作为值的逻辑表达式
+//
+// 只用于跳转的条件始终在控制流中翻译 (translate_cond), 真正需要的值则直接用比较指令算出 0 或 1,
+// 由 slt/sltu/xori 实现, 不再生成给 OPE_BOOL 赋值的分支:
+//     x = a < b;           x := a < b
+//     x = !(a < b);        x := a >= b
+//     x = !a;              x := a == #0
+//     x = a < b && c;      t1 := a < b; t2 := c != #0; t3 := t1 + t2; x := t3 > #1
+// 与或表达式的两边都求值, 所以只在右边没有副作用且不会出错时这样做 (没有调用, 赋值, 访存和除法),
+// 否则仍按短路求值的控制流来翻译.
+//
+
+static void translate_compare(Node exp, Operand lope, Operand rope, IR_Type relop)
+{
+    if (lope->type == OPE_INTEGER && rope->type == OPE_INTEGER) {
+        Operand const_ope = new_operand(OPE_INTEGER);
+        const_ope->integer = eval_relop(relop, lope->integer, rope->integer);
+        free_ope(&exp->dst);
+        exp->dst = const_ope;
+    }
+    else {
+        new_instr(branch_to_compare(relop), lope, rope, exp->dst);
+    }
+}
+
+
+static bool is_logic(Node exp)
+{
+    return exp->tag == EXP_is_RELOP || exp->tag == EXP_is_NOT ||
+           exp->tag == EXP_is_AND || exp->tag == EXP_is_OR;
+}
+
+
+// 可以无条件地求值
+static bool is_safe(Node exp)
+{
+    switch (exp->tag) {
+        case EXP_is_INT:
+        case EXP_is_ID:
+            return typecmp(exp->sema.type, BASIC_INT);
+        case EXP_is_BINARY:
+            if (exp->val.operator[0] == '/') {
+                return false;
+            }
+            // Fall through
+        case EXP_is_RELOP:
+        case EXP_is_AND:
+        case EXP_is_OR:
+            return is_safe(exp->child) && is_safe(exp->child->sibling);
+        case EXP_is_UNARY:
+        case EXP_is_NOT:
+            return is_safe(exp->child);
+        default:
+            return false;
+    }
+}
+
+
+// 子表达式的值, 非逻辑表达式则与 0 比较得到 0 或 1
+static Operand translate_bool(Node exp)
+{
+    exp->dst = new_operand(OPE_TEMP);
+    translate_dispatcher(exp);
+    try_deref(exp);
+    if (is_logic(exp)) {
+        return exp->dst;
+    }
+
+    Operand value = exp->dst;
+    Operand const_zero = new_operand(OPE_INTEGER);
+    const_zero->integer = 0;
+    exp->dst = new_operand(OPE_TEMP);
+    translate_compare(exp, value, const_zero, IR_BNE);
+    return exp->dst;
+}
+
+
+static void translate_relop_value(Node exp)
+{
+    // 没有目标地址, 只为副作用求值
+    if (exp->dst == NULL) {
+        translate_cond_prepare(exp);
+        return;
+    }
+
+    Node left = exp->child;
+    Node right = left->sibling;
+    left->dst = new_operand(OPE_TEMP);
+    translate_dispatcher(left);
+    right->dst = new_operand(OPE_TEMP);
+    translate_dispatcher(right);
+    try_deref(left);
+    try_deref(right);
+
+    translate_compare(exp, left->dst, right->dst, get_relop(exp->val.operator));
+}
+
+
+static void translate_not_value(Node exp)
+{
+    Node sub_exp = exp->child;
+    if (exp->dst == NULL || (is_logic(sub_exp) && sub_exp->tag != EXP_is_RELOP)) {
+        translate_cond_prepare(exp);
+        return;
+    }
+
+    if (sub_exp->tag == EXP_is_RELOP) {
+        Node left = sub_exp->child;
+        Node right = left->sibling;
+        left->dst = new_operand(OPE_TEMP);
+        translate_dispatcher(left);
+        right->dst = new_operand(OPE_TEMP);
+        translate_dispatcher(right);
+        try_deref(left);
+        try_deref(right);
+
+        IR_Type relop = get_relop_anti(get_relop(sub_exp->val.operator));
+        translate_compare(exp, left->dst, right->dst, relop);
+    }
+    else {
+        sub_exp->dst = new_operand(OPE_TEMP);
+        translate_dispatcher(sub_exp);
+        try_deref(sub_exp);
+
+        Operand const_zero = new_operand(OPE_INTEGER);
+        const_zero->integer = 0;
+        translate_compare(exp, sub_exp->dst, const_zero, IR_BEQ);
+    }
+}
+
+
+static void translate_logic_value(Node exp)
+{
+    Node left = exp->child;
+    Node right = left->sibling;
+    if (exp->dst == NULL || !is_safe(right)) {
+        translate_cond_prepare(exp);
+        return;
+    }
+
+    Operand lope = translate_bool(left);
+    Operand rope = translate_bool(right);
+
+    // 两个 0 或 1 的和, 与为 2, 或不为 0
+    Operand bound = new_operand(OPE_INTEGER);
+    bound->integer = exp->tag == EXP_is_AND ? 1 : 0;
+    if (lope->type == OPE_INTEGER && rope->type == OPE_INTEGER) {
+        Operand const_ope = new_operand(OPE_INTEGER);
+        const_ope->integer = lope->integer + rope->integer > bound->integer;
+        free_ope(&exp->dst);
+        exp->dst = const_ope;
+    }
+    else {
+        Operand sum = new_operand(OPE_TEMP);
+        new_instr(IR_ADD, lope, rope, sum);
+        new_instr(IR_SGT, sum, bound, exp->dst);
+    }
+}
+
+
 /////////////////////////////////////////////////////////////////////
 //  Statements
 /////////////////////////////////////////////////////////////////////
@@ -998,9 +1161,9 @@ static trans_visitor trans_visitors[] =
     [EXP_is_ID_ARG]                = translate_call,
     [EXP_is_ASSIGN]                = translate_exp_is_assign,
     [EXP_is_EXP_IDX]               = translate_exp_is_exp_idx,
-    [EXP_is_AND]                   = translate_cond_prepare,
-    [EXP_is_OR]                    = translate_cond_prepare,
-    [EXP_is_NOT]                   = translate_cond_prepare,
-    [EXP_is_RELOP]                 = translate_cond_prepare,
+    [EXP_is_AND]                   = translate_logic_value,
+    [EXP_is_OR]                    = translate_logic_value,
+    [EXP_is_NOT]                   = translate_not_value,
+    [EXP_is_RELOP]                 = translate_relop_value,
 };
 